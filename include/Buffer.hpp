@@ -0,0 +1,77 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+#include "SharedLine.hpp"
+#include "MemoryStats.hpp"
+
+#define BUFFER_BLOCK_SIZE 4096
+
+/*
+BUFFER:
+	byte queue made of fixed-size blocks taken from a shared pool.
+	- an empty buffer owns no block at all: blocks are taken when data is
+	  appended and handed back to the pool as soon as they are drained
+	- data is appended at the tail and consumed from the head, nothing is
+	  ever shifted or copied around inside the buffer
+	- a SharedLine is queued as a small node referencing it instead of
+	  being copied, so a broadcast costs one copy of the line in total
+	- blocks and nodes are charged to the buffer's MemoryCategory
+	- the search for "\r\n" resumes where the last one stopped, so input
+	  trickling in without a line end is scanned once, not on every read
+*/
+
+struct BufferNode {
+	BufferNode			*next;
+	size_t				begin; // first unread byte
+	size_t				end; // first free byte
+	SharedLine			*shared; // referenced line, NULL for a BufferBlock
+
+	const char			*bytes(void) const;
+	void				destroy(void); // drops the reference or hands the block back
+
+	static void			*operator new(size_t);
+	static void			operator delete(void *, size_t);
+};
+
+struct BufferBlock : BufferNode {
+	char				data[BUFFER_BLOCK_SIZE];
+
+	static void			*operator new(size_t);
+	static void			operator delete(void *, size_t);
+};
+
+class Buffer {
+	private:
+		BufferNode			*_head;
+		BufferNode			*_tail;
+		size_t				_size;
+		mutable size_t		_scanned; // head bytes already searched for "\r\n" without a match
+		MemoryCategory		_category;
+
+		void				copyOut(std::string &, size_t) const;
+		size_t				findLine(void) const; // length of the first line, npos when it isn't complete
+		BufferBlock			*newTail(void);
+		void				dropHead(void);
+							Buffer(const Buffer &);
+		Buffer&				operator=(const Buffer &);
+	public:
+							Buffer(MemoryCategory);
+							~Buffer(void);
+
+		void				append(const char *, size_t);
+		void				append(std::string_view);
+		void				append(SharedLine *); // takes a reference, no copy
+		char				*claim(size_t); // room to write in place, throws past BUFFER_BLOCK_SIZE
+		size_t				size(void) const;
+		bool				empty(void) const;
+		void				clear(void);
+		void				copyTo(std::string &) const; // the whole content, left in place
+
+		size_t				peek(struct iovec *, size_t) const; // fills iovecs for writev, returns count
+		void				consume(size_t);
+
+		bool				hasLine(void) const;
+		bool				getLine(std::string &); // pops one line ended by "\r\n", without it
+};
@@ -14,6 +14,12 @@
 
 #include <string>
 #include <vector>
+#include <map>
+#include <ctime>
+#include "Serializer.hpp"
+#include "History.hpp"
+#include "Mask.hpp"
+#include "MemoryStats.hpp"
 
 /*
 CHANNEL MODES:
@@ -22,6 +28,9 @@ CHANNEL MODES:
 	- k: channel key
 	- l: limit on number of users that may join the channel
 	- o: operator
+	- b / e / I: ban, ban exception and invite exception masks, matched
+	  against nick!user@host. a banned member that is neither operator
+	  nor voiced can't speak or change nick, and nobody banned can join
 */
 
 enum ChannelMode {
@@ -34,6 +43,42 @@ enum ChannelMode {
 };
 
 
+enum MemberMode {
+	MemberOperator = 1,
+	MemberVoice = 2
+};
+
+// which server links a channel line crosses besides the local members, see Link.hpp
+enum LinkRoute {
+	LinksNone,
+	LinksAll // every link: the channel's state changed
+};
+
+enum MaskList {
+	ListBan, // b
+	ListExcept, // e: overrides b
+	ListInviteExcept, // I: joins a +i channel without an INVITE
+	MaskListCount
+};
+
+struct MaskEntry {
+	CompiledMask	mask;
+	std::string		setter;
+	time_t			time;
+
+	MaskEntry(const std::string &mask, const std::string &setter, time_t time)
+		: mask(mask), setter(setter), time(time) {}
+};
+
+// a member's ban check, good for as long as the lists are at the same generation
+struct BanVerdict {
+	unsigned long	generation;
+	bool			banned;
+};
+
+#define MASK_LIST_MAX 100 // entries per b / e / I list, advertised as MAXLIST
+#define NAMES_LINE_MAX 510 // 512 minus the "\r\n"
+
 class Server;
 
 class Channel {
@@ -41,14 +86,29 @@ class Channel {
 		std::string			_name;
 		std::string			_pass;
 		std::string			_topic;
-		std::vector<int>	_clients;
-		std::vector<int>	_operators;
-		std::vector<int>	_voiced;
+		std::vector<int>	_clients; // join order
+		std::map<int, unsigned char>_members; // fd -> MemberMode bits
+		int					_operatorCount;
+		std::string			_names; // "@op +voiced nick " kept in sync on every membership change
 		std::vector<int>	_invites;
 		int					_limit;
 		int					_mode;
+		time_t				_createdAt;
+		time_t				_topicTime;
+		ChannelHistory		_history; // for CHATHISTORY
+		std::vector<MaskEntry>	_masks[MaskListCount];
+		unsigned long		_maskGeneration; // bumped by every b / e change
+		std::map<int, BanVerdict>	_verdicts; // members only, dropped on part and nick change
+		size_t				_footprint; // charged to MemChannels, see account
 		Server				*_server;
 		Channel&			operator=(const Channel &);
+
+		std::string			namesToken(unsigned char, const std::string &) const;
+		void				replaceNamesToken(const std::string &, const std::string &);
+		void				setMemberMode(int, MemberMode, bool);
+		bool				matchesList(MaskList, const std::string &) const;
+		std::string			maskSubject(int) const; // folded "nick!user@host"
+		void				account(void); // charges the tables again after they changed
 	public:
 							Channel(void);
 							Channel(std::string name, std::string pass, Server *server);
@@ -56,6 +116,12 @@ class Channel {
 							Channel(const Channel &);
 							~Channel(void);
 
+		static void			*operator new(size_t); // channels live in a slab pool
+		static void			operator delete(void *, size_t);
+
+		void				save(Serializer &) const; // members and invites by socket, the history and the b / e / I lists
+		static Channel		*load(Deserializer &, Server *, const std::map<int, int> &); // old socket -> new socket
+
 		const std::string&	getName(void) const;
 		void 				setName(std::string);
 
@@ -65,6 +131,8 @@ class Channel {
 		void				setMode(ChannelMode, bool);
 		bool				getMode(ChannelMode) const;
 		std::string			getModeString(void) const;
+		int					getModes(void) const; // raw bits, for persisting
+		void				setModes(int);
 
 
 		int					getLimit(void) const;
@@ -72,10 +140,16 @@ class Channel {
 
 		void				setTopic(std::string);
 		const std::string&	getTopic(void) const;
+		time_t				getTopicTime(void) const;
+		time_t				getCreationTime(void) const;
+		void				setTimes(time_t, time_t); // creation and topic time of a restored channel
 
 		void				addClient(int);
 		const std::vector<int>&getClients(void) const;
-		std::string 		getclientsNicknames(void) const;
+		const std::string&	getclientsNicknames(void) const;
+		void				sendNames(int, const std::string &); // 353 lines split at 512 bytes, then 366
+		void				appendNames(std::string &, const std::string &) const; // the same lines, for a batched reply
+		void				renameClient(int, const std::string &, const std::string &);
 		int					getClientCount(void) const;
 		void				removeClient(int);
 		bool				hasClient(int) const;
@@ -88,11 +162,25 @@ class Channel {
 		void				removeInvite(int);
 		bool				hasInvite(int) const;
 
+		bool				addMask(MaskList, const std::string &, const std::string &, time_t); // false: already there or full
+		bool				removeMask(MaskList, const std::string &);
+		const std::vector<MaskEntry>&getMasks(MaskList) const;
+		void				clearMasks(void);
+		bool				isBanned(int); // matches a b and no e, cached for members
+		void				forgetVerdict(int); // the member's nick!user@host changed
+		bool				isInviteExcepted(int) const;
+
 		void				addOperator(int);
 		int					getOperatorCount(void) const;
 		void				removeOperator(int);
 		bool				isOperator(int) const;
 
-		void				broadcast(std::string);
-		void				broadcast(std::string, int); // broadcast to all except one: invoker
+		void				broadcast(const std::string &);
+		void				broadcast(const std::string &, int, LinkRoute = LinksNone); // broadcast to all except one: invoker or source link
+		void				broadcastMasked(const std::string &, const std::string &); // operators get the first line, the others the second
+		void				broadcastEvent(const std::string &, int = -1, LinkRoute = LinksAll, unsigned long = 0); // same, and kept in the history
+		void				broadcastEvent(SharedLine *, int, LinkRoute, unsigned long = 0); // a line the caller built, it keeps its reference
+		void				sendShared(SharedLine *, int, LinkRoute, unsigned long = 0); // epoch: skip members that already got it
+		const ChannelHistory&getHistory(void) const;
+		size_t				footprint(void) const; // the channel and its tables, in bytes
 };
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+class Channel;
+
+/*
+CHANNEL REGISTRY:
+	open addressing hash table (linear probing, power of two capacity,
+	kept at most half full) from RFC 1459 case-folded channel names, with
+	the leading '#' dropped, to channels.
+	- every slot caches the hash of its key, so a probe only compares
+	  strings when the hashes already agree
+	- lookups take a plain (pointer, length) view and fold characters on
+	  the fly: resolving a target never allocates
+	- erasing shifts the following entries back instead of leaving
+	  tombstones, so probe chains never grow with churn
+*/
+
+class ChannelRegistry {
+	private:
+		struct Slot {
+			size_t		hash;
+			std::string	key;
+			Channel		*channel; // NULL for an empty slot
+		};
+
+		std::vector<Slot>	_slots;
+		size_t				_count;
+
+		static size_t		hash(const char *, size_t);
+		static bool			sameKey(const std::string &, const char *, size_t);
+		static void			trim(const char *&, size_t &);
+		size_t				findSlot(const char *, size_t, size_t) const;
+		void				grow(void);
+
+							ChannelRegistry(const ChannelRegistry &);
+		ChannelRegistry&	operator=(const ChannelRegistry &);
+	public:
+							ChannelRegistry(void);
+
+		Channel				*find(const char *, size_t) const;
+		Channel				*find(const std::string &) const;
+		bool				insert(const std::string &, Channel *); // false if the name is taken
+		bool				erase(const std::string &);
+		size_t				size(void) const;
+
+		// raw slot access for iterating: empty slots hold a NULL channel
+		size_t				capacity(void) const;
+		Channel				*channelAt(size_t) const;
+		const std::string&	keyAt(size_t) const;
+		size_t				footprint(void) const; // the slots, keys within the small string buffer
+};
@@ -14,22 +14,71 @@
 
 #include <iostream>
 #include <sstream>
+#include <string_view>
 #include <vector>
+#include "Buffer.hpp"
+#include "PendingReply.hpp"
+#include "TimerWheel.hpp"
+#include "Serializer.hpp"
+
+class Channel;
+
+#define NICK_MAX_LEN 9 // enforced by NICK
+#define USER_MAX_LEN 12 // enforced by USER
+#define INPUT_LINE_MAX 512 // bytes a client may send without a line end, "\r\n" included
+#define LINK_INPUT_MAX 8192 // the same for a server link, its relayed lines carry a prefix
+
+enum ClientFlag {
+	ClientAuthenticated = 1,
+	ClientRegistered = 2,
+	ClientCapNegotiating = 4, // registration waits for CAP END
+	ClientNoImplicitNames = 8, // draft/no-implicit-names: no NAMES on JOIN
+	ClientPingSent = 16, // idle, waiting for any traffic before the ping timeout
+	ClientServerTime = 32, // server-time: replayed history carries @time
+	ClientBatch = 64, // batch: CHATHISTORY replies are wrapped in a BATCH
+	ClientMessageTags = 128, // message-tags: replayed history carries @msgid
+	ClientServerLink = 256 // the socket leads to another server, see Link.hpp
+};
+
+/*
+CLIENT LAYOUT:
+	- hot fields, touched on every message, come first and stay inline:
+	  socket, flags, the two buffer queues and the fixed-size nick / user
+	- cold fields (ip, hostname, realname, identifier) live in a separate ClientInfo
+	  that is only touched by WHO / WHOIS / prefix building
+	- buffers own no memory while nothing is pending (see Buffer.hpp)
+*/
+
+struct ClientInfo {
+	std::string				ip;
+	std::string				hostname;
+	std::string				realname;
+	std::string				identifier; // nick!user@host, rebuilt by NICK / USER
+	std::string				server; // server a remote user is on, or the peer of a link
+
+	static void				*operator new(size_t);
+	static void				operator delete(void *, size_t);
+};
 
 class Client {
 	private:
-		std::string				_ip;
 		int						_socket;
-		std::string				_hostname;
-		std::stringstream		_inboundBuffer;
-		std::stringstream		_outboundBuffer;
-
-		std::string				_nickname;
-		std::string 			_username;
-		std::string 			_realname;
-		bool					_authenticated;
-		bool					_isregistered;
-		
+		unsigned short			_flags;
+		int						_link; // socket of the server link a remote user is behind, -1 when local
+		unsigned long			_deliveryMark; // last message epoch this client got, see Server::deliverMessage
+		std::vector<Channel *>	_channels; // joined, kept by Channel::addClient / removeClient
+		char					_nickname[NICK_MAX_LEN + 1];
+		char					_username[USER_MAX_LEN + 1];
+		Buffer					_inboundBuffer;
+		Buffer					_outboundBuffer;
+		std::string				_prefix; // ":nick!user@host ", rebuilt by NICK / USER
+		PendingReply			*_pending; // reply still being produced, if any
+		unsigned long			_lastActive; // tick of the last received data
+		TimerNode				_timer; // registration deadline / idle check
+		ClientInfo				*_info;
+
+		void					updatePrefix(void);
+
 								Client(void); // can't be empty constructed or copied
 		Client&					operator=(const Client&);
 								Client(const Client&);
@@ -37,30 +86,58 @@ class Client {
 								Client(int, std::string, std::string);
 								~Client(void);
 
+		static void				*operator new(size_t); // clients live in a slab pool
+		static void				operator delete(void *, size_t);
+
+		void					save(Serializer &) const; // everything but the socket, timer and pending reply
+		static Client			*load(Deserializer &, int); // rebuilds a saved client on a new socket
+
 		int						getSocket(void) const;
-		std::string				getNetworkIdentifier(void) const;
+		const std::string&		getNetworkIdentifier(void) const;
 
-		void					appendToInboundBuffer(std::string);
+		void					appendToInboundBuffer(std::string_view);
 		bool					inboundReady(void) const;
+		bool					inboundOverflow(void) const; // more unterminated input than a line may hold
 		std::vector<std::string>getCompleteCommands(void); // splits inbound on "\r\n"s
 
-		void					newMessage(std::string);
+		void					newMessage(std::string_view);
+		void					newRawMessage(std::string_view); // already "\r\n" terminated
+		void					newSharedMessage(SharedLine *); // queued by reference
+		char					*claimOutbound(size_t); // room for a line written in place, see Reply.hpp
 		bool					outboundReady(void) const;
-		std::string				getOutboundBuffer(void);
+		size_t					getOutboundBuffer(struct iovec *, size_t) const; // iovecs for writev
 		void					advanceOutboundBuffer(size_t);
+		size_t					getOutboundSize(void) const;
+		size_t					getInboundSize(void) const; // received bytes not yet making a full line
+		PendingReply			*getPendingReply(void) const;
+		void					setPendingReply(PendingReply *); // takes ownership, drops the previous one
+		TimerNode&				getTimer(void);
+		unsigned long			getLastActive(void) const;
+		void					setLastActive(unsigned long);
 
-		const std::string&		getNickname(void) const;
-		const std::string&		getUsername(void) const;
+		const char				*getNickname(void) const;
+		const char				*getUsername(void) const;
 		const std::string&		getRealname(void) const;
 		const std::string&		getHostname(void) const;
+		const std::string&		getIp(void) const;
+		int						getLink(void) const;
+		void					setLink(int);
+		bool					markDelivered(unsigned long); // false if it already got this epoch's message
+		const std::vector<Channel *>&getChannels(void) const;
+		void					joinedChannel(Channel *);
+		void					leftChannel(Channel *);
+		const std::string&		getServer(void) const;
+		void					setServer(const std::string &);
 
 		bool					isAuthenticated(void) const;
 		bool					isRegistered(void) const;
+		bool					getFlag(ClientFlag) const;
+		void					setFlag(ClientFlag, bool);
 
-		void					setNickname(std::string);
-		void					setUsername(std::string);
+		void					setNickname(std::string_view);
+		void					setUsername(std::string_view);
 		void					setRealname(std::string);
 		void					setAuthenticated(bool authenticated = true);
 		void					setRegistered(bool isregistered = true);
-		std::string				prefix(void) const;
+		const std::string&		prefix(void) const;
 };
\ No newline at end of file
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+
+/*
+CONFIG:
+	optional "key = value" file read once at startup.
+	- blank lines and lines starting with '#' are skipped
+	- a key may repeat (exempt = ...), getAll returns every value in order
+	- a missing file leaves every setting at its default, a malformed
+	  line or an out of range number is an error
+*/
+
+class Config {
+	private:
+		std::multimap<std::string, std::string>	_values;
+		std::string								_path;
+	public:
+												Config(void);
+
+		bool									load(const std::string &path); // false when there is no such file
+		bool									has(const std::string &) const;
+		std::string								get(const std::string &, const std::string &) const; // last value, or the default
+		long									getNumber(const std::string &, long, long, long) const; // default, min, max
+		std::vector<std::string>				getAll(const std::string &) const;
+};
@@ -0,0 +1,78 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <sys/socket.h>
+
+class Config;
+
+/*
+CONNECTION THROTTLE:
+	admission control run on every accepted socket, before any Client
+	exists. one entry per source: the address itself for IPv4, the /64
+	for IPv6 (a single host usually owns a whole /64).
+	- each entry counts the live connections of its source and the
+	  connect attempts of the current rate window
+	- open addressing table (linear probing, power of two capacity, at
+	  most half full) with backward-shift erase, so an admit is O(1)
+	- each admit also visits a couple of slots and drops entries that
+	  are idle and out of their window: no periodic sweep, no growth
+	  from sources that came and went
+	- exemptions are CIDR masks from the config, evaluated once when a
+	  source gets its entry; IPv6 ones are matched against the /64
+*/
+
+enum ThrottleVerdict {
+	ThrottleAdmit,
+	ThrottleTooMany, // too many concurrent connections from the source
+	ThrottleTooFast // too many connect attempts in the window
+};
+
+struct HostKey {
+	unsigned char	bytes[16]; // IPv4 as ::ffff:a.b.c.d, IPv6 cut to its /64
+
+	static bool		fromSockaddr(const struct sockaddr *, HostKey &);
+	static bool		fromString(const std::string &, HostKey &); // numeric address
+};
+
+class ConnectionThrottle {
+	private:
+		struct Entry {
+			size_t			hash;
+			HostKey			key;
+			unsigned int	connections;
+			unsigned int	attempts; // in the window starting at windowStart
+			unsigned long	windowStart;
+			bool			used;
+			bool			exempt;
+		};
+		struct Exemption {
+			HostKey			key;
+			unsigned int	bits;
+		};
+
+		std::vector<Entry>		_entries;
+		size_t					_count;
+		size_t					_sweep; // next slot checked for a stale entry
+		std::vector<Exemption>	_exemptions;
+		unsigned int			_maxPerHost;
+		unsigned int			_maxAttempts;
+		unsigned long			_window;
+
+		static size_t			hash(const HostKey &);
+		size_t					findSlot(const HostKey &, size_t) const;
+		bool					isExempt(const HostKey &) const;
+		bool					isStale(const Entry &, unsigned long) const;
+		void					erase(size_t);
+		void					grow(void);
+		void					sweep(unsigned long);
+		Entry					&lookup(const HostKey &, unsigned long);
+	public:
+								ConnectionThrottle(void);
+
+		void					configure(const Config &); // limits and exemptions
+		ThrottleVerdict			admit(const HostKey &, unsigned long); // counts the connection when admitted
+		void					attach(const HostKey &, unsigned long); // counts an already accepted connection
+		void					release(const HostKey &);
+		size_t					size(void) const;
+};
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <stdint.h>
+#include <cstddef>
+#include "SharedLine.hpp"
+
+#define HISTORY_LINES 100 // per channel, history_lines in ircserv.conf, 0 disables
+#define HISTORY_MEMORY (16 * 1024 * 1024) // server wide, history_memory in ircserv.conf
+
+class ChannelHistory;
+
+/*
+CHANNEL HISTORY:
+	recent channel events kept for CHATHISTORY, as the very SharedLines
+	that were broadcast: keeping a line costs a reference, not a copy.
+	- each entry sits on two lists: its channel's (oldest to newest) and
+	  the server wide one (same order, across every channel)
+	- a channel over its line cap drops its own oldest entry; the server
+	  over its memory cap drops the oldest entry of any channel. both are
+	  O(1) unlinks, there is no scan and no stale bookkeeping
+	- msgids come from one server wide counter, so within a channel they
+	  grow with time and can be compared like timestamps
+*/
+
+struct HistoryEntry {
+	HistoryEntry		*prev; // channel order
+	HistoryEntry		*next;
+	HistoryEntry		*olderGlobal; // server order
+	HistoryEntry		*newerGlobal;
+	ChannelHistory		*owner;
+	SharedLine			*line;
+	uint64_t			msgid;
+	uint64_t			time; // milliseconds since the epoch
+
+	static void			*operator new(size_t); // entries live in a slab pool
+	static void			operator delete(void *, size_t);
+};
+
+class ChannelHistory {
+	private:
+		HistoryEntry			*_oldest;
+		HistoryEntry			*_newest;
+		size_t					_count;
+
+		static HistoryEntry		*_globalOldest;
+		static HistoryEntry		*_globalNewest;
+		static size_t			_bytes;
+		static size_t			_maxLines;
+		static size_t			_maxBytes;
+		static uint64_t			_nextMsgid;
+
+		void					dropOldest(void);
+		void					append(SharedLine *, uint64_t, uint64_t);
+
+								ChannelHistory(const ChannelHistory &);
+		ChannelHistory&			operator=(const ChannelHistory &);
+	public:
+								ChannelHistory(void);
+								~ChannelHistory(void);
+
+		void					record(SharedLine *, uint64_t, uint64_t); // takes a reference; msgid, time
+		void					clear(void);
+		const HistoryEntry		*oldest(void) const;
+		const HistoryEntry		*newest(void) const;
+		size_t					size(void) const;
+
+		static void				configure(size_t, size_t); // lines per channel, bytes server wide
+		static size_t			memoryUsed(void);
+		static uint64_t			nextMsgid(void);
+		static void				setNextMsgid(uint64_t);
+		static uint64_t			takeMsgid(void);
+		static uint64_t			now(void); // milliseconds since the epoch
+};
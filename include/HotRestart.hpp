@@ -0,0 +1,27 @@
+#pragma once
+
+/*
+HOT RESTART:
+	on SIGUSR2 the running server hands its sockets and state to a freshly
+	exec'd binary, so a new build is deployed without dropping anyone.
+	- the old process forks, the child execs the binary found at startup
+	  with the same arguments and HANDOFF_ENV naming its end of a socketpair
+	- the old process sends [u64 length][state] (see Server::saveState),
+	  then the listener and every client and server link socket with
+	  SCM_RIGHTS, in the order the state lists them. users behind a link
+	  and the servers it leads to come along, so neither side of the link
+	  sees a netsplit
+	- the new process rebuilds everything, answers HANDOFF_ACK and runs;
+	  only then does the old one exit. if the new one fails or stays
+	  silent, the old one kills it and keeps serving
+	- the handoff waits up to HANDOFF_DRAIN_TIMEOUT ticks for streamed
+	  replies (LIST, WHO) to finish, they can't be carried over
+*/
+
+#define HANDOFF_ENV "IRCSERV_HANDOFF_FD"
+#define HANDOFF_MAGIC 0x49524348 // "IRCH"
+#define HANDOFF_VERSION 7
+#define HANDOFF_ACK 'K'
+#define HANDOFF_ACK_TIMEOUT_MS 10000
+#define HANDOFF_DRAIN_TIMEOUT 5
+#define HANDOFF_FDS_PER_MESSAGE 64
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+#define LINK_RETRY 30 // ticks between attempts to reach a configured link that is down
+#define LINK_DESCRIPTION "ft_irc server"
+
+/*
+SERVER LINKS:
+	servers form a tree; every server knows every server, user and
+	channel of the network, and a line crosses each link once.
+	- link = <name> <host> <port> <password> [connect] in ircserv.conf
+	  allows a peer; "connect" also dials it every LINK_RETRY ticks
+	  while it is down. both sides name each other with the same password
+	- handshake: SERVER <name> <password> :<description>, sent first by
+	  the dialing side and answered by the accepting one. then each side
+	  bursts what it knows, in an order the other can apply line by line:
+	    :<uplink> SERVER <name> <hops> :<description>  servers behind us
+	    :<server> NICK <nick> <user> <host> :<realname>   every user
+	    :<server> SJOIN <ts> <channel> <+modes> [key] [limit] :[@|+]nick ...
+	    :<server> TOPIC <channel> <time> :<topic>
+	- after the burst, the links carry the same lines local members get
+	  (":nick!user@host PRIVMSG #chan :text", JOIN, PART, KICK, TOPIC,
+	  MODE, QUIT, NICK, INVITE, KILL), so a channel line is rendered once
+	  for local members and links alike. state changes cross every link;
+	  PRIVMSG / NOTICE crosses a link once, with all its targets, and
+	  only when a recipient is behind it
+	- users on other servers are Clients with pseudo sockets (-2, -3, ...)
+	  that remember the link they are behind: channels, the user index,
+	  WHO and WHOIS need no special case, and anything sent to such a
+	  client goes down its link instead
+	- SJOIN merges a channel by creation time: the older side's modes and
+	  statuses win, equal times merge. a nick on both sides of a new link
+	  is killed on both (no timestamps on nicks)
+	- a link going down is a netsplit: the servers behind it and their
+	  users quit with "<server> <peer>" and the others hear SQUIT
+*/
+
+struct LinkConfig {
+	std::string		name;
+	std::string		host;
+	std::string		port;
+	std::string		password;
+	bool			connect; // dialed by us, not only accepted
+};
+
+struct RemoteServer {
+	std::string		name;
+	std::string		uplink; // server it is linked to, towards us
+	std::string		description;
+	int				hops;
+	int				link; // our socket towards it
+};
+
+struct LinkMessage {
+	std::string					line; // as received, without "\r\n"
+	std::string					source; // prefix without ':', or the peer's name
+	std::string					command;
+	std::vector<std::string>	params; // the last one may hold spaces
+
+	bool						parse(const std::string &, const std::string &);
+	std::string					sourceNick(void) const; // source up to the '!'
+};
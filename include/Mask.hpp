@@ -0,0 +1,39 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/*
+MASKS:
+	IRC wildcard masks: '*' matches any run of characters, '?' exactly one.
+	comparisons use the RFC 1459 case mapping, where {}|^ are the lower
+	case forms of []\~.
+*/
+
+char		ircToLower(char);
+std::string	ircLower(std::string_view);
+bool		hasWildcards(std::string_view);
+bool		matchMask(std::string_view mask, std::string_view str);
+std::string	fullMask(const std::string &); // "nick" -> "nick!*@*", "user@host" -> "*!user@host"
+
+/*
+COMPILED MASK:
+	a mask split once, when it is set, into the literal runs between its
+	'*'s, already case folded. matching is then a compare at both ends
+	and a forward search for each run in between: no backtracking and no
+	folding per check. the subject has to be folded by the caller, once
+	for however many masks it is tested against.
+*/
+class CompiledMask {
+	private:
+		std::string					_mask; // as given, for the list replies
+		std::string					_head; // before the first '*', the whole mask when there is none
+		std::string					_tail; // after the last '*'
+		std::vector<std::string>	_runs; // between them, in order
+		bool						_star;
+	public:
+		CompiledMask(const std::string &);
+		const std::string&	str(void) const;
+		bool				matches(std::string_view) const; // subject folded with ircLower
+};
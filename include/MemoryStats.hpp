@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+
+#define MEMORY_BUDGET 0 // bytes, memory_budget in ircserv.conf, 0 disables it
+#define MEMORY_REFUSE_PERCENT 90 // of the budget: past it new connections are refused
+#define MEMORY_SHED_MIN 65536 // send queues shorter than this are never shed for the budget
+#define MAP_NODE_OVERHEAD (4 * sizeof(void *)) // colour, parent and children of a std::map / std::set node
+
+enum MemoryCategory {
+	MemInbound, // blocks of the inbound buffers
+	MemOutbound, // blocks of the outbound buffers and the nodes queuing shared lines
+	MemLines, // SharedLines, however many queues and histories hold them
+	MemClients, // Client and ClientInfo
+	MemChannels, // Channel and its member, invite, mask and verdict tables
+	MemTables, // server wide maps: clients, pollfds, user index, channel registry, monitor
+	MemoryCategoryCount
+};
+
+/*
+MEMORY STATS:
+	bytes held per category, charged where the memory is taken and
+	released where it is given back, with the highest total each one
+	reached since startup.
+	- buffers, lines and clients are charged per allocation; channels
+	  charge their tables again after every change to them; the server
+	  wide maps are recomputed from their sizes
+	- maps are counted as node overhead plus payload, vectors by capacity,
+	  so the figures track growth rather than match malloc to the byte
+	- objects coming from a slab pool are counted while in use, the free
+	  slots the pool keeps are not
+*/
+
+class MemoryStats {
+	private:
+		static size_t		_used[MemoryCategoryCount];
+		static size_t		_peak[MemoryCategoryCount];
+		static size_t		_total;
+		static size_t		_totalPeak;
+	public:
+		static void			charge(MemoryCategory, size_t);
+		static void			release(MemoryCategory, size_t);
+		static void			set(MemoryCategory, size_t); // a category recomputed as a whole
+		static size_t		used(MemoryCategory);
+		static size_t		peak(MemoryCategory);
+		static size_t		total(void);
+		static size_t		totalPeak(void);
+		static const char	*name(MemoryCategory); // as STATS z shows it
+};
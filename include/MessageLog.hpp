@@ -0,0 +1,128 @@
+#pragma once
+
+#include <stdint.h>
+#include <pthread.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include "SharedLine.hpp"
+
+#define LOG_SEGMENT_SIZE (16 * 1024 * 1024) // bytes, log_segment_size in ircserv.conf
+#define LOG_RETENTION (30 * 86400) // seconds, log_retention in ircserv.conf
+#define LOG_FLUSH_MS 200 // longest a record waits in memory before the writer picks it up
+#define LOG_BATCH_BYTES (256 * 1024) // queued bytes that wake the writer early
+#define LOG_INDEX_EVERY 64 // records of one channel between two index points
+#define LOG_MAGIC "IRCLOG1\n"
+
+/*
+MESSAGE LOG:
+	every channel event that goes into the history (ChannelHistory) is
+	also appended to an on-disk log in log_dir, so history outlives the
+	memory caps, the channel and the process.
+	- the log is a directory of segments, <id>.seg, each a magic followed
+	  by records: u32 size, u64 msgid, u64 time, channel (case-folded),
+	  line, in the Serializer encoding. a segment is closed once it
+	  passes log_segment_size and the next one is started
+	- the loop only encodes the record into a queue; a writer thread
+	  swaps the queue out and write()s and fdatasync()s it at least every
+	  LOG_FLUSH_MS. the loop never waits on the disk, except in flush()
+	  before a hot restart and at exit
+	- the loop owns all the bookkeeping: it decides where each record
+	  lands, so the sparse index (one point every LOG_INDEX_EVERY records
+	  of a channel, and at each segment it enters) is known without
+	  asking the writer. the writer publishes how far the files are
+	  written, and reads never go past it
+	- reads mmap the segments, start from the nearest index point and
+	  walk the records forward from there
+	- segments whose newest record is older than log_retention are
+	  dropped as new segments are started; the writer unlinks the files
+	- at startup the segments are scanned to rebuild the index, and a
+	  torn record at the end of the last one is cut off
+*/
+
+struct LoggedLine {
+	uint64_t		msgid;
+	uint64_t		time; // milliseconds since the epoch
+	std::string		line; // without "\r\n"
+};
+
+struct LogIndexPoint {
+	uint64_t		msgid;
+	uint64_t		time;
+	uint32_t		segment;
+	uint32_t		offset;
+};
+
+struct LogSegment {
+	uint32_t		id;
+	uint32_t		size; // bytes appended so far, written or not
+	uint64_t		newest; // time of the last record
+	const char		*map; // read only mapping, NULL until a read needs it
+	size_t			mapped;
+};
+
+struct LogWrite {
+	uint32_t		segment;
+	uint32_t		end; // segment size once these bytes are written
+	bool			drop; // unlink the segment instead
+	std::string		bytes;
+};
+
+struct LogChannelIndex {
+	std::vector<LogIndexPoint>	points;
+	unsigned					sinceLast; // records since the last point
+};
+
+class MessageLog {
+	private:
+		std::string								_dir;
+		size_t									_segmentSize;
+		uint64_t								_retention; // milliseconds
+		bool									_enabled;
+		uint64_t								_lastMsgid;
+		std::deque<LogSegment>					_segments; // ascending ids, the last one is appended to
+		std::map<std::string, LogChannelIndex>	_index; // by case-folded channel name
+
+		pthread_t								_writer;
+		pthread_mutex_t							_lock;
+		pthread_cond_t							_wake; // work for the writer
+		pthread_cond_t							_idle; // the writer caught up
+		std::vector<LogWrite>					_queue;
+		size_t									_queuedBytes;
+		bool									_writing;
+		bool									_stop;
+		uint32_t								_writtenSegment; // everything before this position is in the files
+		uint32_t								_writtenSize;
+
+		static void								*writerMain(void *);
+		void									writerLoop(void);
+		std::string								segmentPath(uint32_t) const;
+		void									scanSegment(uint32_t, bool);
+		void									startSegment(uint64_t);
+		void									expire(uint64_t);
+		void									queue(uint32_t, uint32_t, const std::string &, const char *, size_t);
+		void									addIndexPoint(const std::string &, uint64_t, uint64_t, uint32_t, uint32_t);
+		size_t									segmentAt(uint32_t) const;
+		uint32_t								mapSegment(size_t, uint32_t); // readable bytes, at most the size asked
+		void									scan(const std::string &, uint32_t, uint32_t, uint32_t, uint32_t,
+													bool, bool, uint64_t, size_t, std::vector<LoggedLine> &);
+
+												MessageLog(const MessageLog &);
+		MessageLog&								operator=(const MessageLog &);
+	public:
+												MessageLog(void);
+												~MessageLog(void); // flushes and stops the writer
+
+		void									open(const std::string &, size_t, uint64_t); // throws if the directory is unusable
+		bool									enabled(void) const;
+		uint64_t								nextMsgid(void) const; // one past the newest logged msgid
+		void									append(const std::string &, uint64_t, uint64_t, const SharedLine *);
+		void									flush(void); // waits until everything queued is written
+		void									close(void);
+
+		// newest limit lines of channel with msgid (or time) < mark, oldest first
+		void									before(const std::string &, bool, uint64_t, size_t, std::vector<LoggedLine> &);
+		// oldest limit lines of channel with msgid (or time) > mark
+		void									after(const std::string &, bool, uint64_t, size_t, std::vector<LoggedLine> &);
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+#define MONITOR_MAX 100 // nicks one client may watch, advertised as MONITOR=
+#define MONITOR_TOTAL_MAX 100000 // watch entries across all clients
+
+/*
+MONITOR:
+	watch lists kept both ways, keyed on the case-folded nick:
+	- nick -> watchers, so a nick coming or going is one lookup and only
+	  its watchers hear about it (730 / 731), nothing is polled
+	- watcher -> the nicks it watches, as it wrote them, for MONITOR L / S
+	  and to drop the whole list when the watcher leaves
+	a watched nick needs no client behind it: lists name nicks, not users
+*/
+
+class MonitorIndex {
+	private:
+		typedef std::map<std::string, std::string>	List; // folded -> as given
+
+		std::map<std::string, std::set<int> >	_watchers;
+		std::map<int, List>						_lists;
+		size_t									_perClient;
+		size_t									_total;
+		size_t									_size;
+
+		void					unwatch(int, const std::string &);
+	public:
+								MonitorIndex(void);
+
+		void					setLimits(size_t, size_t); // per client, across all clients
+		size_t					getLimit(void) const;
+		bool					add(int, const std::string &); // false once a limit is reached
+		void					remove(int, const std::string &);
+		void					clear(int);
+		std::vector<std::string>list(int) const;
+		const std::set<int>		*watchers(const std::string &) const; // NULL when nobody watches it
+		size_t					footprint(void) const; // estimated bytes, see MemoryStats.hpp
+};
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <ctime>
+
+/*
+MOTD:
+	message of the day read from a text file, one MOTD line per file line.
+	the file is stat'ed at most once per second and only re-read when its
+	mtime changes; when it can't be read the built-in lines are used.
+*/
+
+class Motd {
+	private:
+		std::string					_path;
+		std::vector<std::string>	_lines;
+		time_t						_mtime;
+		time_t						_lastCheck;
+		bool						_loaded;
+
+		void						loadDefault(void);
+	public:
+									Motd(const std::string &path);
+
+		bool						refresh(void); // true when the lines changed
+		const std::vector<std::string>&getLines(void) const;
+};
@@ -0,0 +1,79 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+/*
+OBJECT POOL:
+	fixed-size slab allocator for objects that are created and destroyed
+	all the time (clients, channels, buffer blocks).
+	- memory is grabbed in slabs of SlabSize slots and never given back
+	  until the pool dies, so churn recycles the same slots instead of
+	  fragmenting the heap
+	- allocate / deallocate are O(1): a pop / push on an intrusive free list
+	- slots of the same slab are contiguous, which keeps hot objects close
+	- a class's operator new takes a slot only for exactly sizeof(T), and
+	  its sized operator delete checks the same size, so anything larger
+	  (a derived class) goes to the heap and comes back to it
+*/
+
+template <typename T, size_t SlabSize = 64>
+class ObjectPool {
+	private:
+		union Slot {
+			Slot		*next; // valid only while the slot is free
+			char		storage[sizeof(T)];
+			long double	alignLongDouble;
+			long long	alignLongLong;
+			void		*alignPointer;
+		};
+
+		Slot				*_free;
+		std::vector<Slot *>	_slabs;
+		size_t				_inUse;
+
+		void				grow(void)
+		{
+			Slot *slab = static_cast<Slot *>(::operator new(sizeof(Slot) * SlabSize));
+			_slabs.push_back(slab);
+			for (size_t i = SlabSize; i > 0; --i)
+			{
+				slab[i - 1].next = _free;
+				_free = &slab[i - 1];
+			}
+		}
+
+							ObjectPool(const ObjectPool &);
+		ObjectPool&			operator=(const ObjectPool &);
+	public:
+							ObjectPool(void) : _free(NULL), _inUse(0) {}
+							~ObjectPool(void)
+		{
+			for (size_t i = 0; i < _slabs.size(); i++)
+				::operator delete(_slabs[i]);
+		}
+
+		void				*allocate(void)
+		{
+			if (!_free)
+				grow();
+			Slot *slot = _free;
+			_free = slot->next;
+			++_inUse;
+			return slot;
+		}
+
+		void				deallocate(void *ptr)
+		{
+			if (!ptr)
+				return;
+			Slot *slot = static_cast<Slot *>(ptr);
+			slot->next = _free;
+			_free = slot;
+			--_inUse;
+		}
+
+		size_t				inUse(void) const { return _inUse; }
+		size_t				capacity(void) const { return _slabs.size() * SlabSize; }
+};
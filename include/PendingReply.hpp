@@ -0,0 +1,19 @@
+#pragma once
+
+class Server;
+
+#define REPLY_LOW_WATER 4096 // resume once the send queue drained below this
+#define REPLY_HIGH_WATER 16384 // stop producing once the send queue grew past this
+
+/*
+PENDING REPLY:
+	long replies (LIST, ...) are not queued all at once: they are produced
+	in slices while the client's send queue drains, so a single command
+	can't block the loop or pile megabytes in one outbound buffer.
+*/
+
+class PendingReply {
+	public:
+		virtual			~PendingReply(void) {}
+		virtual bool	resume(Server &, int) = 0; // queues the next slice, true once finished
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include <type_traits>
+
+#define IRC_LINE_MAX 512 // with the "\r\n"
+
+/*
+NUMERIC REPLIES:
+	Server::reply formats ":<server> <code> <nick> <params...> :<text>"
+	straight into the client's outbound buffer: the length is summed from
+	the arguments first, the room is claimed in the buffer once and the
+	line is written in place, "\r\n" included. no string is built.
+	- the arguments are typed: strings of any kind and integers, which
+	  are printed without a stream
+	- <nick> is the client's own, "*" before it has one
+	- a line that would pass IRC_LINE_MAX loses the end of its text,
+	  never half of a UTF-8 character; params alone that long are cut
+*/
+
+class ReplyArg {
+	private:
+		std::string_view	_text;
+		char				_digits[24]; // an integer, right aligned
+		unsigned char		_length; // of the integer, 0 for text
+
+		void				print(unsigned long long, bool);
+	public:
+		ReplyArg(std::string_view text): _text(text), _length(0) {}
+		ReplyArg(const std::string &text): _text(text), _length(0) {}
+		ReplyArg(const char *text): _text(text), _length(0) {}
+		ReplyArg(char letter): _length(1) { _digits[sizeof(_digits) - 1] = letter; }
+		template <typename T, typename = typename std::enable_if<std::is_integral<T>::value>::type>
+		ReplyArg(T value): _length(0)
+		{
+			print(value < 0 ? 0ULL - static_cast<unsigned long long>(value) : static_cast<unsigned long long>(value), value < 0);
+		}
+
+		std::string_view	view(void) const;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <stdint.h>
+
+/*
+SERIALIZER:
+	flat binary encoding for state that has to outlive the process.
+	- integers are fixed width and big endian, strings are a 32 bit
+	  length followed by the bytes: the same data gives the same bytes
+	  on every build
+	- the reader never trusts its input: reading past the end throws
+*/
+
+class Serializer {
+	private:
+		std::string			_data;
+	public:
+		void				putU8(uint8_t);
+		void				putU16(uint16_t);
+		void				putU32(uint32_t);
+		void				putU64(uint64_t);
+		void				putString(const std::string &);
+		const std::string&	data(void) const;
+};
+
+class Deserializer {
+	private:
+		const char			*_data;
+		size_t				_size;
+		size_t				_offset;
+
+		const char			*take(size_t);
+	public:
+							Deserializer(const char *, size_t);
+
+		uint8_t				getU8(void);
+		uint16_t			getU16(void);
+		uint32_t			getU32(void);
+		uint64_t			getU64(void);
+		std::string			getString(void);
+		size_t				remaining(void) const;
+};
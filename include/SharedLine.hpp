@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <initializer_list>
+#include <cstddef>
+
+/*
+SHARED LINE:
+	an immutable, already "\r\n" terminated line rendered once and then
+	referenced by every outbound buffer that sends it and by the channel
+	history that keeps it. the bytes live right after the header, in the
+	same allocation, and go away with the last reference.
+*/
+
+class SharedLine {
+	private:
+		size_t				_refs;
+		size_t				_size;
+
+							SharedLine(size_t);
+							~SharedLine(void);
+							SharedLine(const SharedLine &);
+		SharedLine&			operator=(const SharedLine &);
+	public:
+		static SharedLine	*create(std::string_view); // appends the "\r\n", starts with one reference
+		static SharedLine	*create(std::initializer_list<std::string_view>); // the parts, joined
+
+		void				retain(void);
+		void				release(void); // frees the line with the last reference
+		const char			*data(void) const;
+		size_t				size(void) const; // with the "\r\n"
+		size_t				footprint(void) const; // bytes held, header included
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+CHANNEL SNAPSHOT:
+	channel state (name, key, topic, modes, limit, timestamps, b / e / I
+	lists) saved to
+	disk so a restarted server comes back with its channels. members are
+	not part of it: they reconnect on their own.
+	- the file is laid out to be mmap'ed and used in place: a header, an
+	  array of fixed-size records, then a pool of the strings the records
+	  point into. loading is one pass over the records, nothing is parsed
+	- native byte order and alignment; the header carries a byte order
+	  mark, a version and a checksum, and a file that fails any of them
+	  is ignored rather than half loaded
+	- written every snapshot_interval seconds by a forked child, so the
+	  loop never waits on the disk,
+	  and synchronously on SIGINT / SIGTERM. both write a temporary file
+	  and rename it over the old one: a crash never leaves a torn file
+	- the image is built in the loop and the child only makes system
+	  calls: the message log's writer thread may hold the malloc lock at
+	  the moment of the fork, and the child would wait on it forever
+	- restored channels nobody joined within SNAPSHOT_RESTORE_GRACE are
+	  dropped: a +i one has no operator left to invite anyone in, and
+	  would otherwise hold its name forever
+*/
+
+#define SNAPSHOT_FILE "ircserv.snapshot" // snapshot_file in ircserv.conf
+#define SNAPSHOT_INTERVAL 300 // seconds, snapshot_interval in ircserv.conf, 0 disables
+#define SNAPSHOT_RESTORE_GRACE 600 // seconds a restored channel waits for its first member
+#define SNAPSHOT_MAGIC "IRCSNAP"
+#define SNAPSHOT_VERSION 2
+#define SNAPSHOT_BYTE_ORDER 0x01020304
+
+struct SnapshotHeader {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	byteOrder;
+	uint32_t	count; // records following the header
+	uint32_t	checksum; // FNV-1a of everything after the header
+	uint64_t	stringsOffset; // from the start of the file
+	uint64_t	size; // whole file
+};
+
+struct SnapshotString {
+	uint32_t	offset; // into the string pool
+	uint32_t	length;
+};
+
+struct SnapshotRecord {
+	int64_t			createdAt;
+	int64_t			topicTime;
+	uint32_t		modes; // Channel mode bits
+	int32_t			limit;
+	SnapshotString	name;
+	SnapshotString	key;
+	SnapshotString	topic;
+	SnapshotString	masks; // "<b|e|I> <mask> <setter> <time>\n" per entry; keeps the record a multiple of 8 bytes
+};
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <cstddef>
+
+/*
+TIMER WHEEL:
+	hierarchical timing wheel (4 levels of 64 slots, one tick per second)
+	for per-connection deadlines.
+	- timers are intrusive nodes living inside their owner, so arming,
+	  re-arming and cancelling are O(1) list splices and allocate nothing
+	- level n holds timers due within 64^(n + 1) ticks; a slot of level n
+	  is spread over the level below each time the lower level wraps, so
+	  every timer is moved at most 3 times before it fires
+	- a node unlinks itself when destroyed, so freeing the owner is enough
+	  to cancel its timer, even after it fired and waits in the expired list
+*/
+
+struct TimerNode {
+	TimerNode		*prev;
+	TimerNode		*next;
+	unsigned long	expires; // tick it fires at
+	int				owner; // socket of the client it belongs to
+
+					TimerNode(void);
+					~TimerNode(void);
+	bool			pending(void) const;
+	void			unlink(void);
+
+	private:
+					TimerNode(const TimerNode &);
+	TimerNode&		operator=(const TimerNode &);
+};
+
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4
+
+class TimerWheel {
+	private:
+		TimerNode			_slots[TIMER_LEVELS][TIMER_SLOTS]; // list heads
+		TimerNode			_expired; // fired, not yet handed out
+		unsigned long		_now; // last tick processed
+
+		void				place(TimerNode &);
+		void				cascade(int);
+
+							TimerWheel(const TimerWheel &);
+		TimerWheel&			operator=(const TimerWheel &);
+	public:
+							TimerWheel(void);
+
+		void				start(unsigned long); // sets the current tick
+		void				schedule(TimerNode &, unsigned long); // (re)arms the node for a tick
+		void				cancel(TimerNode &);
+		void				advance(unsigned long); // fires everything due up to that tick
+		TimerNode			*popExpired(void); // next fired node, NULL when done
+		long				ticksUntilNext(void) const; // -1 when nothing is armed
+		unsigned long		now(void) const;
+};
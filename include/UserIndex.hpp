@@ -0,0 +1,48 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+
+/*
+USER INDEX:
+	ordered indexes over the case-folded nick, username and hostname of
+	every client, so lookups and WHO masks don't have to scan all clients.
+	- a sorted map doubles as a prefix tree: every key starting with "ab"
+	  sits in [lower_bound("ab"), lower_bound("ac"))
+	- hosts are bucketed (host -> fds) both as is and reversed, so that
+	  "10.0.*" and "*.example.com" both become prefix ranges
+	- a mask is answered from the index where its literal part is the
+	  longest, and every candidate is then checked against the full mask
+*/
+
+class UserIndex {
+	private:
+		typedef std::map<std::string, std::set<int> >	Buckets;
+
+		std::map<std::string, int>	_nicknames;
+		Buckets						_usernames;
+		Buckets						_hosts;
+		Buckets						_reversedHosts;
+		size_t						_hosted; // clients in _hosts, each sits in up to three buckets
+
+		static void					addTo(Buckets &, const std::string &, int);
+		static bool					removeFrom(Buckets &, const std::string &, int); // false if fd wasn't under key
+		static void					collectRange(const Buckets &, const std::string &, std::set<int> &, size_t);
+		void						collectNicknames(const std::string &, std::set<int> &, size_t) const;
+	public:
+									UserIndex(void);
+
+		int							findNickname(const std::string &) const; // fd, or -1
+		void						setNickname(int, const std::string &, const std::string &);
+		void						setUsername(int, const std::string &, const std::string &);
+		void						addHost(int, const std::string &);
+		void						removeClient(int, const std::string &, const std::string &, const std::string &);
+
+		// up to <cap> fds that may match nick!user@host masks; false when the mask has no
+		// literal part an index can use and the caller has to scan everyone
+		bool						candidates(const std::string &, const std::string &, const std::string &,
+										std::set<int> &, size_t) const;
+		size_t						footprint(void) const; // estimated bytes, see MemoryStats.hpp
+};
@@ -15,8 +15,10 @@
 
 #include <iostream>     // For input/output operations
 #include <string>       // For string manipulation
+#include <string_view>
 #include <vector>       // For dynamic arrays
 #include <map>          // For key-value pairs
+#include <set>
 #include <sys/types.h>  // For system data types
 #include <sys/socket.h> // For socket operations
 #include <netinet/in.h> // For internet address family
@@ -24,73 +26,243 @@
 #include <unistd.h>     // For POSIX API
 #include <fcntl.h>      // For file control operations
 #include <poll.h>       // For polling file descriptors
+#include <sys/uio.h>    // For writev
 #include <csignal>
+#include <cstring>
+#include <cerrno>
+#include <cstdlib>
+#include <algorithm>
+#include <ctime>
 
 #include "../include/Client.hpp"
+#include "../include/Motd.hpp"
+#include "../include/UserIndex.hpp"
+#include "../include/ChannelRegistry.hpp"
+#include "../include/TimerWheel.hpp"
+#include "../include/Config.hpp"
+#include "../include/ConnectionThrottle.hpp"
+#include "../include/MessageLog.hpp"
+#include "../include/Link.hpp"
+#include "../include/Monitor.hpp"
+#include "../include/Reply.hpp"
+#include "../include/MemoryStats.hpp"
 
 class Channel;
 
+struct ChannelListEntry {
+	std::string	key; // case-folded name, the list is sorted on it
+	std::string	name;
+	std::string	topic; // the 322 trailing text, cut by reply() like any other
+	Channel		*channel;
+	int			users;
+	time_t		createdAt;
+	time_t		topicTime;
+	bool		secret;
+};
+
 #define CMD_BLUE "\033[0;34m"
 #define CMD_GREEN "\033[0;32m"
 #define CMD_RED "\033[0;31m"
 #define CMD_YELLOW "\033[0;33m"
 #define CMD_RESET "\033[0m"
 
+#define SERVER_NAME "ircserv"
+#define MOTD_FILE "ircserv.motd"
+#define CONFIG_FILE "ircserv.conf" // optional, see Config.hpp
+#define WHO_MAX_RESULTS 200 // matches returned by one WHO mask search
+#define WHO_MAX_SCAN 5000 // candidates taken from the user index per WHO
+#define CHATHISTORY_MAX 100 // lines one CHATHISTORY may return, advertised in 005
+#define MODES_MAX 4 // mode changes with a parameter per MODE, advertised as MODES=
+#define MESSAGE_TARGETS_MAX 20 // comma separated PRIVMSG / NOTICE targets, advertised as TARGMAX
+#define WHITESPACE " \t\n\v\f\r" // what std::ws skips
+#define TIMER_TICK_MS 1000 // resolution of the timer wheel
+#define REGISTRATION_TIMEOUT 30 // ticks between accept and a finished registration
+#define PING_INTERVAL 120 // idle ticks before the server PINGs a client
+#define PING_TIMEOUT 60 // ticks a PINGed client has to send anything back
+
 class Server
 {
 	private:
 		int _server_fd;
 		int _port;
 		std::string _password;
+		Config _config;
+		ConnectionThrottle _throttle; // per source admission, checked before a Client exists
+		std::string _serverName; // SERVER_NAME unless server_name is configured
+		std::string _prefix; // ":ircserv ", prepended to every numeric
 		std::vector<struct pollfd> _pollfds;
+		std::vector<int> _pollIndex; // fd -> its slot in _pollfds, -1 when it is not polled
 		std::map<int, Client*> _clients;
-		std::map<std::string, Channel *>		_channels;
+		UserIndex _userIndex; // nick / user / host indexes over _clients
+		MonitorIndex _monitor; // MONITOR watch lists, see Monitor.hpp
+		ChannelRegistry						_channels;
 
-		typedef void (Server::*commandHandler)(int, std::string);
+		typedef void (Server::*commandHandler)(int, const std::string &);
 		std::map<std::string, commandHandler>	_commandHandlers;
 
+		Motd						_motd;
+		std::vector<std::string>	_welcomeTemplate; // registration burst, split where the nickname goes
+		size_t						_welcomeSize;
+
+		std::vector<ChannelListEntry>	_channelList; // rendered LIST, sorted by key
+		bool							_channelListDirty;
+		unsigned long					_channelListGeneration;
+
+		TimerWheel						_timers; // one timer per client, see TimerWheel.hpp
+
+		std::string						_executable; // what a hot restart execs, see HotRestart.hpp
+		std::vector<std::string>		_arguments;
+		bool							_restartPending;
+		unsigned long					_restartRequestedAt;
+		static volatile sig_atomic_t	_restartSignal;
+
+		std::string						_snapshotPath; // see Snapshot.hpp
+		unsigned long					_snapshotInterval;
+		pid_t							_snapshotPid; // child writing a snapshot, -1 when none
+		TimerNode						_snapshotTimer;
+		TimerNode						_restoreTimer; // drops the restored channels still empty
+		static volatile sig_atomic_t	_shutdownSignal;
+
+		MessageLog						_log; // on-disk channel history, see MessageLog.hpp
+		unsigned long					_historyBatches; // CHATHISTORY batch references handed out, kept across a hot restart
+		unsigned long					_deliveryEpoch; // one per PRIVMSG / NOTICE / QUIT / NICK fan-out, see deliverMessage
+		size_t							_memoryBudget; // bytes, 0 for none, see MemoryStats.hpp
+
+		std::vector<LinkConfig>			_linkConfig; // see Link.hpp
+		std::vector<int>				_links; // sockets of the established links
+		std::map<std::string, RemoteServer>	_servers; // every other server of the network
+		int								_nextRemoteId; // remote users get -2, -3, ...
+		TimerNode						_linkTimer;
+
+		typedef void (Server::*linkHandler)(int, const LinkMessage &);
+		std::map<std::string, linkHandler>	_linkHandlers;
+
 		void init_server();
 		void handleNewConnection();
 		void handleClientMessage(int client_fd);
 		void writeToClient(int);
+		int pollTimeout(void) const;
+		void expireTimers(void);
+		void clientTimerExpired(int);
 		void _initCommandHandlers(void);
+		bool checkHotRestart(void);
+		bool hotRestart(void);
+		void saveState(Serializer &, std::vector<int> &);
+		void restoreState(Deserializer &, const std::vector<int> &);
+		void adoptState(int);
+		std::string snapshotImage(void) const;
+		static bool writeSnapshotImage(const char *, const char *, const std::string &);
+		bool writeSnapshot(const std::string &) const;
+		void loadSnapshot(void);
+		void dropEmptyRestoredChannels(void);
+		void startSnapshot(void);
+		void reapSnapshot(bool);
+		void saveOnShutdown(void);
+		void renderWelcomeTemplate(void);
+		void accountTables(void);
+		bool overMemoryThreshold(void) const; // new connections get refused
+		void enforceMemoryBudget(void);
+		void writeReply(int, int, std::initializer_list<ReplyArg>, const std::string_view *);
+		void relayMessage(int, const std::string &, const std::string &);
+		void notifyWatchers(const std::string &, const std::string &);
+		void leaveChannel(int, Channel &, const std::string &);
+		void deliverMessage(const std::string &, const std::string &, const std::vector<std::string> &,
+			std::string_view, int);
+
+		void _initLinkHandlers(void);
+		void loadLinkConfig(void);
+		void connectLinks(void);
+		void linkHandshake(int, const std::vector<std::string> &);
+		void sendBurst(int);
+		std::string modeParams(Channel &) const;
+		size_t applyModes(Channel &, const std::vector<std::string> &, size_t, const std::string &); // last: who set b / e / I
+		void sendMaskBurst(int, Channel &);
+		void receiveFromLink(int, const std::string &);
+		int linkUser(int, const LinkMessage &);
+		void removeRemoteUser(int, const std::string &);
+		void closeLink(int, const std::string &);
+		void dropServers(const std::set<std::string> &, const std::string &);
+		void linkServer(int, const LinkMessage &);
+		void linkNick(int, const LinkMessage &);
+		void linkSjoin(int, const LinkMessage &);
+		void linkTopic(int, const LinkMessage &);
+		void linkJoin(int, const LinkMessage &);
+		void linkPart(int, const LinkMessage &);
+		void linkKick(int, const LinkMessage &);
+		void linkMode(int, const LinkMessage &);
+		void linkPrivmsg(int, const LinkMessage &);
+		void linkInvite(int, const LinkMessage &);
+		void linkQuit(int, const LinkMessage &);
+		void linkKill(int, const LinkMessage &);
+		void linkSquit(int, const LinkMessage &);
+		void linkPing(int, const LinkMessage &);
+		void linkPong(int, const LinkMessage &);
+		void linkError(int, const LinkMessage &);
 
 	public:
-		Server(int port, const std::string &password);
+		Server(int port, const std::string &password, int handoff = -1); // handoff: socket from the process being replaced
 		~Server();
-		void run();
-		Client&		getClient(int); // by fd
-		Client&		getClient(std::string); // by nickname
+		void run(); // returns on SIGINT / SIGTERM or once a hot restart handed everything over
+		void enableHotRestart(char **argv);
+		static void requestHotRestart(int); // SIGUSR2 handler
+		static void requestShutdown(int); // SIGINT / SIGTERM handler
+		Client*		findClient(int); // by fd, NULL when there is none
+		Client*		findClient(const std::string &); // by nickname, NULL when nobody has it
+		Client&		getClient(int); // by fd, throws when there is none
+		bool		hasClient(int) const;
 		pollfd& 	getPollfd(int socket);
+		void		addPollfd(int socket, short events);
+		void		removePollfd(int socket);
 		void		removeClient(int);
+		void		disconnectClient(int, const std::string &); // ERROR + QUIT, for server side closes
 
-		void		processCommands(std::vector<std::string> commands, int client_fd);
-		std::string prefix(void);
+		void		processCommands(std::vector<std::string> commands, int client_fd); // takes the lines over
+		const std::string& prefix(void) const;
 		void		sendMessageToClient(int client_fd, const std::string &message);
+		void		sendRawToClient(int client_fd, const std::string &data); // data holds whole "\r\n" lines
+		void		sendSharedToClient(int client_fd, SharedLine *line); // queued by reference, see SharedLine.hpp
+		void		reply(int, int, std::initializer_list<ReplyArg>); // a numeric, see Reply.hpp
+		void		reply(int, int, std::initializer_list<ReplyArg>, std::string_view); // with its trailing text
+		MessageLog&	getMessageLog(void);
+		const std::string& getServerName(void) const;
+		void		propagate(const std::string &, int); // to every link but one
+		void		propagateShared(SharedLine *, int);
 
-		void		createChannel(std::string, std::string, std::string = "No topic"); // "No topic
-		Channel&	getChannel(std::string);
+		Channel&	createChannel(const std::string &, std::string, std::string = "No topic"); // throws if it exists
+		Channel*	findChannel(const std::string &); // NULL when there is none
+		void		removeChannelIfEmpty(Channel &); // tears down channels nobody is in
+		void		invalidateChannelList(void);
+		const std::vector<ChannelListEntry>& getChannelList(void); // re-rendered only after a change
+		unsigned long getChannelListGeneration(void) const;
+		void		resumePendingReply(int);
 		std::vector<Channel *> getClientChannels(int);
-		void		sendMessageToClientChannels(int, std::string);
+		void		sendMessageToClientChannels(int, const std::string &); // once per neighbour, however many channels are shared
 		
 		void		registerNewClient(int);
-		void		PASS(int, std::string);
-		void		NICK(int, std::string);
-		void		USER(int, std::string);
-		void		PING(int, std::string);
-		void		LIST(int, std::string);
-		void		JOIN(int, std::string);
-		void		PART(int, std::string);
-		void		WHO(int, std::string);
-		void		WHOIS(int, std::string);
-		void		PRIVMSG(int, std::string);
-		void		QUIT(int, std::string);
-		void		KICK(int, std::string);
-		void		TOPIC(int, std::string);
-		void		INVITE(int, std::string);
-		void		NOTICE(int, std::string);
-		void		ISON(int, std::string);
-		void		MODE(int, std::string);
+		void		PASS(int, const std::string &);
+		void		NICK(int, const std::string &);
+		void		USER(int, const std::string &);
+		void		PING(int, const std::string &);
+		void		PONG(int, const std::string &);
+		void		LIST(int, const std::string &);
+		void		JOIN(int, const std::string &);
+		void		PART(int, const std::string &);
+		void		WHO(int, const std::string &);
+		void		WHOIS(int, const std::string &);
+		void		PRIVMSG(int, const std::string &);
+		void		QUIT(int, const std::string &);
+		void		KICK(int, const std::string &);
+		void		TOPIC(int, const std::string &);
+		void		INVITE(int, const std::string &);
+		void		NOTICE(int, const std::string &);
+		void		ISON(int, const std::string &);
+		void		MODE(int, const std::string &);
+		void		NAMES(int, const std::string &);
+		void		CAP(int, const std::string &);
+		void		CHATHISTORY(int, const std::string &);
+		void		MONITOR(int, const std::string &);
+		void		STATS(int, const std::string &);
+		void		SERVER(int, const std::string &);
 };
 
 
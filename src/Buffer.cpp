@@ -0,0 +1,240 @@
+#include "../include/Buffer.hpp"
+#include "../include/ObjectPool.hpp"
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+static ObjectPool<BufferBlock, 32>& blockPool(void)
+{
+	static ObjectPool<BufferBlock, 32> pool;
+	return pool;
+}
+
+void *BufferBlock::operator new(size_t size)
+{
+	if (size != sizeof(BufferBlock))
+		return ::operator new(size);
+	return blockPool().allocate();
+}
+
+void BufferBlock::operator delete(void *ptr, size_t size)
+{
+	if (size != sizeof(BufferBlock))
+		return ::operator delete(ptr);
+	blockPool().deallocate(ptr);
+}
+
+static ObjectPool<BufferNode>& nodePool(void)
+{
+	static ObjectPool<BufferNode> pool;
+	return pool;
+}
+
+void *BufferNode::operator new(size_t size)
+{
+	if (size != sizeof(BufferNode))
+		return ::operator new(size);
+	return nodePool().allocate();
+}
+
+void BufferNode::operator delete(void *ptr, size_t size)
+{
+	if (size != sizeof(BufferNode))
+		return ::operator delete(ptr);
+	nodePool().deallocate(ptr);
+}
+
+const char *BufferNode::bytes(void) const {
+	if (shared)
+		return shared->data();
+	return static_cast<const BufferBlock *>(this)->data;
+}
+
+void BufferNode::destroy(void) {
+	if (shared) {
+		shared->release();
+		delete this;
+	}
+	else
+		delete static_cast<BufferBlock *>(this);
+}
+
+Buffer::Buffer(MemoryCategory category)
+:_head(NULL),_tail(NULL),_size(0),_scanned(0),_category(category)
+{}
+
+Buffer::Buffer(const Buffer &){}
+
+Buffer& Buffer::operator=(const Buffer &){return *this;}
+
+Buffer::~Buffer(void) {
+	clear();
+}
+
+void Buffer::clear(void) {
+	while (_head)
+		dropHead();
+	_tail = NULL;
+	_size = 0;
+	_scanned = 0;
+}
+
+void Buffer::dropHead(void) {
+	BufferNode *next = _head->next;
+	MemoryStats::release(_category, _head->shared ? sizeof(BufferNode) : sizeof(BufferBlock));
+	_head->destroy();
+	_head = next;
+}
+
+size_t Buffer::size(void) const {
+	return _size;
+}
+
+bool Buffer::empty(void) const {
+	return _size == 0;
+}
+
+BufferBlock *Buffer::newTail(void) {
+	BufferBlock *block = new BufferBlock;
+	MemoryStats::charge(_category, sizeof(BufferBlock));
+	block->next = NULL;
+	block->begin = 0;
+	block->end = 0;
+	block->shared = NULL;
+	if (_tail)
+		_tail->next = block;
+	else
+		_head = block;
+	_tail = block;
+	return block;
+}
+
+void Buffer::append(const char *data, size_t len) {
+	while (len > 0) {
+		if (!_tail || _tail->shared || _tail->end == BUFFER_BLOCK_SIZE)
+			newTail();
+		BufferBlock *tail = static_cast<BufferBlock *>(_tail);
+		size_t chunk = std::min(len, BUFFER_BLOCK_SIZE - tail->end);
+		std::memcpy(tail->data + tail->end, data, chunk);
+		tail->end += chunk;
+		_size += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+void Buffer::append(std::string_view data) {
+	append(data.data(), data.size());
+}
+
+/*
+	len contiguous bytes at the tail, counted as queued right away: the
+	caller fills them before anything reads the buffer. what is left of
+	a tail block too short for them stays unused.
+*/
+char *Buffer::claim(size_t len) {
+	if (len > BUFFER_BLOCK_SIZE)
+		throw std::runtime_error("Buffer::claim: more than a block");
+	if (!_tail || _tail->shared || BUFFER_BLOCK_SIZE - _tail->end < len)
+		newTail();
+	BufferBlock *tail = static_cast<BufferBlock *>(_tail);
+	char *space = tail->data + tail->end;
+	tail->end += len;
+	_size += len;
+	return space;
+}
+
+void Buffer::append(SharedLine *line) {
+	BufferNode *node = new BufferNode;
+	MemoryStats::charge(_category, sizeof(BufferNode));
+	line->retain();
+	node->next = NULL;
+	node->begin = 0;
+	node->end = line->size();
+	node->shared = line;
+	if (_tail)
+		_tail->next = node;
+	else
+		_head = node;
+	_tail = node;
+	_size += node->end;
+}
+
+size_t Buffer::peek(struct iovec *iov, size_t count) const {
+	size_t i = 0;
+	for (BufferNode *block = _head; block && i < count; block = block->next, i++) {
+		iov[i].iov_base = const_cast<char *>(block->bytes() + block->begin);
+		iov[i].iov_len = block->end - block->begin;
+	}
+	return i;
+}
+
+void Buffer::consume(size_t bytes) {
+	_scanned = bytes < _scanned ? _scanned - bytes : 0;
+	while (bytes > 0 && _head) {
+		size_t chunk = std::min(bytes, _head->end - _head->begin);
+		_head->begin += chunk;
+		_size -= chunk;
+		bytes -= chunk;
+		if (_head->begin == _head->end)
+			dropHead();
+	}
+	if (!_head)
+		_tail = NULL;
+}
+
+void Buffer::copyOut(std::string &out, size_t len) const {
+	out.clear();
+	out.reserve(len);
+	for (BufferNode *block = _head; block && len > 0; block = block->next) {
+		size_t chunk = std::min(len, block->end - block->begin);
+		out.append(block->bytes() + block->begin, chunk);
+		len -= chunk;
+	}
+}
+
+void Buffer::copyTo(std::string &out) const {
+	copyOut(out, _size);
+}
+
+/*
+	picks the search up one byte before where it stopped, so a "\r" that
+	ended the previous read still pairs with the "\n" starting this one.
+	whole blocks before that point are skipped by their length.
+*/
+size_t Buffer::findLine(void) const {
+	size_t pos = _scanned ? _scanned - 1 : 0;
+	size_t skipped = 0;
+	BufferNode *block = _head;
+	while (block && skipped + (block->end - block->begin) <= pos) {
+		skipped += block->end - block->begin;
+		block = block->next;
+	}
+	char prev = 0;
+	for (; block; block = block->next) {
+		const char *bytes = block->bytes();
+		for (size_t i = block->begin + (pos - skipped); i < block->end; i++, pos++) {
+			if (prev == '\r' && bytes[i] == '\n') {
+				_scanned = pos - 1;
+				return pos - 1;
+			}
+			prev = bytes[i];
+		}
+		skipped = pos;
+	}
+	_scanned = _size;
+	return std::string::npos;
+}
+
+bool Buffer::hasLine(void) const {
+	return findLine() != std::string::npos;
+}
+
+bool Buffer::getLine(std::string &line) {
+	size_t length = findLine();
+	if (length == std::string::npos)
+		return false;
+	copyOut(line, length);
+	consume(length + 2);
+	return true;
+}
@@ -14,27 +14,145 @@
 #include "../include/Channel.hpp"
 #include "../include/server.hpp"
 #include "../include/Client.hpp"
+#include "../include/ObjectPool.hpp"
+#include <algorithm>
+
+static ObjectPool<Channel>& channelPool(void)
+{
+	static ObjectPool<Channel> pool;
+	return pool;
+}
+
+void *Channel::operator new(size_t size)
+{
+	if (size != sizeof(Channel))
+		return ::operator new(size);
+	return channelPool().allocate();
+}
+
+void Channel::operator delete(void *ptr, size_t size)
+{
+	if (size != sizeof(Channel))
+		return ::operator delete(ptr);
+	channelPool().deallocate(ptr);
+}
 
 Channel::Channel(void)
-:_name(""),_pass(""),_limit(0),_mode(0),_server(NULL)
-{}
+:_name(""),_pass(""),_operatorCount(0),_limit(0),_mode(0),_createdAt(time(NULL)),_topicTime(0),_maskGeneration(0),_footprint(0),_server(NULL)
+{
+	account();
+}
 
 Channel::Channel(std::string name, std::string pass, Server *server)
-:_name(name),_pass(pass), _limit(0), _mode(0),_server(server)
+:_name(std::move(name)),_pass(std::move(pass)),_operatorCount(0), _limit(0), _mode(0),_createdAt(time(NULL)),_topicTime(0),_maskGeneration(0),_footprint(0),_server(server)
 {
 	if (!_pass.empty())
 		setMode(ChannelKey, true);
 	if (_name[0] != '#')
 		_name = "#" + _name;
+	account();
 }
 
 
-Channel::Channel(const Channel &){}
+Channel::Channel(const Channel &)
+:_footprint(0)
+{}
 
-Channel::~Channel(void) {}
+Channel::~Channel(void) {
+	MemoryStats::release(MemChannels, _footprint);
+	for (size_t i = 0; _server && i < _clients.size(); i++)
+		if (Client *client = _server->findClient(_clients[i]))
+			client->leftChannel(this);
+}
 
 Channel& Channel::operator=(const Channel &){return *this;}
 
+void Channel::save(Serializer &out) const {
+	out.putString(_name);
+	out.putString(_pass);
+	out.putString(_topic);
+	out.putU64(_topicTime);
+	out.putU64(_createdAt);
+	out.putU32(_mode);
+	out.putU32(_limit);
+	out.putU32(_clients.size());
+	for (size_t i = 0; i < _clients.size(); i++) {
+		out.putU32(_clients[i]);
+		out.putU8(_members.find(_clients[i])->second);
+	}
+	out.putU32(_invites.size());
+	for (size_t i = 0; i < _invites.size(); i++)
+		out.putU32(_invites[i]);
+	out.putU32(_history.size());
+	for (const HistoryEntry *entry = _history.oldest(); entry; entry = entry->next) {
+		out.putU64(entry->msgid);
+		out.putU64(entry->time);
+		out.putString(std::string(entry->line->data(), entry->line->size() - 2));
+	}
+	for (int list = 0; list < MaskListCount; list++) {
+		out.putU32(_masks[list].size());
+		for (size_t i = 0; i < _masks[list].size(); i++) {
+			out.putString(_masks[list][i].mask.str());
+			out.putString(_masks[list][i].setter);
+			out.putU64(_masks[list][i].time);
+		}
+	}
+}
+
+/*
+	members whose socket didn't make it over are skipped; the NAMES
+	string is rebuilt from the restored members, so the clients have to
+	be restored first.
+*/
+Channel *Channel::load(Deserializer &in, Server *server, const std::map<int, int> &sockets) {
+	std::string name = in.getString();
+	std::string pass = in.getString();
+	Channel *channel = new Channel(name, pass, server);
+	try {
+		channel->_topic = in.getString();
+		channel->_topicTime = in.getU64();
+		channel->_createdAt = in.getU64();
+		channel->_mode = in.getU32();
+		channel->_limit = in.getU32();
+		for (uint32_t count = in.getU32(); count > 0; count--) {
+			std::map<int, int>::const_iterator fd = sockets.find(in.getU32());
+			unsigned char modes = in.getU8();
+			if (fd == sockets.end() || channel->hasClient(fd->second))
+				continue;
+			channel->_clients.push_back(fd->second);
+			server->getClient(fd->second).joinedChannel(channel);
+			channel->_members[fd->second] = modes;
+			if (modes & MemberOperator)
+				channel->_operatorCount++;
+			channel->_names += channel->namesToken(modes, server->getClient(fd->second).getNickname());
+		}
+		for (uint32_t count = in.getU32(); count > 0; count--) {
+			std::map<int, int>::const_iterator fd = sockets.find(in.getU32());
+			if (fd != sockets.end())
+				channel->_invites.push_back(fd->second);
+		}
+		for (uint32_t count = in.getU32(); count > 0; count--) {
+			uint64_t msgid = in.getU64();
+			uint64_t time = in.getU64();
+			SharedLine *line = SharedLine::create(in.getString());
+			channel->_history.record(line, msgid, time);
+			line->release();
+		}
+		for (int list = 0; list < MaskListCount; list++) {
+			for (uint32_t count = in.getU32(); count > 0; count--) {
+				std::string mask = in.getString();
+				std::string setter = in.getString();
+				channel->addMask(static_cast<MaskList>(list), mask, setter, in.getU64());
+			}
+		}
+	} catch (std::exception &) {
+		delete channel;
+		throw;
+	}
+	channel->account(); // the members went in behind addClient
+	return channel;
+}
+
 const std::string& Channel::getName(void) const {
 	return _name;
 }
@@ -44,22 +162,41 @@ const std::string& Channel::getPass(void) const {
 }
 
 void Channel::addClient(int fd) {
-	if (!hasClient(fd))
-		_clients.push_back(fd);
+	if (hasClient(fd))
+		return;
+	_clients.push_back(fd);
+	_members[fd] = 0;
+	_server->getClient(fd).joinedChannel(this);
+	_names += _server->getClient(fd).getNickname();
+	_names += " ";
+	account();
+	_server->invalidateChannelList();
 }
 
 void Channel::removeClient(int fd) {
+	std::map<int, unsigned char>::iterator member = _members.find(fd);
+	if (member == _members.end())
+		return;
+	if (member->second & MemberOperator)
+		_operatorCount--;
+	replaceNamesToken(namesToken(member->second, _server->getClient(fd).getNickname()), "");
+	_members.erase(member);
+	_verdicts.erase(fd);
 	std::vector<int>::iterator it = std::find(_clients.begin(), _clients.end(), fd);
 	if (it != _clients.end())
 		_clients.erase(it);
-	removeOperator(fd);
+	_server->getClient(fd).leftChannel(this);
+	account();
+	_server->invalidateChannelList();
 }
 
 bool Channel::hasClient(int fd) const {
-	return std::find(_clients.begin(), _clients.end(), fd) != _clients.end();
+	return _members.find(fd) != _members.end();
 }
 
 void Channel::setMode(ChannelMode key, bool value) {
+	if (key == ChanSecret && getMode(ChanSecret) != value)
+		_server->invalidateChannelList();
 	if (value)
 		_mode |= (1 << key);
 	else
@@ -87,49 +224,117 @@ std::string Channel::getModeString(void) const {
 	return modes;
 }
 
+int Channel::getModes(void) const {
+	return _mode;
+}
+
+void Channel::setModes(int modes) {
+	_mode = modes;
+	_server->invalidateChannelList();
+}
+
 int Channel::getLimit(void) const {
 	return _limit;
 }
 
 void Channel::setLimit(int limit) {
 	_limit = limit;
+	setMode(ChanLimit, limit > 0); // what JOIN checks
 }
 
 
 void Channel::setTopic(std::string topic) {
-	_topic = topic;
+	_topic = std::move(topic);
+	_topicTime = time(NULL);
+	_server->invalidateChannelList();
 }
 
 const std::string& Channel::getTopic(void) const {
 	return _topic;
 }
 
+time_t Channel::getTopicTime(void) const {
+	return _topicTime;
+}
+
+time_t Channel::getCreationTime(void) const {
+	return _createdAt;
+}
+
+void Channel::setTimes(time_t createdAt, time_t topicTime) {
+	_createdAt = createdAt;
+	_topicTime = topicTime;
+	_server->invalidateChannelList();
+}
+
 void Channel::addOperator(int fd) {
-	if (!isOperator(fd))
-		_operators.push_back(fd);
+	setMemberMode(fd, MemberOperator, true);
 }
 
 void Channel::removeOperator(int fd) {
-	std::vector<int>::iterator it = std::find(_operators.begin(), _operators.end(), fd);
-	if (it != _operators.end())
-		_operators.erase(it);
+	setMemberMode(fd, MemberOperator, false);
 }
 
 bool Channel::isOperator(int fd) const {
-	return std::find(_operators.begin(), _operators.end(), fd) != _operators.end();
+	std::map<int, unsigned char>::const_iterator it = _members.find(fd);
+	return it != _members.end() && (it->second & MemberOperator);
+}
+
+void Channel::broadcast(const std::string &message) {
+	broadcast(message, -1);
+}
+
+// the line is rendered once and every member's queue references it
+void Channel::broadcast(const std::string &message, int fd, LinkRoute route) {
+	SharedLine *line = SharedLine::create(message);
+	sendShared(line, fd, route);
+	line->release();
 }
 
-void Channel::broadcast(std::string message) {
+// each version is rendered once; operators see the line as it is
+void Channel::broadcastMasked(const std::string &message, const std::string &masked) {
+	if (message == masked)
+		return broadcast(message);
+	SharedLine *line = SharedLine::create(message);
+	SharedLine *hidden = SharedLine::create(masked);
 	for (std::vector<int>::iterator it = _clients.begin(); it != _clients.end(); it++) {
-		_server->sendMessageToClient(*it, message);
+		if (*it >= 0)
+			_server->sendSharedToClient(*it, isOperator(*it) ? line : hidden);
 	}
+	line->release();
+	hidden->release();
 }
 
-void Channel::broadcast(std::string message, int fd) {
+void Channel::broadcastEvent(const std::string &message, int fd, LinkRoute route, unsigned long epoch) {
+	SharedLine *line = SharedLine::create(message);
+	broadcastEvent(line, fd, route, epoch);
+	line->release();
+}
+
+void Channel::broadcastEvent(SharedLine *line, int fd, LinkRoute route, unsigned long epoch) {
+	uint64_t msgid = ChannelHistory::takeMsgid();
+	uint64_t time = ChannelHistory::now();
+	_history.record(line, msgid, time);
+	_server->getMessageLog().append(_name, msgid, time, line);
+	sendShared(line, fd, route, epoch);
+}
+
+// fd is skipped whether it is a member or the link a line came in from;
+// remote members hear the line through their own server
+void Channel::sendShared(SharedLine *line, int fd, LinkRoute route, unsigned long epoch) {
 	for (std::vector<int>::iterator it = _clients.begin(); it != _clients.end(); it++) {
-		if (*it != fd)
-			_server->sendMessageToClient(*it, message);
+		if (*it == fd || *it < 0)
+			continue;
+		if (epoch && !_server->getClient(*it).markDelivered(epoch))
+			continue; // reached through another target of the same message
+		_server->sendSharedToClient(*it, line);
 	}
+	if (route == LinksAll)
+		_server->propagateShared(line, fd);
+}
+
+const ChannelHistory& Channel::getHistory(void) const {
+	return _history;
 }
 
 int Channel::getClientCount(void) const {
@@ -137,60 +342,232 @@ int Channel::getClientCount(void) const {
 }
 
 void Channel::setName(std::string name) {
-	_name = name;
+	_name = std::move(name);
 	if (_name[0] != '#')
-		_name = "#" + _name;
+		_name.insert(0, 1, '#');
 }
 
 void Channel::setPass(std::string pass) {
-	_pass = pass;
+	_pass = std::move(pass);
 }
 
 const std::vector<int>& Channel::getClients(void) const {
 	return _clients;
 }
 
-std::string Channel::getclientsNicknames(void) const {
-	std::string nicks;
-	for (std::vector<int>::const_iterator it = _clients.begin(); it != _clients.end(); it++) {
-		if (isOperator(*it))
-			nicks += "@"; // operator
-		nicks += _server->getClient(*it).getNickname() + " ";
+const std::string& Channel::getclientsNicknames(void) const {
+	return _names;
+}
+
+std::string Channel::namesToken(unsigned char modes, const std::string &nickname) const {
+	if (modes & MemberOperator)
+		return "@" + nickname + " ";
+	if (modes & MemberVoice)
+		return "+" + nickname + " ";
+	return nickname + " ";
+}
+
+/*
+	tokens in _names are "<status><nick> " and nicknames are unique, so a
+	token is found by matching it right after the start or a space.
+*/
+void Channel::replaceNamesToken(const std::string &oldToken, const std::string &newToken) {
+	size_t pos = 0;
+	while ((pos = _names.find(oldToken, pos)) != std::string::npos) {
+		if (pos == 0 || _names[pos - 1] == ' ') {
+			_names.replace(pos, oldToken.size(), newToken);
+			return;
+		}
+		pos++;
 	}
-	return nicks;
+}
+
+void Channel::setMemberMode(int fd, MemberMode mode, bool value) {
+	std::map<int, unsigned char>::iterator it = _members.find(fd);
+	if (it == _members.end() || bool(it->second & mode) == value)
+		return;
+	unsigned char modes = value ? (it->second | mode) : (it->second & ~mode);
+	if (mode == MemberOperator)
+		_operatorCount += value ? 1 : -1;
+	const std::string nickname = _server->getClient(fd).getNickname();
+	std::string oldToken = namesToken(it->second, nickname);
+	std::string newToken = namesToken(modes, nickname);
+	if (oldToken != newToken)
+		replaceNamesToken(oldToken, newToken);
+	it->second = modes;
+	account();
+}
+
+void Channel::renameClient(int fd, const std::string &oldNickname, const std::string &newNickname) {
+	std::map<int, unsigned char>::iterator it = _members.find(fd);
+	if (it != _members.end())
+		replaceNamesToken(namesToken(it->second, oldNickname), namesToken(it->second, newNickname));
+	_verdicts.erase(fd); // the new nick may match other masks
+	account();
+}
+
+/*
+	sends the NAMES reply: the member list is cut into as many 353 lines
+	as needed so that none of them exceeds the 512 bytes limit.
+*/
+void Channel::sendNames(int fd, const std::string &nickname) {
+	std::string reply;
+	appendNames(reply, nickname);
+	_server->sendRawToClient(fd, reply);
+}
+
+void Channel::appendNames(std::string &out, const std::string &nickname) const {
+	std::string header = _server->prefix() + "353 " + nickname + (getMode(ChanSecret) ? " @ " : " = ") + _name + " :";
+	std::string line = header;
+	size_t start = 0;
+	size_t end;
+	while ((end = _names.find(' ', start)) != std::string::npos) {
+		if (line.size() > header.size() && line.size() + (end - start) + 1 > NAMES_LINE_MAX) {
+			line.erase(line.size() - 1); // trailing space
+			out += line + "\r\n";
+			line = header;
+		}
+		line.append(_names, start, end - start + 1);
+		start = end + 1;
+	}
+	if (line.size() > header.size()) {
+		line.erase(line.size() - 1);
+		out += line + "\r\n";
+	}
+	out += _server->prefix() + "366 " + nickname + " " + _name + " :End of /NAMES list\r\n";
 }
 
 void Channel::addVoice(int fd) {
-	if (!hasVoice(fd))
-		_voiced.push_back(fd);
+	setMemberMode(fd, MemberVoice, true);
 }
 
 void Channel::removeVoice(int fd) {
-	std::vector<int>::iterator it = std::find(_voiced.begin(), _voiced.end(), fd);
-	if (it != _voiced.end())
-		_voiced.erase(it);
+	setMemberMode(fd, MemberVoice, false);
 }
 
 bool Channel::hasVoice(int fd) const {
-	return std::find(_voiced.begin(), _voiced.end(), fd) != _voiced.end();
+	std::map<int, unsigned char>::const_iterator it = _members.find(fd);
+	return it != _members.end() && (it->second & MemberVoice);
 }
 
 void Channel::addInvite(int fd) {
 	if (!hasInvite(fd))
 		_invites.push_back(fd);
+	account();
 }
 
 void Channel::removeInvite(int fd) {
 	std::vector<int>::iterator it = std::find(_invites.begin(), _invites.end(), fd);
 	if (it != _invites.end())
 		_invites.erase(it);
+	account();
 }
 
 bool Channel::hasInvite(int fd) const {
 	return std::find(_invites.begin(), _invites.end(), fd) != _invites.end();
 }
 
+bool Channel::addMask(MaskList list, const std::string &mask, const std::string &setter, time_t time) {
+	std::vector<MaskEntry> &entries = _masks[list];
+	if (entries.size() >= MASK_LIST_MAX)
+		return false;
+	std::string folded = ircLower(mask);
+	for (size_t i = 0; i < entries.size(); i++)
+		if (ircLower(entries[i].mask.str()) == folded)
+			return false;
+	entries.push_back(MaskEntry(mask, setter, time));
+	if (list != ListInviteExcept)
+		_maskGeneration++;
+	account();
+	return true;
+}
+
+bool Channel::removeMask(MaskList list, const std::string &mask) {
+	std::vector<MaskEntry> &entries = _masks[list];
+	std::string folded = ircLower(mask);
+	for (std::vector<MaskEntry>::iterator it = entries.begin(); it != entries.end(); it++) {
+		if (ircLower(it->mask.str()) != folded)
+			continue;
+		entries.erase(it);
+		if (list != ListInviteExcept)
+			_maskGeneration++;
+		account();
+		return true;
+	}
+	return false;
+}
+
+const std::vector<MaskEntry>& Channel::getMasks(MaskList list) const {
+	return _masks[list];
+}
+
+void Channel::clearMasks(void) {
+	for (int list = 0; list < MaskListCount; list++)
+		_masks[list].clear();
+	_maskGeneration++;
+	account();
+}
+
+std::string Channel::maskSubject(int fd) const {
+	return ircLower(_server->getClient(fd).getNetworkIdentifier());
+}
+
+bool Channel::matchesList(MaskList list, const std::string &subject) const {
+	const std::vector<MaskEntry> &entries = _masks[list];
+	for (size_t i = 0; i < entries.size(); i++)
+		if (entries[i].mask.matches(subject))
+			return true;
+	return false;
+}
+
+/*
+	the lists are only walked when a member's verdict is missing or older
+	than the last b / e change, so speaking or changing nick in a channel
+	with a long ban list costs a map lookup. non-members (a JOIN) are not
+	cached: nothing would drop the entry if they never make it in.
+*/
+bool Channel::isBanned(int fd) {
+	if (_masks[ListBan].empty())
+		return false;
+	std::map<int, BanVerdict>::iterator cached = _verdicts.find(fd);
+	if (cached != _verdicts.end() && cached->second.generation == _maskGeneration)
+		return cached->second.banned;
+	std::string subject = maskSubject(fd);
+	bool banned = matchesList(ListBan, subject) && !matchesList(ListExcept, subject);
+	if (hasClient(fd)) {
+		BanVerdict verdict = { _maskGeneration, banned };
+		_verdicts[fd] = verdict;
+		account();
+	}
+	return banned;
+}
+
+void Channel::forgetVerdict(int fd) {
+	if (_verdicts.erase(fd))
+		account();
+}
+
+bool Channel::isInviteExcepted(int fd) const {
+	return !_masks[ListInviteExcept].empty() && matchesList(ListInviteExcept, maskSubject(fd));
+}
+
 
 int Channel::getOperatorCount(void) const {
-	return _operators.size();
-}
\ No newline at end of file
+	return _operatorCount;
+}
+
+size_t Channel::footprint(void) const {
+	size_t bytes = sizeof(Channel) + _names.capacity()
+		+ (_clients.capacity() + _invites.capacity()) * sizeof(int)
+		+ _members.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const int, unsigned char>))
+		+ _verdicts.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const int, BanVerdict>));
+	for (int list = 0; list < MaskListCount; list++)
+		bytes += _masks[list].capacity() * sizeof(MaskEntry);
+	return bytes;
+}
+
+void Channel::account(void) {
+	MemoryStats::release(MemChannels, _footprint);
+	_footprint = footprint();
+	MemoryStats::charge(MemChannels, _footprint);
+}
@@ -0,0 +1,160 @@
+#include "../include/ChannelRegistry.hpp"
+#include "../include/Mask.hpp"
+
+#define REGISTRY_MIN_CAPACITY 64
+
+ChannelRegistry::ChannelRegistry(void)
+:_count(0)
+{
+	Slot empty = {0, "", NULL};
+	_slots.assign(REGISTRY_MIN_CAPACITY, empty);
+}
+
+ChannelRegistry::ChannelRegistry(const ChannelRegistry &){}
+
+ChannelRegistry& ChannelRegistry::operator=(const ChannelRegistry &){return *this;}
+
+void ChannelRegistry::trim(const char *&name, size_t &len)
+{
+	if (len > 0 && name[0] == '#')
+	{
+		name++;
+		len--;
+	}
+}
+
+// FNV-1a over the case-folded name
+size_t ChannelRegistry::hash(const char *name, size_t len)
+{
+	size_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++)
+	{
+		h ^= static_cast<unsigned char>(ircToLower(name[i]));
+		h *= 16777619u;
+	}
+	return h;
+}
+
+bool ChannelRegistry::sameKey(const std::string &key, const char *name, size_t len)
+{
+	if (key.size() != len)
+		return false;
+	for (size_t i = 0; i < len; i++)
+		if (key[i] != ircToLower(name[i]))
+			return false;
+	return true;
+}
+
+// index of the slot holding the name, or of the empty slot ending its chain
+size_t ChannelRegistry::findSlot(const char *name, size_t len, size_t h) const
+{
+	size_t mask = _slots.size() - 1;
+	size_t i = h & mask;
+	while (_slots[i].channel && !(_slots[i].hash == h && sameKey(_slots[i].key, name, len)))
+		i = (i + 1) & mask;
+	return i;
+}
+
+void ChannelRegistry::grow(void)
+{
+	std::vector<Slot> old;
+	old.swap(_slots);
+	Slot empty = {0, "", NULL};
+	_slots.assign(old.size() * 2, empty);
+	size_t mask = _slots.size() - 1;
+	for (size_t i = 0; i < old.size(); i++)
+	{
+		if (!old[i].channel)
+			continue;
+		size_t j = old[i].hash & mask;
+		while (_slots[j].channel)
+			j = (j + 1) & mask;
+		_slots[j].hash = old[i].hash;
+		_slots[j].key.swap(old[i].key);
+		_slots[j].channel = old[i].channel;
+	}
+}
+
+Channel *ChannelRegistry::find(const char *name, size_t len) const
+{
+	trim(name, len);
+	return _slots[findSlot(name, len, hash(name, len))].channel;
+}
+
+Channel *ChannelRegistry::find(const std::string &name) const
+{
+	return find(name.data(), name.size());
+}
+
+bool ChannelRegistry::insert(const std::string &name, Channel *channel)
+{
+	if ((_count + 1) * 2 > _slots.size())
+		grow();
+	const char *key = name.data();
+	size_t len = name.size();
+	trim(key, len);
+	size_t h = hash(key, len);
+	Slot &slot = _slots[findSlot(key, len, h)];
+	if (slot.channel)
+		return false;
+	slot.hash = h;
+	slot.key = ircLower(std::string(key, len));
+	slot.channel = channel;
+	_count++;
+	return true;
+}
+
+bool ChannelRegistry::erase(const std::string &name)
+{
+	const char *key = name.data();
+	size_t len = name.size();
+	trim(key, len);
+	size_t mask = _slots.size() - 1;
+	size_t i = findSlot(key, len, hash(key, len));
+	if (!_slots[i].channel)
+		return false;
+	// backward shift: pull back every following entry that may live in the hole
+	size_t j = i;
+	while (true)
+	{
+		j = (j + 1) & mask;
+		if (!_slots[j].channel)
+			break;
+		size_t home = _slots[j].hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue; // still reachable from its home without crossing the hole
+		_slots[i].hash = _slots[j].hash;
+		_slots[i].key.swap(_slots[j].key);
+		_slots[i].channel = _slots[j].channel;
+		i = j;
+	}
+	_slots[i].key.clear();
+	_slots[i].channel = NULL;
+	_count--;
+	return true;
+}
+
+size_t ChannelRegistry::size(void) const
+{
+	return _count;
+}
+
+size_t ChannelRegistry::capacity(void) const
+{
+	return _slots.size();
+}
+
+Channel *ChannelRegistry::channelAt(size_t i) const
+{
+	return _slots[i].channel;
+}
+
+const std::string& ChannelRegistry::keyAt(size_t i) const
+{
+	return _slots[i].key;
+}
+
+size_t ChannelRegistry::footprint(void) const
+{
+	return _slots.capacity() * sizeof(Slot);
+}
@@ -11,115 +11,332 @@
 /* ************************************************************************** */
 
 #include "../include/Client.hpp"
+#include "../include/ObjectPool.hpp"
+#include <algorithm>
 
-Client::Client(void) {}
+static ObjectPool<Client>& clientPool(void)
+{
+    static ObjectPool<Client> pool;
+    return pool;
+}
+
+void *Client::operator new(size_t size)
+{
+    if (size != sizeof(Client))
+        return ::operator new(size);
+    return clientPool().allocate();
+}
 
-Client::Client(const Client&){}
+void Client::operator delete(void *ptr, size_t size)
+{
+    if (size != sizeof(Client))
+        return ::operator delete(ptr);
+    clientPool().deallocate(ptr);
+}
+
+static ObjectPool<ClientInfo>& infoPool(void)
+{
+    static ObjectPool<ClientInfo> pool;
+    return pool;
+}
+
+void *ClientInfo::operator new(size_t size)
+{
+    if (size != sizeof(ClientInfo))
+        return ::operator new(size);
+    return infoPool().allocate();
+}
+
+void ClientInfo::operator delete(void *ptr, size_t size)
+{
+    if (size != sizeof(ClientInfo))
+        return ::operator delete(ptr);
+    infoPool().deallocate(ptr);
+}
+
+static void copyBounded(char *dst, std::string_view src, size_t max)
+{
+    size_t len = std::min(src.size(), max);
+    src.copy(dst, len);
+    dst[len] = '\0';
+}
+
+Client::Client(void)
+:_inboundBuffer(MemInbound),_outboundBuffer(MemOutbound)
+{}
+
+Client::Client(const Client&)
+:_inboundBuffer(MemInbound),_outboundBuffer(MemOutbound)
+{}
 
 
 Client::Client(int socket,std::string ip, std::string hostname)
-:_ip(ip),_socket(socket),_hostname(hostname),_inboundBuffer(""),_outboundBuffer(""),
-_realname(""),_authenticated(false),_isregistered(false)
+:_socket(socket),_flags(0),_link(-1),_deliveryMark(0),_inboundBuffer(MemInbound),
+_outboundBuffer(MemOutbound),_pending(NULL),_lastActive(0),_info(new ClientInfo)
 {
-    if (_hostname.empty())
-        _hostname = ip;
+    MemoryStats::charge(MemClients, sizeof(Client) + sizeof(ClientInfo));
+    _timer.owner = socket;
+    _nickname[0] = '\0';
+    _username[0] = '\0';
+    _info->hostname = hostname.empty() ? ip : std::move(hostname);
+    _info->ip = std::move(ip);
+    updatePrefix();
 }
 
 Client& Client::operator=(const Client&){return *this;}
 
-Client::~Client(void) {}
+Client::~Client(void) {
+    MemoryStats::release(MemClients, sizeof(Client) + sizeof(ClientInfo));
+    delete _pending;
+    delete _info;
+}
+
+void Client::save(Serializer &out) const {
+    out.putString(_info->ip);
+    out.putString(_info->hostname);
+    out.putU16(_flags); // every ClientFlag, ClientServerLink is past the first byte
+    out.putString(_nickname);
+    out.putString(_username);
+    out.putString(_info->realname);
+    out.putString(_info->server);
+    out.putU32(_link); // the old process's socket, the caller renumbers it
+    out.putU64(_lastActive);
+    std::string data;
+    _inboundBuffer.copyTo(data);
+    out.putString(data);
+    _outboundBuffer.copyTo(data);
+    out.putString(data);
+}
+
+Client *Client::load(Deserializer &in, int socket) {
+    std::string ip = in.getString();
+    std::string hostname = in.getString();
+    Client *client = new Client(socket, ip, hostname);
+    try {
+        client->_flags = in.getU16();
+        copyBounded(client->_nickname, in.getString(), NICK_MAX_LEN);
+        copyBounded(client->_username, in.getString(), USER_MAX_LEN);
+        client->_info->realname = in.getString();
+        client->_info->server = in.getString();
+        client->_link = static_cast<int32_t>(in.getU32());
+        client->_lastActive = in.getU64();
+        client->_inboundBuffer.append(in.getString());
+        client->_outboundBuffer.append(in.getString());
+    } catch (std::exception &) {
+        delete client;
+        throw;
+    }
+    client->updatePrefix();
+    return client;
+}
+
+void Client::updatePrefix(void) {
+    std::string &identifier = _info->identifier;
+    identifier.assign(_nickname);
+    identifier += '!';
+    identifier += _username;
+    identifier += '@';
+    identifier += _info->hostname;
+    _prefix.reserve(identifier.size() + 2);
+    _prefix.assign(1, ':');
+    _prefix += identifier;
+    _prefix += ' ';
+}
 
-std::string Client::getNetworkIdentifier(void) const {
-    return _nickname + "!" + _username + "@" + _hostname;
+const std::string& Client::getNetworkIdentifier(void) const {
+    return _info->identifier;
 }
 
 int Client::getSocket(void) const {
     return _socket;
 }
 
-void Client::appendToInboundBuffer(std::string data) {
-    _inboundBuffer << data; // data coming from client
+void Client::appendToInboundBuffer(std::string_view data) {
+    _inboundBuffer.append(data); // data coming from client
 }
 
 bool Client::inboundReady(void) const {
-    return _inboundBuffer.str().find("\r\n") != std::string::npos;
+    return _inboundBuffer.hasLine();
+}
+
+bool Client::inboundOverflow(void) const {
+    size_t limit = getFlag(ClientServerLink) ? LINK_INPUT_MAX : INPUT_LINE_MAX;
+    return _inboundBuffer.size() > limit && !_inboundBuffer.hasLine();
 }
 
 std::vector<std::string> Client::getCompleteCommands(void) {
     std::vector<std::string> commands;
-    std::string buffer = _inboundBuffer.str();
-    size_t pos;
-    while ((pos = buffer.find("\r\n")) != std::string::npos) {
-        std::string sub = buffer.substr(0, pos);
-        if (sub.size() > 0) // ignore empty lines
-            commands.push_back(buffer.substr(0, pos));
-        buffer.erase(0, pos + 2);
+    std::string line;
+    while (_inboundBuffer.getLine(line)) {
+        if (line.size() > 0) // ignore empty lines
+            commands.emplace_back(std::move(line));
     }
-    _inboundBuffer.str(buffer);
     return commands;
 }
 
 bool Client::outboundReady(void) const {
-    return _outboundBuffer.str().size();
+    return !_outboundBuffer.empty();
 }
 
-std::string Client::getOutboundBuffer(void) {
-    return _outboundBuffer.str();
+size_t Client::getOutboundBuffer(struct iovec *iov, size_t count) const {
+    return _outboundBuffer.peek(iov, count);
 }
 
 void Client::advanceOutboundBuffer(size_t bytes) {
-    std::string buffer = _outboundBuffer.str();
-    _outboundBuffer.str(buffer.substr(bytes));
+    _outboundBuffer.consume(bytes);
+}
+
+size_t Client::getOutboundSize(void) const {
+    return _outboundBuffer.size();
+}
+
+size_t Client::getInboundSize(void) const {
+    return _inboundBuffer.size();
+}
+
+PendingReply *Client::getPendingReply(void) const {
+    return _pending;
 }
 
-const std::string& Client::getNickname(void) const {
+void Client::setPendingReply(PendingReply *reply) {
+    if (_pending != reply)
+        delete _pending;
+    _pending = reply;
+}
+
+TimerNode& Client::getTimer(void) {
+    return _timer;
+}
+
+unsigned long Client::getLastActive(void) const {
+    return _lastActive;
+}
+
+void Client::setLastActive(unsigned long tick) {
+    _lastActive = tick;
+}
+
+const char *Client::getNickname(void) const {
     return _nickname;
 }
 
-const std::string& Client::getUsername(void) const {
+const char *Client::getUsername(void) const {
     return _username;
 }
 
 const std::string& Client::getRealname(void) const {
-    return _realname;
+    return _info->realname;
 }
 
 const std::string& Client::getHostname(void) const {
-    return _hostname;
+    return _info->hostname;
+}
+
+const std::string& Client::getIp(void) const {
+    return _info->ip;
+}
+
+int Client::getLink(void) const {
+    return _link;
+}
+
+void Client::setLink(int link) {
+    _link = link;
+}
+
+bool Client::markDelivered(unsigned long epoch) {
+    if (_deliveryMark == epoch)
+        return false;
+    _deliveryMark = epoch;
+    return true;
+}
+
+const std::vector<Channel *>& Client::getChannels(void) const {
+    return _channels;
+}
+
+void Client::joinedChannel(Channel *channel) {
+    _channels.push_back(channel);
+}
+
+void Client::leftChannel(Channel *channel) {
+    std::vector<Channel *>::iterator it = std::find(_channels.begin(), _channels.end(), channel);
+    if (it != _channels.end())
+        _channels.erase(it);
+}
+
+const std::string& Client::getServer(void) const {
+    return _info->server;
+}
+
+void Client::setServer(const std::string &server) {
+    _info->server = server;
 }
 
 bool Client::isAuthenticated(void) const {
-    return _authenticated;
+    return _flags & ClientAuthenticated;
 }
 
 bool Client::isRegistered(void) const {
-    return _isregistered;
+    return _flags & ClientRegistered;
+}
+
+bool Client::getFlag(ClientFlag flag) const {
+    return _flags & flag;
+}
+
+void Client::setFlag(ClientFlag flag, bool value) {
+    if (value)
+        _flags |= flag;
+    else
+        _flags &= ~flag;
 }
 
-void Client::setNickname(std::string nickname) {
-    _nickname = nickname;
+void Client::setNickname(std::string_view nickname) {
+    copyBounded(_nickname, nickname, NICK_MAX_LEN);
+    updatePrefix();
 }
 
-void Client::setUsername(std::string username) {
-    _username = username;
+void Client::setUsername(std::string_view username) {
+    copyBounded(_username, username, USER_MAX_LEN);
+    updatePrefix();
 }
 
 void Client::setRealname(std::string realname) {
-    _realname = realname;
+    _info->realname = std::move(realname);
 }
 
 void Client::setAuthenticated(bool authenticated) {
-    _authenticated = authenticated;
+    if (authenticated)
+        _flags |= ClientAuthenticated;
+    else
+        _flags &= ~ClientAuthenticated;
 }
 
 void Client::setRegistered(bool registered) {
-    _isregistered = registered;
+    if (registered)
+        _flags |= ClientRegistered;
+    else
+        _flags &= ~ClientRegistered;
+}
+
+void Client::newMessage(std::string_view message) {
+    _outboundBuffer.append(message);
+    _outboundBuffer.append("\r\n", 2);
+}
+
+void Client::newRawMessage(std::string_view data) {
+    _outboundBuffer.append(data);
+}
+
+void Client::newSharedMessage(SharedLine *line) {
+    _outboundBuffer.append(line);
 }
 
-void Client::newMessage(std::string message) {
-    _outboundBuffer << message << "\r\n";
+char *Client::claimOutbound(size_t len) {
+    return _outboundBuffer.claim(len);
 }
 
-std::string Client::prefix(void) const {
-    return ":" + getNetworkIdentifier() + " ";
+const std::string& Client::prefix(void) const {
+    return _prefix;
 }
\ No newline at end of file
@@ -0,0 +1,85 @@
+#include "../include/Config.hpp"
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <cstdlib>
+#include <cerrno>
+
+static std::string trimSpaces(const std::string &str)
+{
+	size_t begin = str.find_first_not_of(" \t\r");
+	if (begin == std::string::npos)
+		return "";
+	size_t end = str.find_last_not_of(" \t\r");
+	return str.substr(begin, end - begin + 1);
+}
+
+Config::Config(void)
+{
+}
+
+bool Config::load(const std::string &path)
+{
+	std::ifstream file(path.c_str());
+	if (!file)
+		return false;
+	_path = path;
+	_values.clear();
+	std::string line;
+	for (int number = 1; std::getline(file, line); number++)
+	{
+		line = trimSpaces(line);
+		if (line.empty() || line[0] == '#')
+			continue;
+		size_t equal = line.find('=');
+		std::string key = trimSpaces(line.substr(0, equal));
+		if (equal == std::string::npos || key.empty())
+		{
+			std::ostringstream error;
+			error << path << ":" << number << ": expected \"key = value\"";
+			throw std::runtime_error(error.str());
+		}
+		_values.insert(std::make_pair(key, trimSpaces(line.substr(equal + 1))));
+	}
+	return true;
+}
+
+bool Config::has(const std::string &key) const
+{
+	return _values.find(key) != _values.end();
+}
+
+std::string Config::get(const std::string &key, const std::string &fallback) const
+{
+	std::multimap<std::string, std::string>::const_iterator it = _values.upper_bound(key);
+	if (it == _values.begin() || (--it)->first != key)
+		return fallback;
+	return it->second;
+}
+
+long Config::getNumber(const std::string &key, long fallback, long min, long max) const
+{
+	if (!has(key))
+		return fallback;
+	std::string value = get(key, "");
+	char *end;
+	errno = 0;
+	long number = std::strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end || errno == ERANGE || number < min || number > max)
+	{
+		std::ostringstream error;
+		error << _path << ": " << key << " must be a number between " << min << " and " << max;
+		throw std::runtime_error(error.str());
+	}
+	return number;
+}
+
+std::vector<std::string> Config::getAll(const std::string &key) const
+{
+	std::vector<std::string> values;
+	std::pair<std::multimap<std::string, std::string>::const_iterator,
+		std::multimap<std::string, std::string>::const_iterator> range = _values.equal_range(key);
+	for (; range.first != range.second; ++range.first)
+		values.push_back(range.first->second);
+	return values;
+}
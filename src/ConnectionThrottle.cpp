@@ -0,0 +1,254 @@
+#include "../include/ConnectionThrottle.hpp"
+#include "../include/Config.hpp"
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+#define THROTTLE_MIN_CAPACITY 64
+#define THROTTLE_SWEEP_STEP 2 // slots checked for stale entries per admit
+
+bool HostKey::fromSockaddr(const struct sockaddr *addr, HostKey &key)
+{
+	std::memset(key.bytes, 0, sizeof(key.bytes));
+	if (addr->sa_family == AF_INET)
+	{
+		key.bytes[10] = 0xff;
+		key.bytes[11] = 0xff;
+		std::memcpy(key.bytes + 12, &reinterpret_cast<const struct sockaddr_in *>(addr)->sin_addr, 4);
+		return true;
+	}
+	if (addr->sa_family == AF_INET6)
+	{
+		const unsigned char *bytes = reinterpret_cast<const struct sockaddr_in6 *>(addr)->sin6_addr.s6_addr;
+		if (IN6_IS_ADDR_V4MAPPED(reinterpret_cast<const struct in6_addr *>(bytes)))
+			std::memcpy(key.bytes, bytes, 16); // an IPv4 client of a dual stack socket
+		else
+			std::memcpy(key.bytes, bytes, 8);
+		return true;
+	}
+	return false;
+}
+
+bool HostKey::fromString(const std::string &address, HostKey &key)
+{
+	struct sockaddr_in addr4;
+	struct sockaddr_in6 addr6;
+	std::memset(&addr4, 0, sizeof(addr4));
+	std::memset(&addr6, 0, sizeof(addr6));
+	if (inet_pton(AF_INET, address.c_str(), &addr4.sin_addr) == 1)
+	{
+		addr4.sin_family = AF_INET;
+		return fromSockaddr(reinterpret_cast<struct sockaddr *>(&addr4), key);
+	}
+	if (inet_pton(AF_INET6, address.c_str(), &addr6.sin6_addr) == 1)
+	{
+		addr6.sin6_family = AF_INET6;
+		return fromSockaddr(reinterpret_cast<struct sockaddr *>(&addr6), key);
+	}
+	return false;
+}
+
+ConnectionThrottle::ConnectionThrottle(void)
+:_count(0),_sweep(0),_maxPerHost(10),_maxAttempts(10),_window(60)
+{
+	Entry empty;
+	std::memset(&empty, 0, sizeof(empty));
+	_entries.assign(THROTTLE_MIN_CAPACITY, empty);
+}
+
+/*
+CONFIG KEYS:
+	- max_connections_per_host: live connections per source
+	- connect_attempts / connect_window: attempts allowed per source per window (seconds)
+	- exempt: address or address/bits, may repeat
+*/
+void ConnectionThrottle::configure(const Config &config)
+{
+	_maxPerHost = config.getNumber("max_connections_per_host", _maxPerHost, 1, 65535);
+	_maxAttempts = config.getNumber("connect_attempts", _maxAttempts, 1, 65535);
+	_window = config.getNumber("connect_window", _window, 1, 86400);
+	std::vector<std::string> masks = config.getAll("exempt");
+	_exemptions.clear();
+	for (size_t i = 0; i < masks.size(); i++)
+	{
+		Exemption exemption;
+		size_t slash = masks[i].find('/');
+		std::string address = masks[i].substr(0, slash);
+		bool isV4 = address.find(':') == std::string::npos;
+		exemption.bits = 128;
+		if (slash != std::string::npos)
+		{
+			std::string bits = masks[i].substr(slash + 1);
+			exemption.bits = std::atoi(bits.c_str()) + (isV4 ? 96 : 0);
+			if (bits.empty() || bits.find_first_not_of("0123456789") != std::string::npos
+				|| exemption.bits > 128 || (isV4 && exemption.bits < 96))
+				throw std::runtime_error("Invalid exempt mask: " + masks[i]);
+		}
+		if (!HostKey::fromString(address, exemption.key))
+			throw std::runtime_error("Invalid exempt address: " + masks[i]);
+		_exemptions.push_back(exemption);
+	}
+	for (size_t i = 0; i < _entries.size(); i++)
+		if (_entries[i].used)
+			_entries[i].exempt = isExempt(_entries[i].key);
+}
+
+// FNV-1a over the key bytes
+size_t ConnectionThrottle::hash(const HostKey &key)
+{
+	size_t h = 2166136261u;
+	for (size_t i = 0; i < sizeof(key.bytes); i++)
+	{
+		h ^= key.bytes[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+// index of the slot holding the key, or of the empty slot ending its chain
+size_t ConnectionThrottle::findSlot(const HostKey &key, size_t h) const
+{
+	size_t mask = _entries.size() - 1;
+	size_t i = h & mask;
+	while (_entries[i].used && !(_entries[i].hash == h
+		&& !std::memcmp(_entries[i].key.bytes, key.bytes, sizeof(key.bytes))))
+		i = (i + 1) & mask;
+	return i;
+}
+
+bool ConnectionThrottle::isExempt(const HostKey &key) const
+{
+	for (size_t i = 0; i < _exemptions.size(); i++)
+	{
+		unsigned int bits = _exemptions[i].bits;
+		size_t whole = bits / 8;
+		if (std::memcmp(key.bytes, _exemptions[i].key.bytes, whole))
+			continue;
+		unsigned char mask = 0xff << (8 - bits % 8);
+		if (bits % 8 && (key.bytes[whole] & mask) != (_exemptions[i].key.bytes[whole] & mask))
+			continue;
+		return true;
+	}
+	return false;
+}
+
+bool ConnectionThrottle::isStale(const Entry &entry, unsigned long now) const
+{
+	return entry.connections == 0 && now - entry.windowStart >= _window;
+}
+
+void ConnectionThrottle::erase(size_t i)
+{
+	size_t mask = _entries.size() - 1;
+	// backward shift: pull back every following entry that may live in the hole
+	size_t j = i;
+	while (true)
+	{
+		j = (j + 1) & mask;
+		if (!_entries[j].used)
+			break;
+		size_t home = _entries[j].hash & mask;
+		if (((j - home) & mask) < ((j - i) & mask))
+			continue; // still reachable from its home without crossing the hole
+		_entries[i] = _entries[j];
+		i = j;
+	}
+	_entries[i].used = false;
+	_count--;
+}
+
+void ConnectionThrottle::grow(void)
+{
+	std::vector<Entry> old;
+	old.swap(_entries);
+	Entry empty;
+	std::memset(&empty, 0, sizeof(empty));
+	_entries.assign(old.size() * 2, empty);
+	size_t mask = _entries.size() - 1;
+	for (size_t i = 0; i < old.size(); i++)
+	{
+		if (!old[i].used)
+			continue;
+		size_t j = old[i].hash & mask;
+		while (_entries[j].used)
+			j = (j + 1) & mask;
+		_entries[j] = old[i];
+	}
+	_sweep = 0;
+}
+
+void ConnectionThrottle::sweep(unsigned long now)
+{
+	for (size_t step = 0; step < THROTTLE_SWEEP_STEP; step++)
+	{
+		_sweep &= _entries.size() - 1;
+		if (_entries[_sweep].used && isStale(_entries[_sweep], now))
+			erase(_sweep); // something else may have shifted in, look at it next time
+		else
+			_sweep++;
+	}
+}
+
+// entry of the source, created on first sight, with its rate window rolled over
+ConnectionThrottle::Entry &ConnectionThrottle::lookup(const HostKey &key, unsigned long now)
+{
+	sweep(now);
+	if ((_count + 1) * 2 > _entries.size())
+		grow();
+	size_t h = hash(key);
+	Entry &entry = _entries[findSlot(key, h)];
+	if (!entry.used)
+	{
+		entry.hash = h;
+		entry.key = key;
+		entry.connections = 0;
+		entry.attempts = 0;
+		entry.windowStart = now;
+		entry.used = true;
+		entry.exempt = isExempt(key);
+		_count++;
+	}
+	if (now - entry.windowStart >= _window)
+	{
+		entry.windowStart = now;
+		entry.attempts = 0;
+	}
+	return entry;
+}
+
+ThrottleVerdict ConnectionThrottle::admit(const HostKey &key, unsigned long now)
+{
+	Entry &entry = lookup(key, now);
+	if (!entry.exempt)
+	{
+		if (entry.attempts >= _maxAttempts)
+		{
+			entry.windowStart = now; // a source that keeps hammering stays out until it pauses
+			return ThrottleTooFast;
+		}
+		entry.attempts++;
+		if (entry.connections >= _maxPerHost)
+			return ThrottleTooMany;
+	}
+	entry.connections++;
+	return ThrottleAdmit;
+}
+
+void ConnectionThrottle::attach(const HostKey &key, unsigned long now)
+{
+	lookup(key, now).connections++;
+}
+
+void ConnectionThrottle::release(const HostKey &key)
+{
+	Entry &entry = _entries[findSlot(key, hash(key))];
+	if (entry.used && entry.connections > 0)
+		entry.connections--; // the sweep drops it once its window is over
+}
+
+size_t ConnectionThrottle::size(void) const
+{
+	return _count;
+}
@@ -0,0 +1,170 @@
+#include "../include/History.hpp"
+#include "../include/ObjectPool.hpp"
+#include <sys/time.h>
+
+static ObjectPool<HistoryEntry>& entryPool(void)
+{
+	static ObjectPool<HistoryEntry> pool;
+	return pool;
+}
+
+void *HistoryEntry::operator new(size_t size)
+{
+	if (size != sizeof(HistoryEntry))
+		return ::operator new(size);
+	return entryPool().allocate();
+}
+
+void HistoryEntry::operator delete(void *ptr, size_t size)
+{
+	if (size != sizeof(HistoryEntry))
+		return ::operator delete(ptr);
+	entryPool().deallocate(ptr);
+}
+
+HistoryEntry	*ChannelHistory::_globalOldest = NULL;
+HistoryEntry	*ChannelHistory::_globalNewest = NULL;
+size_t			ChannelHistory::_bytes = 0;
+size_t			ChannelHistory::_maxLines = HISTORY_LINES;
+size_t			ChannelHistory::_maxBytes = HISTORY_MEMORY;
+uint64_t		ChannelHistory::_nextMsgid = 1;
+
+static size_t entryFootprint(const HistoryEntry *entry)
+{
+	return sizeof(HistoryEntry) + entry->line->footprint();
+}
+
+ChannelHistory::ChannelHistory(void)
+:_oldest(NULL),_newest(NULL),_count(0)
+{
+}
+
+ChannelHistory::ChannelHistory(const ChannelHistory &){}
+
+ChannelHistory& ChannelHistory::operator=(const ChannelHistory &){return *this;}
+
+ChannelHistory::~ChannelHistory(void)
+{
+	clear();
+}
+
+void ChannelHistory::dropOldest(void)
+{
+	HistoryEntry *entry = _oldest;
+	_oldest = entry->next;
+	if (_oldest)
+		_oldest->prev = NULL;
+	else
+		_newest = NULL;
+	_count--;
+
+	if (entry->olderGlobal)
+		entry->olderGlobal->newerGlobal = entry->newerGlobal;
+	else
+		_globalOldest = entry->newerGlobal;
+	if (entry->newerGlobal)
+		entry->newerGlobal->olderGlobal = entry->olderGlobal;
+	else
+		_globalNewest = entry->olderGlobal;
+
+	_bytes -= entryFootprint(entry);
+	entry->line->release();
+	delete entry;
+}
+
+void ChannelHistory::append(SharedLine *line, uint64_t msgid, uint64_t time)
+{
+	if (_maxLines == 0)
+		return;
+	HistoryEntry *entry = new HistoryEntry;
+	line->retain();
+	entry->line = line;
+	entry->msgid = msgid;
+	entry->time = time;
+	entry->owner = this;
+
+	entry->next = NULL;
+	entry->prev = _newest;
+	if (_newest)
+		_newest->next = entry;
+	else
+		_oldest = entry;
+	_newest = entry;
+	_count++;
+
+	entry->newerGlobal = NULL;
+	entry->olderGlobal = _globalNewest;
+	if (_globalNewest)
+		_globalNewest->newerGlobal = entry;
+	else
+		_globalOldest = entry;
+	_globalNewest = entry;
+	_bytes += entryFootprint(entry);
+
+	while (_count > _maxLines)
+		dropOldest();
+	while (_bytes > _maxBytes && _globalOldest)
+		_globalOldest->owner->dropOldest();
+}
+
+void ChannelHistory::record(SharedLine *line, uint64_t msgid, uint64_t time)
+{
+	append(line, msgid, time);
+	if (msgid >= _nextMsgid)
+		_nextMsgid = msgid + 1;
+}
+
+void ChannelHistory::clear(void)
+{
+	while (_oldest)
+		dropOldest();
+}
+
+const HistoryEntry *ChannelHistory::oldest(void) const
+{
+	return _oldest;
+}
+
+const HistoryEntry *ChannelHistory::newest(void) const
+{
+	return _newest;
+}
+
+size_t ChannelHistory::size(void) const
+{
+	return _count;
+}
+
+void ChannelHistory::configure(size_t maxLines, size_t maxBytes)
+{
+	_maxLines = maxLines;
+	_maxBytes = maxBytes;
+}
+
+size_t ChannelHistory::memoryUsed(void)
+{
+	return _bytes;
+}
+
+uint64_t ChannelHistory::nextMsgid(void)
+{
+	return _nextMsgid;
+}
+
+void ChannelHistory::setNextMsgid(uint64_t msgid)
+{
+	if (msgid > _nextMsgid)
+		_nextMsgid = msgid;
+}
+
+uint64_t ChannelHistory::takeMsgid(void)
+{
+	return _nextMsgid++;
+}
+
+uint64_t ChannelHistory::now(void)
+{
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return uint64_t(tv.tv_sec) * 1000 + tv.tv_usec / 1000;
+}
@@ -0,0 +1,399 @@
+#include "../include/server.hpp"
+#include "../include/Channel.hpp"
+#include "../include/HotRestart.hpp"
+#include "../include/Serializer.hpp"
+#include <sys/wait.h>
+#include <climits>
+
+extern char **environ;
+
+volatile sig_atomic_t Server::_restartSignal = 0;
+
+void Server::requestHotRestart(int)
+{
+	_restartSignal = 1;
+}
+
+/*
+	remembers how this process was started, the handoff re-runs the same
+	command. the path is resolved now: by the time of the restart the
+	file may have been replaced by a new build, which is the point.
+*/
+void Server::enableHotRestart(char **argv)
+{
+	char path[PATH_MAX];
+	ssize_t len = readlink("/proc/self/exe", path, sizeof(path) - 1);
+	_executable = len > 0 ? std::string(path, len) : argv[0];
+	_arguments.clear();
+	for (int i = 0; argv[i]; i++)
+		_arguments.push_back(argv[i]);
+}
+
+static bool writeAll(int fd, const char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t written = write(fd, data, size);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= written;
+	}
+	return true;
+}
+
+static bool readAll(int fd, char *data, size_t size)
+{
+	while (size > 0)
+	{
+		ssize_t got = read(fd, data, size);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		data += got;
+		size -= got;
+	}
+	return true;
+}
+
+static bool sendSockets(int fd, const std::vector<int> &sockets)
+{
+	for (size_t first = 0; first < sockets.size(); first += HANDOFF_FDS_PER_MESSAGE)
+	{
+		size_t count = std::min(sockets.size() - first, size_t(HANDOFF_FDS_PER_MESSAGE));
+		union {
+			struct cmsghdr	header;
+			char			buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+		} control;
+		std::memset(&control, 0, sizeof(control));
+		char byte = 'F';
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * count);
+		struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+		std::memcpy(CMSG_DATA(cmsg), &sockets[first], sizeof(int) * count);
+		ssize_t sent;
+		while ((sent = sendmsg(fd, &msg, 0)) < 0 && errno == EINTR)
+			;
+		if (sent != 1)
+			return false;
+	}
+	return true;
+}
+
+// one byte per message, so the ancillary data of two batches is never merged
+static bool receiveSockets(int fd, std::vector<int> &sockets, size_t count)
+{
+	while (sockets.size() < count)
+	{
+		union {
+			struct cmsghdr	header;
+			char			buffer[CMSG_SPACE(sizeof(int) * HANDOFF_FDS_PER_MESSAGE)];
+		} control;
+		char byte;
+		struct iovec iov;
+		iov.iov_base = &byte;
+		iov.iov_len = 1;
+		struct msghdr msg;
+		std::memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = control.buffer;
+		msg.msg_controllen = sizeof(control.buffer);
+		ssize_t got;
+		while ((got = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+			;
+		if (got != 1 || (msg.msg_flags & MSG_CTRUNC))
+			return false;
+		for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+		{
+			if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+				continue;
+			size_t received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+			const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+			sockets.insert(sockets.end(), fds, fds + received);
+		}
+	}
+	return sockets.size() == count;
+}
+
+/*
+STATE (HANDOFF_VERSION 7):
+	u32 magic, u32 version, u32 count of clients with a socket (links
+	included), u32 remote user count, u64 next history msgid,
+	u64 CHATHISTORY batches handed out, u32 next remote user id
+	then per client with a socket: u32 socket, u64 timer tick (0 when
+	unarmed), Client::save, u32 count + the nicks it MONITORs
+	then per remote user: u32 id, Client::save
+	u32 server count, then name, uplink, description, u32 hops, u32 link
+	u32 link count, then the link sockets in order
+	u32 channel count, then Channel::save for each
+	the sockets follow in the same order as the clients, after the listener.
+	timer ticks are absolute: CLOCK_MONOTONIC is shared by both processes.
+*/
+void Server::saveState(Serializer &out, std::vector<int> &sockets)
+{
+	std::map<int, Client *>::iterator local = _clients.lower_bound(0); // remote users have negative ids
+	out.putU32(HANDOFF_MAGIC);
+	out.putU32(HANDOFF_VERSION);
+	out.putU32(std::distance(local, _clients.end()));
+	out.putU32(std::distance(_clients.begin(), local));
+	out.putU64(ChannelHistory::nextMsgid());
+	out.putU64(_historyBatches);
+	out.putU32(_nextRemoteId);
+	sockets.push_back(_server_fd);
+	for (std::map<int, Client *>::iterator it = local; it != _clients.end(); it++)
+	{
+		TimerNode &timer = it->second->getTimer();
+		out.putU32(it->first);
+		out.putU64(timer.pending() ? timer.expires : 0);
+		it->second->save(out);
+		std::vector<std::string> watched = _monitor.list(it->first);
+		out.putU32(watched.size());
+		for (size_t i = 0; i < watched.size(); i++)
+			out.putString(watched[i]);
+		sockets.push_back(it->first);
+	}
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != local; it++)
+	{
+		out.putU32(it->first);
+		it->second->save(out);
+	}
+	out.putU32(_servers.size());
+	for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); it++)
+	{
+		out.putString(it->second.name);
+		out.putString(it->second.uplink);
+		out.putString(it->second.description);
+		out.putU32(it->second.hops);
+		out.putU32(it->second.link);
+	}
+	out.putU32(_links.size());
+	for (size_t i = 0; i < _links.size(); i++)
+		out.putU32(_links[i]);
+	out.putU32(_channels.size());
+	for (size_t i = 0; i < _channels.capacity(); i++)
+		if (_channels.channelAt(i))
+			_channels.channelAt(i)->save(out);
+}
+
+static void indexUser(UserIndex &index, int id, Client &client)
+{
+	index.addHost(id, client.getHostname());
+	if (*client.getNickname())
+		index.setNickname(id, "", client.getNickname());
+	if (*client.getUsername())
+		index.setUsername(id, "", client.getUsername());
+}
+
+static int renumberedLink(const std::map<int, int> &renumbered, int link)
+{
+	std::map<int, int>::const_iterator found = renumbered.find(link);
+	if (link < 0 || found == renumbered.end())
+		throw std::runtime_error("Handoff: unknown link socket");
+	return found->second;
+}
+
+void Server::restoreState(Deserializer &in, const std::vector<int> &sockets)
+{
+	if (in.getU32() != HANDOFF_MAGIC || in.getU32() != HANDOFF_VERSION)
+		throw std::runtime_error("Handoff state from an incompatible build");
+	uint32_t clients = in.getU32();
+	uint32_t remotes = in.getU32();
+	if (sockets.size() != clients + 1)
+		throw std::runtime_error("Handoff socket count mismatch");
+	ChannelHistory::setNextMsgid(in.getU64());
+	_historyBatches = in.getU64();
+	_nextRemoteId = static_cast<int32_t>(in.getU32());
+
+	_server_fd = sockets[0];
+	addPollfd(_server_fd, POLLIN | POLLERR | POLLHUP);
+
+	std::map<int, int> renumbered; // socket in the old process -> here
+	for (uint32_t i = 1; i <= clients; i++)
+	{
+		int oldSocket = in.getU32();
+		unsigned long expires = in.getU64();
+		Client *client = Client::load(in, sockets[i]);
+		_clients[sockets[i]] = client;
+		for (uint32_t count = in.getU32(); count > 0; count--)
+			_monitor.add(sockets[i], in.getString());
+		renumbered[oldSocket] = sockets[i];
+		if (!client->getFlag(ClientServerLink)) // a link is not a user
+			indexUser(_userIndex, sockets[i], *client);
+		HostKey host;
+		if (HostKey::fromString(client->getIp(), host))
+			_throttle.attach(host, _timers.now());
+		if (expires)
+			_timers.schedule(client->getTimer(), expires);
+		addPollfd(sockets[i], POLLIN | POLLERR | POLLHUP | (client->outboundReady() ? POLLOUT : 0));
+	}
+	for (uint32_t i = 0; i < remotes; i++)
+	{
+		int id = static_cast<int32_t>(in.getU32());
+		Client *user = Client::load(in, id);
+		std::map<int, int>::iterator link = renumbered.find(user->getLink());
+		if (id >= 0 || link == renumbered.end() || _clients.count(id))
+		{
+			delete user;
+			throw std::runtime_error("Handoff: remote user behind an unknown link");
+		}
+		user->setLink(link->second);
+		_clients[id] = user;
+		renumbered[id] = id; // channels list it under the same id
+		indexUser(_userIndex, id, *user);
+	}
+	for (uint32_t count = in.getU32(); count > 0; count--)
+	{
+		RemoteServer server;
+		server.name = in.getString();
+		server.uplink = in.getString();
+		server.description = in.getString();
+		server.hops = in.getU32();
+		server.link = renumberedLink(renumbered, in.getU32());
+		_servers[server.name] = server;
+	}
+	for (uint32_t count = in.getU32(); count > 0; count--)
+		_links.push_back(renumberedLink(renumbered, in.getU32()));
+	for (uint32_t count = in.getU32(); count > 0; count--)
+	{
+		Channel *channel = Channel::load(in, this, renumbered);
+		if (!_channels.insert(channel->getName(), channel))
+			delete channel;
+	}
+	invalidateChannelList();
+}
+
+// the new process: takes over everything the old one sends, then acknowledges
+void Server::adoptState(int handoff)
+{
+	char header[8];
+	if (!readAll(handoff, header, sizeof(header)))
+		throw std::runtime_error("Handoff: no state received");
+	uint64_t size = Deserializer(header, sizeof(header)).getU64();
+	std::string state(size, '\0');
+	if (size && !readAll(handoff, &state[0], size))
+		throw std::runtime_error("Handoff: truncated state");
+	Deserializer counts(state.data(), state.size());
+	counts.getU32(); // magic and version, checked by restoreState
+	counts.getU32();
+	uint32_t clients = counts.getU32();
+	std::vector<int> sockets;
+	if (!receiveSockets(handoff, sockets, clients + 1))
+		throw std::runtime_error("Handoff: sockets missing");
+	Deserializer in(state.data(), state.size());
+	restoreState(in, sockets);
+	char ack = HANDOFF_ACK;
+	if (!writeAll(handoff, &ack, 1))
+		throw std::runtime_error("Handoff: old process went away");
+	close(handoff);
+	unsetenv(HANDOFF_ENV);
+	std::cout << "Took over " << clients << " clients and " << _channels.size() << " channels" << std::endl;
+}
+
+/*
+	called from run() on every pass once SIGUSR2 came in. true when the
+	new process took over and this one has to stop.
+*/
+bool Server::checkHotRestart(void)
+{
+	if (_restartSignal)
+	{
+		_restartSignal = 0;
+		if (!_restartPending)
+			_restartRequestedAt = _timers.now();
+		_restartPending = true;
+	}
+	if (!_restartPending)
+		return false;
+	bool streaming = false;
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end() && !streaming; it++)
+		streaming = it->second->getPendingReply() != NULL;
+	if (streaming && _timers.now() - _restartRequestedAt < HANDOFF_DRAIN_TIMEOUT)
+		return false;
+	_restartPending = false;
+	return hotRestart();
+}
+
+bool Server::hotRestart(void)
+{
+	if (_executable.empty())
+		return false;
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0)
+	{
+		std::cerr << CMD_RED << "Hot restart: socketpair: " << strerror(errno) << CMD_RESET << std::endl;
+		return false;
+	}
+	fcntl(pair[0], F_SETFD, FD_CLOEXEC);
+
+	// everything the child needs is built before the fork
+	std::ostringstream handoffVar;
+	handoffVar << HANDOFF_ENV << "=" << pair[1];
+	std::string handoff = handoffVar.str();
+	std::vector<char *> argv;
+	for (size_t i = 0; i < _arguments.size(); i++)
+		argv.push_back(const_cast<char *>(_arguments[i].c_str()));
+	argv.push_back(NULL);
+	std::vector<char *> envp;
+	for (char **env = environ; *env; env++)
+		if (std::strncmp(*env, HANDOFF_ENV "=", sizeof(HANDOFF_ENV)))
+			envp.push_back(*env);
+	envp.push_back(const_cast<char *>(handoff.c_str()));
+	envp.push_back(NULL);
+
+	std::cout << CMD_YELLOW << "Hot restart: handing over to " << _executable << CMD_RESET << std::endl;
+	_log.flush(); // the new process rebuilds the log index from the files
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		close(pair[0]);
+		close(pair[1]);
+		return false;
+	}
+	if (pid == 0)
+	{
+		execve(_executable.c_str(), &argv[0], &envp[0]);
+		_exit(127);
+	}
+	close(pair[1]);
+
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); it++)
+		it->second->setPendingReply(NULL); // past the drain timeout: cut, not carried over
+	Serializer out;
+	std::vector<int> sockets;
+	saveState(out, sockets);
+	Serializer header;
+	header.putU64(out.data().size());
+	char ack = 0;
+	struct pollfd waitAck;
+	waitAck.fd = pair[0];
+	waitAck.events = POLLIN;
+	bool handedOver = writeAll(pair[0], header.data().data(), header.data().size())
+		&& writeAll(pair[0], out.data().data(), out.data().size())
+		&& sendSockets(pair[0], sockets)
+		&& poll(&waitAck, 1, HANDOFF_ACK_TIMEOUT_MS) == 1
+		&& read(pair[0], &ack, 1) == 1 && ack == HANDOFF_ACK;
+	close(pair[0]);
+	if (!handedOver)
+	{
+		std::cerr << CMD_RED << "Hot restart failed, still serving" << CMD_RESET << std::endl;
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return false;
+	}
+	std::cout << CMD_YELLOW << "Hot restart: process " << pid << " took over" << CMD_RESET << std::endl;
+	return true;
+}
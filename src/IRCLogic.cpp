@@ -13,6 +13,10 @@
 #include "../include/server.hpp"
 #include "../include/Client.hpp"
 #include "../include/Channel.hpp"
+#include "../include/Mask.hpp"
+#include <set>
+#include <cstdio>
+#include <climits>
 
 /**
  * Authenticates a client by checking the provided password against the server's password.
@@ -23,20 +27,67 @@
  * @param socket The socket of the client.
  * @param password The password provided by the client.
  */
-void Server::PASS(int socket, std::string password)
+void Server::PASS(int socket, const std::string &password)
 {
 	Client &client = getClient(socket);
 	if (client.isAuthenticated())
-		sendMessageToClient(socket, prefix() + "462 You may not reregister");
+		reply(socket, 462, {}, "You may not reregister");
 	else if (password != _password)
-		sendMessageToClient(socket, prefix() + "464 Invalid password");
+		reply(socket, 464, {}, "Invalid password");
 	else
 		client.setAuthenticated(true);
 }
 
+static void addWelcomeLine(std::string &tpl, const std::string &prefix, const char *numeric, const std::string &text)
+{
+	tpl += prefix;
+	tpl += numeric;
+	tpl += " ";
+	tpl += '\0'; // nickname slot
+	tpl += " :";
+	tpl += text;
+	tpl += "\r\n";
+}
+
+/**
+ * Pre-renders the welcome / ISUPPORT / MOTD burst sent on registration.
+ * The burst is kept split on every place the nickname goes, so registering
+ * a client is only a matter of gluing the parts around its nickname.
+ */
+void Server::renderWelcomeTemplate(void)
+{
+	std::string tpl;
+	addWelcomeLine(tpl, prefix(), "001", std::string("Welcome to the Internet Relay Network ") + '\0');
+	addWelcomeLine(tpl, prefix(), "002", "Your host is " + _serverName + ", running version 1.0");
+	addWelcomeLine(tpl, prefix(), "003", "This server was created 1970/01/01 00:00:00");
+	addWelcomeLine(tpl, prefix(), "004", _serverName + " 1.0 o o");
+	std::ostringstream isupport;
+	isupport << "CHANTYPES=# PREFIX=(ov)@+ CHANMODES=beI,k,l,imst EXCEPTS INVEX NICKLEN=9 ELIST=CMNTU SAFELIST CHATHISTORY=" << CHATHISTORY_MAX
+		<< " TARGMAX=PRIVMSG:" << MESSAGE_TARGETS_MAX << ",NOTICE:" << MESSAGE_TARGETS_MAX << " MONITOR=" << _monitor.getLimit()
+		<< " MODES=" << MODES_MAX << " MAXLIST=beI:" << MASK_LIST_MAX * MaskListCount;
+	tpl += prefix() + "005 " + '\0' + " " + isupport.str() + " :are supported by this server\r\n";
+	addWelcomeLine(tpl, prefix(), "375", "- " + _serverName + " Message of the day - ");
+	const std::vector<std::string> &motd = _motd.getLines();
+	for (size_t i = 0; i < motd.size(); i++)
+		addWelcomeLine(tpl, prefix(), "372", "- " + motd[i]);
+	addWelcomeLine(tpl, prefix(), "376", "End of /MOTD command.");
+
+	_welcomeTemplate.clear();
+	size_t start = 0;
+	size_t slot;
+	while ((slot = tpl.find('\0', start)) != std::string::npos)
+	{
+		_welcomeTemplate.push_back(tpl.substr(start, slot - start));
+		start = slot + 1;
+	}
+	_welcomeTemplate.push_back(tpl.substr(start));
+	_welcomeSize = tpl.size();
+}
+
 /**
  * Registers a new client with the server.
- * Sets the client's registered flag to true and sends welcome messages to the client.
+ * Sets the client's registered flag to true and queues the pre-rendered
+ * welcome burst, with the client's nickname filled in, as a single write.
  *
  * @param socket The socket of the new client.
  */
@@ -44,16 +95,23 @@ void Server::registerNewClient(int socket)
 {
 	Client& client = getClient(socket);
 	client.setRegistered(true);
-	sendMessageToClient(socket, prefix() + "001 " + client.getNickname() + " : Welcome " + client.getNetworkIdentifier());
-	sendMessageToClient(socket, prefix() + "002 " + client.getNickname() + " : Your host is " + "ircserv" + ", running version 1.0");
-	sendMessageToClient(socket, prefix() + "003 " + client.getNickname() + " : This server was created 1970/01/01 00:00:00");
-	sendMessageToClient(socket, prefix() + "004 " + client.getNickname() + " : ircserv 1.0 o o");
-	sendMessageToClient(socket, prefix() + "005 " + client.getNickname() + " : CHANMODES=s,k,l,i,t :are supported by this server"); // mandatory only
-	sendMessageToClient(socket, prefix() + "375 " + client.getNickname() + " : - " + "ircserv" + " MOTD - ");
-	sendMessageToClient(socket, prefix() + "372 " + client.getNickname() + " : - Welcome to the Internet Relay Network!");
-	sendMessageToClient(socket, prefix() + "372 " + client.getNickname() + " : - Please remember to respect the members and follow the rules.");
-	sendMessageToClient(socket, prefix() + "372 " + client.getNickname() + " : - Enjoy your stay!");
-	sendMessageToClient(socket, prefix() + "376 " + client.getNickname() + " : End of /MOTD command.");
+	_timers.schedule(client.getTimer(), _timers.now() + PING_INTERVAL); // from now on it's an idle check
+	if (_motd.refresh() || _welcomeTemplate.empty())
+		renderWelcomeTemplate();
+	const char *nickname = client.getNickname();
+	size_t nicklen = std::strlen(nickname);
+	std::string burst;
+	burst.reserve(_welcomeSize + (_welcomeTemplate.size() - 1) * nicklen);
+	burst += _welcomeTemplate[0];
+	for (size_t i = 1; i < _welcomeTemplate.size(); i++)
+	{
+		burst.append(nickname, nicklen);
+		burst += _welcomeTemplate[i];
+	}
+	sendRawToClient(socket, burst);
+	propagate(prefix() + "NICK " + nickname + " " + client.getUsername() + " " + client.getHostname()
+		+ " :" + client.getRealname(), -1); // the rest of the network learns about it
+	notifyWatchers(nickname, client.getNetworkIdentifier());
 }
 
 /**
@@ -62,30 +120,47 @@ void Server::registerNewClient(int socket)
  * @param socket The socket of the client.
  * @param nickname The desired nickname for the client.
  */
-void Server::NICK(int socket, std::string nickname)
+void Server::NICK(int socket, const std::string &nickname)
 {
 	Client &client = getClient(socket);
-	if (nickname.size() < 1 || nickname.size() > 9
+	if (nickname.size() < 1 || nickname.size() > NICK_MAX_LEN
 	|| nickname.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789[]\\`_^{|}-") != std::string::npos
 	|| nickname.find_first_of("0123456789-", 0, 1) == 0)
 	{
-		sendMessageToClient(socket, prefix() + "432 " + nickname + " : Erroneous nickname");
+		reply(socket, 432, {nickname}, "Erroneous nickname");
 		return;
 	}
-	try
+	Client *owner = findClient(nickname);
+	if (owner && owner != &client) // a case change of one's own nick is fine
 	{
-		getClient(nickname);
-		sendMessageToClient(socket, prefix() + "433 " + nickname + " : Nickname is already in use");
+		reply(socket, 433, {nickname}, "Nickname is already in use");
+		return;
 	}
-	catch (std::runtime_error &)
+	std::vector<Channel *> channels = getClientChannels(socket);
+	for (size_t i = 0; i < channels.size(); i++)
 	{
-		std::stringstream broadcast;
-		broadcast << client.prefix() << "NICK " << nickname;
-		if (client.getUsername() != "" && !client.isRegistered())
-			registerNewClient(socket);
-		client.setNickname(nickname);
-		sendMessageToClientChannels(socket, broadcast.str());
+		if (channels[i]->isBanned(socket) && !channels[i]->isOperator(socket) && !channels[i]->hasVoice(socket))
+		{
+			reply(socket, 435, {nickname, channels[i]->getName()}, "Cannot change nickname while banned on channel");
+			return;
+		}
 	}
+	std::stringstream broadcast;
+	broadcast << client.prefix() << "NICK " << nickname;
+	if (client.isRegistered())
+		notifyWatchers(client.getNickname(), "");
+	for (size_t i = 0; i < channels.size(); i++)
+		channels[i]->renameClient(socket, client.getNickname(), nickname);
+	_userIndex.setNickname(socket, client.getNickname(), nickname);
+	client.setNickname(nickname);
+	if (client.isRegistered())
+	{
+		propagate(broadcast.str(), -1);
+		notifyWatchers(nickname, client.getNetworkIdentifier());
+	}
+	else if (*client.getUsername() && !client.getFlag(ClientCapNegotiating))
+		registerNewClient(socket); // the burst needs the new nickname
+	sendMessageToClientChannels(socket, broadcast.str());
 }
 
 /**
@@ -96,7 +171,7 @@ void Server::NICK(int socket, std::string nickname)
  * @param socket The socket of the client.
  * @param args The arguments passed with the command.
  */
-void Server::USER(int socket, std::string args)
+void Server::USER(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::string username;
@@ -109,26 +184,30 @@ void Server::USER(int socket, std::string args)
 	std::getline(ss,skip, ':'); // skip the 0 and * (unused fields)
 	ss >> std::ws; // skip whitespace
 	std::getline(ss, realname, '\0');
-	if (username.size() < 1 || username.size() > 12
+	if (username.size() < 1 || username.size() > USER_MAX_LEN
 		|| username.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789") != std::string::npos
 		|| username.find_first_of("0123456789", 0, 1) == 0)
 	{
-		sendMessageToClient(socket, prefix() + "432 " + username + " : Erroneous username");
+		reply(socket, 432, {username}, "Erroneous username");
 		return;
 	}
 	if (!realname.empty() 
 		&& (realname.size() > 50 
 			|| realname.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789[]\\`_^{|}- ") != std::string::npos))
 	{
-		sendMessageToClient(socket, prefix() + "501 " + realname + " : Invalid realname");
+		reply(socket, 501, {realname}, "Invalid realname");
 		return;
 	}
 	std::stringstream broadcast;
 	broadcast << client.prefix() << "USER " << args;
 
+	_userIndex.setUsername(socket, client.getUsername(), username);
 	client.setUsername(username);
-	client.setRealname(realname);
-	if (client.getNickname() != "" && !client.isRegistered())
+	client.setRealname(std::move(realname));
+	std::vector<Channel *> channels = getClientChannels(socket);
+	for (size_t i = 0; i < channels.size(); i++)
+		channels[i]->forgetVerdict(socket); // the masks see the new user name
+	if (*client.getNickname() && !client.isRegistered() && !client.getFlag(ClientCapNegotiating))
 		registerNewClient(socket);
 	sendMessageToClientChannels(socket, broadcast.str());
 }
@@ -139,202 +218,859 @@ void Server::USER(int socket, std::string args)
  * @param socket The socket of the client.
  * @param args The arguments received from the client.
  */
-void Server::PING(int socket, std::string args)
+void Server::PING(int socket, const std::string &args)
 {
 	sendMessageToClient(socket, prefix() + "PONG " + args);
 }
 
 /**
- * Sends a list of channels and their information to the client.
+ * Handles the answer to a server PING.
+ * Any received data already counts as activity, so this only has to
+ * keep the PONG from being answered like a PING.
+ *
+ * @param socket The socket of the client.
+ * @param args The token echoed by the client.
+ */
+void Server::PONG(int socket, const std::string &args)
+{
+	(void)args;
+	getClient(socket).setFlag(ClientPingSent, false);
+}
+
+/**
+ * Sends the member list of one or more comma separated channels.
+ * Secret channels the client is not on only get the end of list reply.
+ *
+ * @param socket The socket of the client.
+ * @param args The arguments passed to the NAMES command.
+ */
+void Server::NAMES(int socket, const std::string &args)
+{
+	Client &client = getClient(socket);
+	std::stringstream ss(args);
+	std::string channels;
+	std::string channel_name;
+	ss >> channels;
+	std::stringstream list(channels);
+	while (std::getline(list, channel_name, ','))
+	{
+		Channel *channel = findChannel(channel_name);
+		if (channel && (!channel->getMode(ChanSecret) || channel->hasClient(socket)))
+		{
+			channel->sendNames(socket, client.getNickname());
+			continue;
+		}
+		reply(socket, 366, {channel_name}, "End of /NAMES list");
+	}
+}
+
+static const struct {
+	const char	*name;
+	ClientFlag	flag;
+} g_capabilities[] = {
+	{"batch", ClientBatch},
+	{"draft/no-implicit-names", ClientNoImplicitNames},
+	{"message-tags", ClientMessageTags},
+	{"server-time", ClientServerTime}
+};
+
+static const size_t g_capabilityCount = sizeof(g_capabilities) / sizeof(g_capabilities[0]);
+
+/**
+ * Handles IRCv3 capability negotiation (CAP LS / LIST / REQ / END).
+ * While a client negotiates before registering, registration is held back
+ * until it sends CAP END.
  *
  * @param socket The socket of the client.
- * @param param Unused parameter.
+ * @param args The arguments passed to the CAP command.
  */
-void Server::LIST(int socket, std::string)
+void Server::CAP(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
+	std::stringstream ss(args);
+	std::string subcommand;
+	std::string requested;
+	ss >> subcommand >> std::ws;
+	std::getline(ss, requested, '\0');
+	if (!requested.empty() && requested[0] == ':')
+		requested = requested.substr(1);
+	std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+	std::string nickname = *client.getNickname() ? client.getNickname() : "*";
 
-	sendMessageToClient(socket, prefix() + "321 " + client.getNickname() + " Channel : Users Name");
-	std::map<std::string, Channel *>::iterator it = _channels.begin();
-	for (; it != _channels.end(); it++)
+	if (subcommand == "LS" || subcommand == "LIST")
 	{
-		std::stringstream ss;
-		Channel& cn = *it->second;
-		if (cn.getMode(ChanSecret) && !cn.hasClient(socket))
-			continue; // skip secret channels if not a member of it
-			
-		ss << prefix() << "322 " << client.getNickname() << " " << cn.getName() << " " << cn.getClientCount()  << " : " << cn.getTopic();
-		sendMessageToClient(socket, ss.str());
+		if (subcommand == "LS" && !client.isRegistered())
+			client.setFlag(ClientCapNegotiating, true);
+		std::string caps;
+		for (size_t i = 0; i < g_capabilityCount; i++)
+		{
+			if (subcommand == "LIST" && !client.getFlag(g_capabilities[i].flag))
+				continue;
+			caps += caps.empty() ? "" : " ";
+			caps += g_capabilities[i].name;
+		}
+		sendMessageToClient(socket, prefix() + "CAP " + nickname + " " + subcommand + " :" + caps);
+	}
+	else if (subcommand == "REQ")
+	{
+		if (!client.isRegistered())
+			client.setFlag(ClientCapNegotiating, true);
+		std::vector<std::pair<ClientFlag, bool> > changes;
+		std::stringstream list(requested);
+		std::string cap;
+		while (list >> cap)
+		{
+			bool enable = cap[0] != '-';
+			if (!enable)
+				cap = cap.substr(1);
+			size_t i = 0;
+			while (i < g_capabilityCount && cap != g_capabilities[i].name)
+				i++;
+			if (i == g_capabilityCount)
+			{
+				sendMessageToClient(socket, prefix() + "CAP " + nickname + " NAK :" + requested);
+				return;
+			}
+			changes.push_back(std::make_pair(g_capabilities[i].flag, enable));
+		}
+		for (size_t i = 0; i < changes.size(); i++)
+			client.setFlag(changes[i].first, changes[i].second);
+		sendMessageToClient(socket, prefix() + "CAP " + nickname + " ACK :" + requested);
+	}
+	else if (subcommand == "END")
+	{
+		if (!client.getFlag(ClientCapNegotiating))
+			return;
+		client.setFlag(ClientCapNegotiating, false);
+		if (*client.getNickname() && *client.getUsername() && !client.isRegistered())
+			registerNewClient(socket);
+	}
+	else
+		reply(socket, 410, {subcommand}, "Invalid CAP command");
+}
+
+/*
+	LIST filters, advertised as ELIST=CMNTU:
+		>n / <n			more / fewer than n users
+		C>n / C<n		created more / less than n minutes ago
+		T>n / T<n		topic changed more / less than n minutes ago
+		mask / !mask	channel name matching / not matching the mask
+*/
+struct ListFilter {
+	int							minUsers; // exclusive bounds, -1 when unset
+	int							maxUsers;
+	time_t						createdAfter; // 0 when unset
+	time_t						createdBefore;
+	time_t						topicAfter;
+	time_t						topicBefore;
+	std::vector<std::string>	masks;
+	std::vector<std::string>	excludes;
+
+								ListFilter(void)
+								:minUsers(-1),maxUsers(-1),createdAfter(0),createdBefore(0),topicAfter(0),topicBefore(0)
+								{}
+
+	void						parse(const std::string &); // a malformed token is skipped, as other servers do
+	bool						accepts(const ChannelListEntry &) const;
+};
+
+void ListFilter::parse(const std::string &args)
+{
+	std::stringstream ss(args);
+	std::string filters;
+	std::string filter;
+	ss >> filters;
+	std::stringstream list(filters);
+	time_t now = time(NULL);
+	while (std::getline(list, filter, ','))
+	{
+		if (filter.empty())
+			continue;
+		size_t skip = (filter[0] == 'C' || filter[0] == 'T') && filter.size() > 1
+			&& (filter[1] == '<' || filter[1] == '>') ? 1 : 0;
+		char op = filter[skip];
+		if (op != '<' && op != '>')
+		{
+			if (filter[0] == '!')
+				excludes.push_back(filter.substr(1));
+			else
+				masks.push_back(filter);
+			continue;
+		}
+		std::string number = filter.substr(skip + 1);
+		errno = 0;
+		long value = std::strtol(number.c_str(), NULL, 10);
+		if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos
+			|| errno == ERANGE || value > INT_MAX)
+			continue;
+		if (skip == 0 && op == '>')
+			minUsers = value;
+		else if (skip == 0)
+			maxUsers = value;
+		else
+		{
+			time_t &bound = filter[0] == 'C'
+				? (op == '<' ? createdAfter : createdBefore)
+				: (op == '<' ? topicAfter : topicBefore);
+			bound = now - value * 60;
+		}
 	}
-	sendMessageToClient(socket, prefix() + "323 " + client.getNickname() + " : End of /LIST");
 }
 
+bool ListFilter::accepts(const ChannelListEntry &entry) const
+{
+	if ((minUsers >= 0 && entry.users <= minUsers) || (maxUsers >= 0 && entry.users >= maxUsers))
+		return false;
+	if ((createdAfter && entry.createdAt <= createdAfter) || (createdBefore && entry.createdAt >= createdBefore))
+		return false;
+	if ((topicAfter && entry.topicTime <= topicAfter) || (topicBefore && entry.topicTime >= topicBefore))
+		return false;
+	const std::string &name = entry.channel->getName();
+	for (size_t i = 0; i < excludes.size(); i++)
+		if (matchMask(excludes[i], name))
+			return false;
+	if (masks.empty())
+		return true;
+	for (size_t i = 0; i < masks.size(); i++)
+		if (matchMask(masks[i], name))
+			return true;
+	return false;
+}
+
+static bool listKeyLess(const std::string &key, const ChannelListEntry &entry)
+{
+	return key < entry.key;
+}
+
+/*
+	walks the server's rendered channel list, a slice at a time. if the
+	list gets re-rendered in between, the walk resumes after the last key.
+*/
+class ListReply : public PendingReply {
+	private:
+		ListFilter		_filter;
+		std::string		_lastKey;
+		size_t			_next;
+		unsigned long	_generation;
+	public:
+						ListReply(const ListFilter &filter, unsigned long generation)
+						:_filter(filter),_next(0),_generation(generation)
+						{}
+
+		bool			resume(Server &server, int socket)
+		{
+			const std::vector<ChannelListEntry> &list = server.getChannelList();
+			if (server.getChannelListGeneration() != _generation)
+			{
+				_generation = server.getChannelListGeneration();
+				if (_next > 0)
+					_next = std::upper_bound(list.begin(), list.end(), _lastKey, listKeyLess) - list.begin();
+			}
+			Client &client = server.getClient(socket);
+			while (_next < list.size() && client.getOutboundSize() < REPLY_HIGH_WATER)
+			{
+				const ChannelListEntry &entry = list[_next++];
+				_lastKey = entry.key;
+				if (!_filter.accepts(entry) || (entry.secret && !entry.channel->hasClient(socket)))
+					continue; // secret channels are only listed to their members
+				server.reply(socket, 322, {entry.name, entry.users}, entry.topic);
+			}
+			if (_next < list.size())
+				return false;
+			server.reply(socket, 323, {}, "End of /LIST");
+			return true;
+		}
+};
+
 /**
- * Joins a client to a channel.
- * 
+ * Sends a list of channels and their information to the client.
+ * The list comes from a cached rendering that is only rebuilt after a
+ * channel changed, and is streamed while the client's send queue drains.
+ *
+ * @param socket The socket of the client.
+ * @param args Optional comma separated ELIST filters.
+ */
+void Server::LIST(int socket, const std::string &args)
+{
+	Client &client = getClient(socket);
+	ListFilter filter;
+	filter.parse(args);
+	getChannelList();
+	reply(socket, 321, {"Channel"}, "Users Name");
+	client.setPendingReply(new ListReply(filter, getChannelListGeneration()));
+	resumePendingReply(socket);
+}
+
+// what "ss >> word >> std::ws" gives, without the stream: rest is left after the spaces
+static std::string_view nextWord(std::string_view &rest)
+{
+	rest.remove_prefix(std::min(rest.find_first_not_of(WHITESPACE), rest.size()));
+	std::string_view word = rest.substr(0, rest.find_first_of(WHITESPACE));
+	rest.remove_prefix(word.size());
+	rest.remove_prefix(std::min(rest.find_first_not_of(WHITESPACE), rest.size()));
+	return word;
+}
+
+/*
+	splits "a,b,,c" on commas; empty items stay, so that keys keep lining
+	up with their channels
+*/
+static std::vector<std::string> splitList(const std::string &list)
+{
+	std::vector<std::string> items;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+		items.push_back(item);
+	return items;
+}
+
+/**
+ * Joins a client to channels: JOIN <channel>{,<channel>} [<key>{,<key>}],
+ * or JOIN 0 to leave every channel. The whole list is checked and joined
+ * in one pass, and everything the joiner gets back (its own JOIN lines,
+ * topics, names, modes and errors) goes out as a single write.
+ *
  * @param socket The socket of the client.
  * @param args The arguments passed to the JOIN command.
  */
-void Server::JOIN(int socket, std::string args)
+void Server::JOIN(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::stringstream ss(args);
-	std::string channel_name;
-	std::string channel_pass;
-	ss >> channel_name >> std::ws;
-	ss >> channel_pass;
-	if (channel_name.empty())
+	std::string names;
+	std::string keys;
+	ss >> names >> keys;
+	if (names.empty())
 	{
-		sendMessageToClient(socket, prefix() + "461 JOIN : Not enough parameters");
+		reply(socket, 461, {"JOIN"}, "Not enough parameters");
 		return;
 	}
-	if (channel_name[0] == '#')
-		channel_name = channel_name.substr(1);
-	// validate channel name
-	if (channel_name.size() < 1 || channel_name.size() > 20
-		|| channel_name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != std::string::npos
-		|| channel_name.find_first_of("0123456789_", 0, 1) == 0)
+	if (names == "0")
 	{
-		sendMessageToClient(socket, prefix() + "403 " + channel_name + " : No such channel");
+		std::vector<Channel *> channels = getClientChannels(socket);
+		for (size_t i = 0; i < channels.size(); i++)
+			leaveChannel(socket, *channels[i], "");
 		return;
 	}
-	channel_name = "#" + channel_name;
-	try
+	std::vector<std::string> channel_names = splitList(names);
+	std::vector<std::string> channel_keys = splitList(keys);
+	for (size_t i = 0; i < channel_names.size(); i++)
 	{
-		Channel &channel = getChannel(channel_name);
-		channel_name = channel.getName();
-		if (channel.getMode(ChannelKey) && (channel_pass.empty() || channel_pass != channel.getPass()))
+		std::string channel_name = channel_names[i];
+		std::string channel_pass = i < channel_keys.size() ? channel_keys[i] : "";
+		if (!channel_name.empty() && channel_name[0] == '#')
+			channel_name = channel_name.substr(1);
+		// validate channel name
+		if (channel_name.size() < 1 || channel_name.size() > 20
+			|| channel_name.find_first_not_of("abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_") != std::string::npos
+			|| channel_name.find_first_of("0123456789_", 0, 1) == 0)
 		{
-			sendMessageToClient(socket, prefix() + "475 " + channel_name + " : Cannot join channel (+k)");
-			return;
+			reply(socket, 403, {channel_name}, "No such channel");
+			continue;
 		}
-		if (channel.getMode(ChanInviteOnly) && !channel.hasInvite(socket))
+		channel_name = "#" + channel_name;
+		Channel *channel = findChannel(channel_name);
+		bool created = !channel;
+		if (channel && channel->hasClient(socket))
+			continue;
+		if (channel && channel->getMode(ChannelKey) && (channel_pass.empty() || channel_pass != channel->getPass()))
 		{
-			sendMessageToClient(socket, prefix() + "473 " + channel_name + " : Cannot join channel (+i)");
-			return;
+			reply(socket, 475, {channel->getName()}, "Cannot join channel (+k)");
+			continue;
 		}
-		if (channel.getMode(ChanLimit) && channel.getClientCount() >= channel.getLimit())
+		if (channel && channel->getMode(ChanInviteOnly) && !channel->hasInvite(socket) && !channel->isInviteExcepted(socket))
 		{
-			sendMessageToClient(socket, prefix() + "471 " + channel_name + " : Cannot join channel (+l)");
-			return;
+			reply(socket, 473, {channel->getName()}, "Cannot join channel (+i)");
+			continue;
+		}
+		if (channel && !channel->hasInvite(socket) && channel->isBanned(socket))
+		{
+			reply(socket, 474, {channel->getName()}, "Cannot join channel (+b)");
+			continue;
+		}
+		if (channel && channel->getMode(ChanLimit) && channel->getClientCount() >= channel->getLimit())
+		{
+			reply(socket, 471, {channel->getName()}, "Cannot join channel (+l)");
+			continue;
 		}
-		channel.addClient(socket);
-		channel.removeInvite(socket);
+		if (created)
+			channel = &createChannel(channel_name, channel_pass);
+		channel->addClient(socket);
+		channel->removeInvite(socket);
 		// if the first client to join the channel, set the channel operator
-		if (channel.getClientCount() == 1)
-			channel.addOperator(socket);
-		channel.broadcast(client.prefix() + "JOIN " + channel_name);
+		if (channel->getClientCount() == 1)
+			channel->addOperator(socket);
+		channel->broadcastEvent(client.prefix() + "JOIN " + channel->getName()); // the joiner included
+		if (created && !channel_pass.empty())
+			propagate(prefix() + "MODE " + channel->getName() + " +k " + channel_pass, -1);
 		// send channel topic, names list, and channel modes
-		sendMessageToClient(socket, prefix() + "332 " + client.getNickname() + " " + channel_name + " : " + channel.getTopic());
-		sendMessageToClient(socket, prefix() + "353 " + client.getNickname() + " = " + channel_name + " : " + channel.getclientsNicknames());
-		sendMessageToClient(socket, prefix() + "324 " + client.getNickname() + " " + channel_name + " " + channel.getModeString());
-		
+		if (created)
+			reply(socket, 331, {channel->getName()}, "No topic is set");
+		else
+			reply(socket, 332, {channel->getName()}, channel->getTopic());
+		if (!client.getFlag(ClientNoImplicitNames))
+			channel->sendNames(socket, client.getNickname());
+		reply(socket, 324, {channel->getName(), channel->getModeString()});
 	}
-	catch (std::runtime_error &)
-	{
-		createChannel(channel_name, channel_pass);
-		Channel &channel = getChannel(channel_name);
-		channel.addClient(socket);
-		channel.addOperator(socket);
-		channel.broadcast(client.prefix() + "JOIN " + channel_name);
-		sendMessageToClient(socket, prefix() + "331 " + client.getNickname() + " " + channel_name + " :No topic is set");
-		sendMessageToClient(socket, prefix() + "353 " + client.getNickname() + " = " + channel_name + " : " + channel.getclientsNicknames());
-		sendMessageToClient(socket, prefix() + "324 " + client.getNickname() + " " + channel_name + " " + channel.getModeString());
+}
 
+// "timestamp=2024-05-23T18:04:31.000Z" or "msgid=42"
+static bool parseHistorySelector(const std::string &selector, bool &byMsgid, uint64_t &value)
+{
+	byMsgid = selector.compare(0, 6, "msgid=") == 0;
+	if (byMsgid)
+	{
+		std::string id = selector.substr(6);
+		if (id.empty() || id.find_first_not_of("0123456789") != std::string::npos)
+			return false;
+		value = std::strtoull(id.c_str(), NULL, 10);
+		return true;
 	}
+	if (selector.compare(0, 10, "timestamp=") != 0)
+		return false;
+	struct tm tm;
+	std::memset(&tm, 0, sizeof(tm));
+	int millis = 0;
+	int parsed = sscanf(selector.c_str() + 10, "%4d-%2d-%2dT%2d:%2d:%2d.%3dZ",
+		&tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &millis);
+	if (parsed < 6)
+		return false;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	time_t seconds = timegm(&tm);
+	if (seconds < 0)
+		return false;
+	value = uint64_t(seconds) * 1000 + millis;
+	return true;
+}
+
+static std::string formatServerTime(uint64_t millis)
+{
+	time_t seconds = millis / 1000;
+	struct tm tm;
+	gmtime_r(&seconds, &tm);
+	char text[64]; // room for any int the compiler can imagine in the fields
+	snprintf(text, sizeof(text), "%04d-%02d-%02dT%02d:%02d:%02d.%03dZ", tm.tm_year + 1900, tm.tm_mon + 1,
+		tm.tm_mday, tm.tm_hour, tm.tm_min, tm.tm_sec, int(millis % 1000));
+	return text;
+}
+
+// "@batch=<reference>;time=...;msgid=... " for the capabilities the client asked for
+static std::string historyTags(Client &client, const std::string &reference, uint64_t msgid, uint64_t time)
+{
+	std::ostringstream tags;
+	if (client.getFlag(ClientBatch))
+		tags << ";batch=" << reference;
+	if (client.getFlag(ClientServerTime))
+		tags << ";time=" << formatServerTime(time);
+	if (client.getFlag(ClientMessageTags))
+		tags << ";msgid=" << msgid;
+	return tags.str().empty() ? "" : "@" + tags.str().substr(1) + " ";
 }
 
 /**
- * Sends a private message to a target client or channel.
- * 
- * @param socket The socket of the client sending the message.
- * @param args The arguments containing the target and message.
+ * Replays the history of a channel the client is in (IRCv3 CHATHISTORY).
+ * - LATEST <target> <* | selector> <limit>: the newest lines, after the selector if one is given
+ * - BEFORE <target> <selector> <limit>: the lines right before the selector
+ * - AFTER <target> <selector> <limit>: the lines right after the selector
+ * Selectors are timestamp=<ISO 8601> or msgid=<id>. Lines older than the
+ * in-memory window are read back from the message log when there is one.
+ * Lines go out oldest
+ * first, as the stored SharedLines, behind @time / @msgid tags and inside a
+ * BATCH when the client negotiated server-time / message-tags / batch.
+ *
+ * @param socket The socket of the client.
+ * @param args The subcommand and its parameters.
  */
-void Server::PRIVMSG(int socket, std::string args)
+void Server::CHATHISTORY(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
-
-	std::string target;
-	std::string message;
 	std::stringstream ss(args);
-
-	ss >> target >> std::ws;
-	std::getline(ss, message, '\0');
-	if (target.empty())
+	std::string subcommand, target, selector, count;
+	ss >> subcommand >> target >> selector >> count;
+	std::transform(subcommand.begin(), subcommand.end(), subcommand.begin(), ::toupper);
+	if (subcommand != "LATEST" && subcommand != "BEFORE" && subcommand != "AFTER")
 	{
-		sendMessageToClient(socket, prefix() + "411 PRIVMSG : No recipient given");
+		sendMessageToClient(socket, prefix() + "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Unknown subcommand");
 		return;
 	}
-	if (message.empty())
+	bool byMsgid = false;
+	uint64_t mark = 0;
+	bool anywhere = subcommand == "LATEST" && selector == "*";
+	int limit = std::atoi(count.c_str());
+	if (target.empty() || count.find_first_not_of("0123456789") != std::string::npos || limit <= 0
+		|| (!anywhere && !parseHistorySelector(selector, byMsgid, mark)))
 	{
-		sendMessageToClient(socket, prefix() + "412 PRIVMSG : No text to send");
+		sendMessageToClient(socket, prefix() + "FAIL CHATHISTORY INVALID_PARAMS " + subcommand + " :Invalid parameters");
 		return;
 	}
-	try
+	limit = std::min(limit, CHATHISTORY_MAX);
+	Channel *channel = target[0] == '#' ? findChannel(target) : NULL;
+	if (!channel || !channel->hasClient(socket))
 	{
-		if (target[0] == '#')
+		sendMessageToClient(socket, prefix() + "FAIL CHATHISTORY INVALID_TARGET " + subcommand + " " + target + " :Messages could not be retrieved");
+		return;
+	}
+
+	// what the memory window does not cover comes from the message log, and
+	// is always older than what it does
+	std::vector<const HistoryEntry *> lines;
+	std::vector<LoggedLine> logged;
+	const ChannelHistory &history = channel->getHistory();
+	if (subcommand == "AFTER")
+	{
+		const HistoryEntry *oldest = history.oldest();
+		if (!oldest || (byMsgid ? oldest->msgid : oldest->time) > mark)
+		{
+			_log.after(channel->getName(), byMsgid, mark, limit, logged);
+			while (oldest && !logged.empty() && logged.back().msgid >= oldest->msgid)
+				logged.pop_back();
+		}
+		for (const HistoryEntry *entry = oldest; entry && int(logged.size() + lines.size()) < limit; entry = entry->next)
+			if ((byMsgid ? entry->msgid : entry->time) > mark)
+				lines.push_back(entry);
+	}
+	else
+	{
+		bool reached = false; // LATEST went back as far as its selector
+		for (const HistoryEntry *entry = history.newest(); entry && int(lines.size()) < limit; entry = entry->prev)
 		{
-			Channel &channel = getChannel(target);
-			if (!channel.hasClient(socket)
-			|| (channel.getMode(ChanModerated) && (!channel.isOperator(socket) && !channel.hasVoice(socket))))
+			uint64_t key = byMsgid ? entry->msgid : entry->time;
+			if (subcommand == "BEFORE" && key >= mark)
+				continue;
+			if (subcommand == "LATEST" && !anywhere && key <= mark)
 			{
-				sendMessageToClient(socket, prefix() + "404 " + target + " : Cannot send to channel");
-				return;
+				reached = true;
+				break;
 			}
-			channel.broadcast(client.prefix() + "PRIVMSG " + target + " " + message, socket);
+			lines.push_back(entry);
 		}
-		else
+		std::reverse(lines.begin(), lines.end());
+		if (int(lines.size()) < limit && !reached)
 		{
-			Client &target_client = getClient(target);
-			sendMessageToClient(target_client.getSocket(), client.prefix() + "PRIVMSG " + target + " " + message);
+			if (!lines.empty())
+				_log.before(channel->getName(), true, lines.front()->msgid, limit - lines.size(), logged);
+			else if (subcommand == "BEFORE")
+				_log.before(channel->getName(), byMsgid, mark, limit, logged);
+			else
+				_log.before(channel->getName(), true, uint64_t(-1), limit, logged);
+			while (subcommand == "LATEST" && !anywhere && !logged.empty()
+				&& (byMsgid ? logged.front().msgid : logged.front().time) <= mark)
+				logged.erase(logged.begin());
 		}
 	}
-	catch (...)
+
+	std::ostringstream reference;
+	reference << "history" << ++_historyBatches;
+	bool batched = client.getFlag(ClientBatch);
+	if (batched)
+		sendMessageToClient(socket, prefix() + "BATCH +" + reference.str() + " chathistory " + channel->getName());
+	for (size_t i = 0; i < logged.size(); i++)
+		sendMessageToClient(socket, historyTags(client, reference.str(), logged[i].msgid, logged[i].time) + logged[i].line);
+	for (size_t i = 0; i < lines.size(); i++)
 	{
-		sendMessageToClient(socket, prefix() + "401 PRIVMSG : No such target");
+		std::string tags = historyTags(client, reference.str(), lines[i]->msgid, lines[i]->time);
+		if (!tags.empty())
+			client.newRawMessage(tags); // the line itself is not copied
+		sendSharedToClient(socket, lines[i]->line);
+	}
+	if (batched)
+		sendMessageToClient(socket, prefix() + "BATCH -" + reference.str());
+}
+
+/**
+ * Handles PRIVMSG and NOTICE: <target>{,<target>} :<text>, with up to
+ * MESSAGE_TARGETS_MAX targets. Each target is checked, and the message goes
+ * to the ones that passed. A NOTICE never gets an error reply.
+ *
+ * @param socket The socket of the sender.
+ * @param args The arguments passed with the command.
+ * @param verb PRIVMSG or NOTICE, as it goes out.
+ */
+void Server::relayMessage(int socket, const std::string &args, const std::string &verb)
+{
+	Client &client = getClient(socket);
+	bool notice = verb == "NOTICE";
+	std::string_view message(args);
+	std::string list(nextWord(message)); // the text stays a view into args until the line is built
+	if (list.empty() || message.empty())
+	{
+		if (!notice)
+		{
+			if (list.empty())
+				reply(socket, 411, {verb}, "No recipient given");
+			else
+				reply(socket, 412, {verb}, "No text to send");
+		}
+		return;
+	}
+	if (std::count(list.begin(), list.end(), ',') >= MESSAGE_TARGETS_MAX)
+	{
+		if (!notice)
+			reply(socket, 407, {list}, "Too many recipients");
 		return;
 	}
+	std::vector<std::string> targets;
+	std::set<Channel *> channels; // a target named twice gets it once
+	std::set<int> users;
+	std::stringstream split(list);
+	std::string target;
+	while (std::getline(split, target, ','))
+	{
+		if (target.empty())
+			continue;
+		if (target[0] == '#')
+		{
+			Channel *channel = findChannel(target);
+			if (channel && (!channel->hasClient(socket)
+			|| ((channel->getMode(ChanModerated) || channel->isBanned(socket))
+				&& !channel->isOperator(socket) && !channel->hasVoice(socket))))
+			{
+				if (!notice)
+					reply(socket, 404, {target}, "Cannot send to channel");
+			}
+			else if (channel && channels.insert(channel).second)
+				targets.push_back(channel->getName());
+			else if (!channel && !notice)
+				reply(socket, 401, {target}, "No such target");
+			continue;
+		}
+		int user = _userIndex.findNickname(target);
+		if (user != -1 && users.insert(user).second)
+			targets.push_back(getClient(user).getNickname());
+		else if (user == -1 && !notice)
+			reply(socket, 401, {target}, "No such target");
+	}
+	if (!targets.empty())
+		deliverMessage(client.prefix(), verb, targets, message, socket);
 }
 
+/*
+	one PRIVMSG / NOTICE to checked targets, from a local sender (from is
+	its socket) or from a link. each target's line is rendered once. the
+	delivery epoch lets a user in several of the target channels get only
+	the first channel's line, and lets every link the message has to cross
+	get it once, as a single line that lists all the targets. a user named
+	as a target always gets the direct line, even if a channel carried it:
+	clients show the two differently.
+*/
+void Server::deliverMessage(const std::string &source, const std::string &verb,
+	const std::vector<std::string> &targets, std::string_view text, int from)
+{
+	unsigned long epoch = ++_deliveryEpoch;
+	if (getClient(from).getFlag(ClientServerLink))
+		getClient(from).markDelivered(epoch); // never back where it came from
+	std::vector<int> links;
+	for (size_t i = 0; i < targets.size(); i++)
+	{
+		Channel *channel = targets[i][0] == '#' ? findChannel(targets[i]) : NULL;
+		if (channel)
+		{
+			SharedLine *line = SharedLine::create({ source, verb, " ", targets[i], " ", text });
+			channel->broadcastEvent(line, from, LinksNone, epoch);
+			line->release();
+			const std::vector<int> &members = channel->getClients();
+			for (size_t j = 0; j < members.size(); j++)
+			{
+				int link = members[j] < 0 ? getClient(members[j]).getLink() : -1;
+				if (link >= 0 && getClient(link).markDelivered(epoch))
+					links.push_back(link);
+			}
+			continue;
+		}
+		int user = targets[i][0] == '#' ? -1 : _userIndex.findNickname(targets[i]);
+		if (user == -1)
+			continue;
+		int link = getClient(user).getLink();
+		if (link < 0)
+		{
+			SharedLine *line = SharedLine::create({ source, verb, " ", targets[i], " ", text });
+			sendSharedToClient(user, line);
+			line->release();
+		}
+		else if (link >= 0 && getClient(link).markDelivered(epoch))
+			links.push_back(link);
+	}
+	if (links.empty())
+		return;
+	std::string list = targets[0];
+	for (size_t i = 1; i < targets.size(); i++)
+		list += "," + targets[i];
+	SharedLine *line = SharedLine::create({ source, verb, " ", list, text[0] == ':' ? " " : " :", text });
+	for (size_t i = 0; i < links.size(); i++)
+		sendSharedToClient(links[i], line);
+	line->release();
+}
+
+/**
+ * Sends a message to channels and / or users, see relayMessage.
+ *
+ * @param socket The socket of the sender.
+ * @param args The arguments passed with the command.
+ */
+void Server::PRIVMSG(int socket, const std::string &args)
+{
+	relayMessage(socket, args, "PRIVMSG");
+}
+
+/**
+ * Same as PRIVMSG, but never answered with an error and sent as NOTICE.
+ *
+ * @param socket The socket of the sender.
+ * @param args The arguments passed with the command.
+ */
+void Server::NOTICE(int socket, const std::string &args)
+{
+	relayMessage(socket, args, "NOTICE");
+}
+
+/*
+	WHO <mask> search: nick!user@host masks (a bare mask is tried against
+	nick, user and host) answered from the user index, then streamed out
+	as a PendingReply. flags: 'r' also matches the mask against realnames
+	(needs a full scan), 'o' keeps IRC operators only, which this server
+	has none of.
+*/
+struct WhoQuery {
+	std::string	mask;
+	std::string	nickMask;
+	std::string	userMask;
+	std::string	hostMask;
+	bool		bare;
+	bool		realname;
+	bool		operatorsOnly;
+
+				WhoQuery(const std::string &target, const std::string &flags)
+				:mask(target),nickMask("*"),userMask("*"),hostMask("*"),bare(false),
+				realname(flags.find('r') != std::string::npos),operatorsOnly(flags.find('o') != std::string::npos)
+	{
+		size_t bang = target.find('!');
+		size_t at = target.find('@');
+		bare = bang == std::string::npos && at == std::string::npos;
+		if (bare)
+			return;
+		nickMask = target.substr(0, bang != std::string::npos ? bang : at);
+		if (bang != std::string::npos)
+			userMask = target.substr(bang + 1, at != std::string::npos && at > bang ? at - bang - 1 : std::string::npos);
+		if (at != std::string::npos)
+			hostMask = target.substr(at + 1);
+		if (nickMask.empty())
+			nickMask = "*";
+	}
+
+	bool		matches(Client &client) const
+	{
+		if (operatorsOnly)
+			return false;
+		if (realname && matchMask(mask, client.getRealname()))
+			return true;
+		if (bare)
+			return matchMask(mask, client.getNickname()) || matchMask(mask, client.getUsername())
+				|| matchMask(mask, client.getHostname());
+		return matchMask(nickMask, client.getNickname()) && matchMask(userMask, client.getUsername())
+			&& matchMask(hostMask, client.getHostname());
+	}
+};
+
+class WhoReply : public PendingReply {
+	private:
+		std::vector<int>	_matches;
+		std::string			_mask;
+		size_t				_next;
+	public:
+							WhoReply(const std::vector<int> &matches, const std::string &mask)
+							:_matches(matches),_mask(mask),_next(0)
+							{}
+
+		bool				resume(Server &server, int socket)
+		{
+			Client &client = server.getClient(socket);
+			while (_next < _matches.size() && client.getOutboundSize() < REPLY_HIGH_WATER)
+			{
+				int fd = _matches[_next++];
+				Client *match = server.findClient(fd);
+				if (!match)
+					continue; // left while the reply was streaming
+				Client &c = *match;
+				server.reply(socket, 352, {"*", c.getUsername(), c.getHostname(),
+					c.getLink() >= 0 ? c.getServer() : server.getServerName(), c.getNickname(), "H"},
+					"0 " + c.getRealname());
+			}
+			if (_next < _matches.size())
+				return false;
+			server.reply(socket, 315, {_mask}, "End of /WHO list");
+			return true;
+		}
+};
+
 /**
  * Sends a WHO command response to the client.
+ * A channel name lists its members, anything else is taken as a mask
+ * searched through the user index, capped at WHO_MAX_RESULTS matches.
  * 
  * @param socket The socket of the client.
  * @param args The arguments passed with the WHO command.
  */
-void Server::WHO(int socket, std::string args)
+void Server::WHO(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::stringstream ss(args);
 	std::string target;
-	ss >> target;
+	std::string flags;
+	ss >> target >> flags;
 	if (target.empty())
 	{
-		sendMessageToClient(socket, prefix() + "431 WHO : No target given");
+		reply(socket, 431, {"WHO"}, "No target given");
 		return;
 	}
-	try {
-		Channel &channel = getChannel(args);
-		const std::vector<int>& clients = channel.getClients();
-		for (size_t i = 0; i < clients.size(); i++) {
-			Client& c = getClient(clients[i]);
-			std::string flags = "H";
-			if (channel.isOperator(c.getSocket())) {
-    			flags += "@";
+	if (target[0] != '#')
+	{
+		WhoQuery query(target, flags);
+		std::set<int> candidates;
+		bool indexed = !query.realname;
+		if (indexed && query.bare)
+		{
+			indexed = _userIndex.candidates(target, "*", "*", candidates, WHO_MAX_SCAN)
+				&& _userIndex.candidates("*", target, "*", candidates, WHO_MAX_SCAN)
+				&& _userIndex.candidates("*", "*", target, candidates, WHO_MAX_SCAN);
+		}
+		else if (indexed)
+			indexed = _userIndex.candidates(query.nickMask, query.userMask, query.hostMask, candidates, WHO_MAX_SCAN);
+		std::vector<int> matches;
+		if (indexed)
+		{
+			for (std::set<int>::iterator it = candidates.begin(); it != candidates.end() && matches.size() < WHO_MAX_RESULTS; it++)
+			{
+				Client &candidate = getClient(*it); // the index also holds connections still registering and links
+				if (candidate.isRegistered() && !candidate.getFlag(ClientServerLink) && query.matches(candidate))
+					matches.push_back(*it);
 			}
-			std::stringstream msgline;
-			msgline << prefix() << "352 ";
-			msgline << client.getNickname() << " " << channel.getName() << " ";
-			msgline << c.getUsername() << " " << c.getHostname() << " ";
-			msgline << "*" << " " << c.getNickname() << " " << flags << " ";
-			msgline << ":0 " << c.getRealname();
-			sendMessageToClient(socket, msgline.str());
 		}
-		sendMessageToClient(socket, prefix() + "315 " + client.getNickname() + " " + channel.getName() + " : End of /WHO list");
+		else
+		{
+			for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end() && matches.size() < WHO_MAX_RESULTS; it++)
+				if (it->second->isRegistered() && !it->second->getFlag(ClientServerLink) && query.matches(*it->second))
+					matches.push_back(it->first);
+		}
+		client.setPendingReply(new WhoReply(matches, target));
+		resumePendingReply(socket);
+		return;
 	}
-	catch (...) {
-		sendMessageToClient(socket, prefix() + "403 " + target + " : No such channel");
+	Channel *found = findChannel(target);
+	if (!found)
+	{
+		reply(socket, 403, {target}, "No such channel");
+		return;
 	}
+	Channel &channel = *found;
+	const std::vector<int>& clients = channel.getClients();
+	for (size_t i = 0; i < clients.size(); i++) {
+		Client& c = getClient(clients[i]);
+		reply(socket, 352, {channel.getName(), c.getUsername(), c.getHostname(), "*", c.getNickname(),
+			channel.isOperator(c.getSocket()) ? "H@" : "H"}, "0 " + c.getRealname());
+	}
+	reply(socket, 315, {channel.getName()}, "End of /WHO list");
 }
 
 /**
@@ -343,26 +1079,24 @@ void Server::WHO(int socket, std::string args)
  * @param socket The socket of the client.
  * @param args The arguments passed to the WHOIS command.
  */
-void Server::WHOIS(int socket, std::string args)
+void Server::WHOIS(int socket, const std::string &args)
 {
-	Client &client = getClient(socket);
 	std::stringstream ss(args);
 	std::string target;
 	ss >> target;
 	if (target.empty())
 	{
-		sendMessageToClient(socket, prefix() + "431 WHOIS : No target given");
+		reply(socket, 431, {"WHOIS"}, "No target given");
 		return;
 	}
-	try {
-		Client &target_client = getClient(target);
-		std::stringstream msgline;
-		msgline << prefix() << "311 " << client.getNickname() << " " << target << " " << target_client.getUsername() << " " << target_client.getHostname() << " * : " << target_client.getRealname();
-		sendMessageToClient(socket, msgline.str());
-	}
-	catch (...) {
-		sendMessageToClient(socket, prefix() + "401 " + target + " : No such target");
+	Client *target_client = findClient(target);
+	if (!target_client)
+	{
+		reply(socket, 401, {target}, "No such target");
+		return;
 	}
+	reply(socket, 311, {target_client->getNickname(), target_client->getUsername(), target_client->getHostname(), "*"},
+		target_client->getRealname());
 }
 
 
@@ -378,7 +1112,7 @@ void setBackupOperator(Channel& channel, Client& target, Server& server)
 			if (clients[i] != socket)
 			{
 				channel.addOperator(clients[i]);
-				channel.broadcast(target.prefix() + "MODE " + channel.getName() + " +o " + server.getClient(clients[i]).getNickname());
+				channel.broadcast(target.prefix() + "MODE " + channel.getName() + " +o " + server.getClient(clients[i]).getNickname(), -1, LinksAll);
 				break;
 			}
 		}
@@ -386,46 +1120,52 @@ void setBackupOperator(Channel& channel, Client& target, Server& server)
 }
 
 
+/*
+	takes a member out of a channel: a backup operator if it was the last
+	one, PART to everyone (the one leaving included), and the channel goes
+	once empty
+*/
+void Server::leaveChannel(int socket, Channel &channel, const std::string &reason)
+{
+	Client &client = getClient(socket);
+	setBackupOperator(channel, client, *this);
+	channel.broadcastEvent(client.prefix() + "PART " + channel.getName() + (reason.empty() ? "" : " " + reason));
+	channel.removeClient(socket);
+	removeChannelIfEmpty(channel);
+}
+
 /**
  * @brief Handles the PART command for a client on the server.
  * 
- * This function is responsible for processing the PART command, which allows a client to leave a channel.
- * It checks if the channel exists and if the client is currently a member of the channel.
- * If the channel and client are valid, it broadcasts a PART message to all other clients in the channel
- * and removes the client from the channel.
- * If the channel does not exist, it sends an error message to the client.
- * If the command is not provided with enough parameters, it sends an error message to the client as well.
+ * PART <channel>{,<channel>} [:<reason>] takes the client out of every listed
+ * channel it is on, with a PART to the members of each. Errors for the whole
+ * list are sent back as a single write.
  * 
  * @param socket The socket of the client.
  * @param args The arguments provided with the PART command.
  */
-void Server::PART(int socket, std::string args)
+void Server::PART(int socket, const std::string &args)
 {
-	Client &client = getClient(socket);
 	std::stringstream ss(args);
-	std::string channel_name;
-	ss >> channel_name;
-	if (channel_name.empty())
+	std::string names;
+	std::string reason;
+	ss >> names >> std::ws;
+	std::getline(ss, reason, '\0');
+	if (names.empty())
 	{
-		sendMessageToClient(socket, prefix() + "461 PART : Not enough parameters");
+		reply(socket, 461, {"PART"}, "Not enough parameters");
 		return;
 	}
-	try
-	{
-		Channel &channel = getChannel(channel_name);
-		if (!channel.hasClient(socket))
-		{
-			sendMessageToClient(socket, prefix() + "442 " + channel_name + " : You're not on that channel");
-			return;
-		}
-		setBackupOperator(channel, client, *this);
-		channel.broadcast(client.prefix() + "PART " + args);
-		channel.removeClient(socket);
-	}
-	catch (std::runtime_error &)
+	std::vector<std::string> channel_names = splitList(names);
+	for (size_t i = 0; i < channel_names.size(); i++)
 	{
-		sendMessageToClient(socket, prefix() + "403 " + channel_name + " : No such channel");
-		return;
+		Channel *channel = findChannel(channel_names[i]);
+		if (!channel)
+			reply(socket, 403, {channel_names[i]}, "No such channel");
+		else if (!channel->hasClient(socket))
+			reply(socket, 442, {channel_names[i]}, "You're not on that channel");
+		else
+			leaveChannel(socket, *channel, reason);
 	}
 }
 
@@ -438,12 +1178,16 @@ void Server::PART(int socket, std::string args)
  * @param socket The socket of the client.
  * @param args The arguments provided with the QUIT command.
  */
-void Server::QUIT(int socket, std::string args)
+void Server::QUIT(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
+	if (client.getFlag(ClientServerLink))
+		return closeLink(socket, args);
 	std::stringstream broadcast;
 	broadcast << client.prefix() << "QUIT : " << args;
 	sendMessageToClientChannels(socket, broadcast.str());
+	if (client.isRegistered())
+		propagate(broadcast.str(), -1);
 	removeClient(socket);
 }
 
@@ -453,7 +1197,7 @@ void Server::QUIT(int socket, std::string args)
  * @param socket The socket of the client.
  * @param args The arguments passed to the command.
  */
-void Server::TOPIC(int socket, std::string args)
+void Server::TOPIC(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::stringstream ss(args);
@@ -463,35 +1207,32 @@ void Server::TOPIC(int socket, std::string args)
 	std::getline(ss, topic, '\0');
 	if (channel_name.empty())
 	{
-		sendMessageToClient(socket, prefix() + "461 TOPIC : Not enough parameters");
+		reply(socket, 461, {"TOPIC"}, "Not enough parameters");
 		return;
 	}
-	try
+	Channel *channel = findChannel(channel_name);
+	if (!channel)
 	{
-		Channel &channel = getChannel(channel_name);
-		if (!channel.hasClient(socket))
-		{
-			sendMessageToClient(socket, prefix() + "442 " + channel_name + " : You're not on that channel");
-			return;
-		}
-		if (topic.empty())
-		{
-			sendMessageToClient(socket, prefix() + "331 " + client.getNickname() + " " + channel_name + " : " + channel.getTopic());
-			return;
-		}
-		if (channel.getMode(ChanTopicProtected) && !channel.isOperator(socket))
-		{
-			sendMessageToClient(socket, prefix() + "482 " + channel_name + " : You're not channel operator");
-			return;
-		}
-		channel.setTopic(topic); 
-		channel.broadcast(client.prefix() + "TOPIC " + channel_name + " : " + topic);
+		reply(socket, 403, {channel_name}, "No such channel");
+		return;
 	}
-	catch (std::runtime_error &)
+	if (!channel->hasClient(socket))
 	{
-		sendMessageToClient(socket, prefix() + "403 " + channel_name + " : No such channel");
+		reply(socket, 442, {channel_name}, "You're not on that channel");
 		return;
 	}
+	if (topic.empty())
+	{
+		reply(socket, 331, {channel->getName()}, channel->getTopic());
+		return;
+	}
+	if (channel->getMode(ChanTopicProtected) && !channel->isOperator(socket))
+	{
+		reply(socket, 482, {channel_name}, "You're not channel operator");
+		return;
+	}
+	channel->setTopic(topic);
+	channel->broadcastEvent(client.prefix() + "TOPIC " + channel_name + " : " + topic);
 }
 
 /**
@@ -500,7 +1241,7 @@ void Server::TOPIC(int socket, std::string args)
  * @param socket The socket of the client performing the kick.
  * @param args The arguments passed to the KICK command.
  */
-void Server::KICK(int socket, std::string args)
+void Server::KICK(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::stringstream ss(args);
@@ -511,38 +1252,41 @@ void Server::KICK(int socket, std::string args)
 	std::getline(ss, reason, '\0');
 	if (channel_name.empty() || target.empty())
 	{
-		sendMessageToClient(socket, prefix() + "461 KICK : Not enough parameters");
+		reply(socket, 461, {"KICK"}, "Not enough parameters");
 		return;
 	}
-	try
+	Channel *channel = findChannel(channel_name);
+	if (!channel)
 	{
-		Channel &channel = getChannel(channel_name);
-		if (!channel.hasClient(socket))
-		{
-			sendMessageToClient(socket, prefix() + "442 " + channel_name + " : You're not on that channel");
-			return;
-		}
-		if (!channel.isOperator(socket))
-		{
-			sendMessageToClient(socket, prefix() + "482 " + channel_name + " : You're not channel operator");
-			return;
-		}
-		Client &target_client = getClient(target);
-		if (!channel.hasClient(target_client.getSocket()))
-		{
-			sendMessageToClient(socket, prefix() + "441 " + target + " " + channel_name + " : They aren't on that channel");
-			return;
-		}
-		std::stringstream broadcast;
-		broadcast << client.prefix() << "KICK " << channel_name << " " << target << " : " << reason;
-		channel.broadcast(broadcast.str());
-		channel.removeClient(target_client.getSocket());
+		reply(socket, 403, {channel_name}, "No such channel");
+		return;
 	}
-	catch (std::runtime_error &)
+	if (!channel->hasClient(socket))
 	{
-		sendMessageToClient(socket, prefix() + "403 " + channel_name + " : No such channel");
+		reply(socket, 442, {channel_name}, "You're not on that channel");
 		return;
 	}
+	if (!channel->isOperator(socket))
+	{
+		reply(socket, 482, {channel_name}, "You're not channel operator");
+		return;
+	}
+	int member = _userIndex.findNickname(target);
+	if (member == -1)
+	{
+		reply(socket, 401, {target}, "No such target");
+		return;
+	}
+	if (!channel->hasClient(member))
+	{
+		reply(socket, 441, {target, channel_name}, "They aren't on that channel");
+		return;
+	}
+	std::stringstream broadcast;
+	broadcast << client.prefix() << "KICK " << channel_name << " " << target << " : " << reason;
+	channel->broadcastEvent(broadcast.str());
+	channel->removeClient(member);
+	removeChannelIfEmpty(*channel);
 }
 
 /**
@@ -551,7 +1295,7 @@ void Server::KICK(int socket, std::string args)
  * @param socket The socket of the client sending the invitation.
  * @param args The arguments containing the target client and channel name.
  */
-void Server::INVITE(int socket, std::string args)
+void Server::INVITE(int socket, const std::string &args)
 {
 	Client &client = getClient(socket);
 	std::stringstream ss(args);
@@ -560,204 +1304,418 @@ void Server::INVITE(int socket, std::string args)
 	ss >> target >> channel_name;
 	if (target.empty() || channel_name.empty())
 	{
-		sendMessageToClient(socket, prefix() + "461 INVITE : Not enough parameters");
+		reply(socket, 461, {"INVITE"}, "Not enough parameters");
 		return;
 	}
-	try
+	int invited = _userIndex.findNickname(target);
+	Channel *channel = findChannel(channel_name);
+	if (invited == -1 || !channel)
 	{
-		Client &target_client = getClient(target);
-		Channel &channel = getChannel(channel_name);
-		if (!channel.hasClient(socket))
-		{
-			sendMessageToClient(socket, prefix() + "442 " + channel_name + " : You're not on that channel");
-			return;
-		}
-		if (channel.hasClient(target_client.getSocket()))
-		{
-			sendMessageToClient(socket, prefix() + "443 " + target + " " + channel_name + " : is already on channel");
-			return;
-		}
-		sendMessageToClient(target_client.getSocket(), client.prefix() + "INVITE " + target + " " + channel_name);
-		channel.addInvite(target_client.getSocket());
+		if (invited == -1)
+			reply(socket, 401, {target}, "No such target");
+		else
+			reply(socket, 403, {channel_name}, "No such channel");
+		return;
 	}
-	catch (std::runtime_error &)
+	if (!channel->hasClient(socket))
 	{
-		sendMessageToClient(socket, prefix() + "403 " + channel_name + " : NO such channel/User");
+		reply(socket, 442, {channel_name}, "You're not on that channel");
 		return;
 	}
+	if (channel->hasClient(invited))
+	{
+		reply(socket, 443, {target, channel_name}, "is already on channel");
+		return;
+	}
+	sendMessageToClient(invited, client.prefix() + "INVITE " + target + " " + channel_name);
+	channel->addInvite(invited);
 }
 
 /**
- * Checks if a given nickname is currently online.
- * Sends a response to the client with the list of online nicknames.
+ * Checks which of the given nicknames are online, from the user index.
+ * Sends back the online ones only, as their owners spell them.
  *
  * @param socket The socket of the client making the request.
  * @param args   The arguments passed to the command.
  */
-void Server::ISON(int socket, std::string args)
+void Server::ISON(int socket, const std::string &args)
 {
-	Client &client = getClient(socket);
 	std::stringstream ss(args);
 	std::string nickname;
-	ss >> nickname;
-	if (nickname.empty())
+	std::string online;
+	if (!(ss >> nickname))
 	{
-		sendMessageToClient(socket, prefix() + "461 ISON : Not enough parameters");
+		reply(socket, 461, {"ISON"}, "Not enough parameters");
 		return;
 	}
-	std::vector<std::string> nicks;
-	std::stringstream response;
-	response << prefix() << "303 " << client.getNickname();
-	while (!ss.eof())
+	do
 	{
-		try
-		{
-			Client &target = getClient(nickname);
-			response << " " << target.getNickname();
-		}
-		catch (std::runtime_error &)
+		if (nickname[0] == ':')
+			nickname = nickname.substr(1);
+		int target = nickname.empty() ? -1 : _userIndex.findNickname(nickname);
+		if (target != -1)
+			online += (online.empty() ? "" : " ") + std::string(getClient(target).getNickname());
+	} while (ss >> nickname);
+	reply(socket, 303, {}, online);
+}
+
+// "<code> <nick> :<item>,<item>..." lines, each within the 512 byte limit
+static void sendTargetList(Server &server, int socket, int code, const std::vector<std::string> &items)
+{
+	// what the prefix, "NNN ", the nickname and " :" leave of NAMES_LINE_MAX
+	size_t room = NAMES_LINE_MAX - server.prefix().size() - std::strlen(server.getClient(socket).getNickname()) - 6;
+	std::string line;
+	for (size_t i = 0; i < items.size(); i++)
+	{
+		if (!line.empty() && line.size() + items[i].size() + 1 > room)
 		{
-			response << " " << nickname;
+			server.reply(socket, code, {}, line);
+			line.clear();
 		}
-		ss >> nickname;
+		line += (line.empty() ? "" : ",") + items[i];
 	}
-	sendMessageToClient(socket, response.str());
+	if (!line.empty())
+		server.reply(socket, code, {}, line);
+}
+
+/*
+	tells everyone watching <nickname> that it came online (mask is its
+	nick!user@host) or went offline (empty mask): 730 / 731.
+*/
+void Server::notifyWatchers(const std::string &nickname, const std::string &mask)
+{
+	const std::set<int> *watchers = _monitor.watchers(nickname);
+	if (!watchers)
+		return;
+	for (std::set<int>::const_iterator it = watchers->begin(); it != watchers->end(); it++)
+		reply(*it, mask.empty() ? 731 : 730, {}, mask.empty() ? nickname : mask);
 }
 
 /**
- * Sets the mode of a channel or performs mode-related operations for a client.
- * 
+ * Handles MONITOR, the pushed replacement for ISON polling:
+ * + <nick>{,<nick>} watches them (730 / 731 for their state right away),
+ * - <nick>{,<nick>} stops, C clears the list, L lists it (732 / 733),
+ * S sends the state of everyone on it.
+ *
  * @param socket The socket of the client.
- * @param args The arguments passed to the MODE command.
+ * @param args The arguments passed with the command.
  */
-void Server::MODE(int socket, std::string args)
+void Server::MONITOR(int socket, const std::string &args)
 {
-	Client &client = getClient(socket);
 	std::stringstream ss(args);
+	std::string action;
+	std::string list;
+	ss >> action >> list;
+	std::vector<std::string> targets;
+	std::stringstream split(list);
 	std::string target;
-	std::string mode;
-	std::string mode_args;
-	ss >> target >> mode >> mode_args;
-	if (target.empty())
+	while (std::getline(split, target, ','))
+		if (!target.empty())
+			targets.push_back(target);
+	if (action.empty() || ((action == "+" || action == "-") && targets.empty()))
 	{
-		sendMessageToClient(socket, prefix() + "461 MODE : Not enough parameters");
+		reply(socket, 461, {"MONITOR"}, "Not enough parameters");
 		return;
 	}
-	Channel *channel;
-	try
+	if (action == "+")
 	{
-		channel = &getChannel(target);
+		for (size_t i = 0; i < targets.size(); i++)
+		{
+			if (_monitor.add(socket, targets[i]))
+				continue;
+			std::string rejected = targets[i];
+			for (size_t j = i + 1; j < targets.size(); j++)
+				rejected += "," + targets[j];
+			reply(socket, 734, {_monitor.getLimit(), rejected}, "Monitor list is full.");
+			targets.resize(i);
+			break;
+		}
 	}
-	catch (std::runtime_error &)
+	else if (action == "-")
 	{
-		sendMessageToClient(socket, prefix() + "403 MODE : No such channel");
+		for (size_t i = 0; i < targets.size(); i++)
+			_monitor.remove(socket, targets[i]);
 		return;
 	}
-	if (mode.empty())
+	else if (action == "C" || action == "c")
+		return _monitor.clear(socket);
+	else if (action == "L" || action == "l")
 	{
-		sendMessageToClient(socket, prefix() + "324 " + client.getNickname() + " " + channel->getName() + " " + channel->getModeString());
+		sendTargetList(*this, socket, 732, _monitor.list(socket));
+		reply(socket, 733, {}, "End of MONITOR list");
 		return;
 	}
-	if (!channel->hasClient(socket) || !channel->isOperator(socket))
+	else if (action == "S" || action == "s")
+		targets = _monitor.list(socket);
+	else
 	{
-		sendMessageToClient(socket, prefix() + "482 MODE : You're not channel operator");
+		reply(socket, 421, {"MONITOR", action}, "Unknown subcommand");
 		return;
 	}
-	
-	bool add = true;
-	if (mode[0] == '+' || mode[0] == '-')
+	std::vector<std::string> online;
+	std::vector<std::string> offline;
+	for (size_t i = 0; i < targets.size(); i++)
 	{
-		add = mode[0] == '+';
-		mode = mode.substr(1);
+		int user = _userIndex.findNickname(targets[i]);
+		if (user == -1)
+			offline.push_back(targets[i]);
+		else
+			online.push_back(getClient(user).getNetworkIdentifier());
 	}
-	if (mode.length() != 1)
+	sendTargetList(*this, socket, 730, online);
+	sendTargetList(*this, socket, 731, offline);
+}
+
+/**
+ * Reports server statistics: STATS z lists the memory held per category
+ * with its peak, then the total against the memory budget. Other letters
+ * only get the end of the report.
+ *
+ * @param socket The socket of the client.
+ * @param args The arguments passed with the command.
+ */
+void Server::STATS(int socket, const std::string &args)
+{
+	std::stringstream ss(args);
+	std::string query;
+	if (!(ss >> query))
 	{
-		sendMessageToClient(socket, prefix() + "472 MODE : malformatted mode");
+		reply(socket, 461, {"STATS"}, "Not enough parameters");
 		return;
 	}
-	switch (mode[0])
+	if (query == "z" || query == "Z")
 	{
-		case 'i': // invite only
-			channel->setMode(ChanInviteOnly, add);
-			break;
-		case 'm': // moderated: only ops and voiced users can write
-			channel->setMode(ChanModerated, add);
-			break;
-		case 't': // topic protected
-				channel->setMode(ChanTopicProtected, add);
-			break;
-		case 's': // secret: not shown in list
-			channel->setMode(ChanSecret, add);
-			break;
-		case 'k': // channel key
-			if (mode_args.empty() && add)
+		accountTables();
+		for (int i = 0; i < MemoryCategoryCount; i++)
+		{
+			MemoryCategory category = static_cast<MemoryCategory>(i);
+			reply(socket, 249, {"z"}, std::string(MemoryStats::name(category)) + " "
+				+ std::to_string(MemoryStats::used(category)) + " bytes, peak "
+				+ std::to_string(MemoryStats::peak(category)));
+		}
+		reply(socket, 249, {"z"}, "total " + std::to_string(MemoryStats::total()) + " bytes, peak "
+			+ std::to_string(MemoryStats::totalPeak()) + ", budget "
+			+ (_memoryBudget ? std::to_string(_memoryBudget) : std::string("none")));
+	}
+	reply(socket, 219, {query.substr(0, 1)}, "End of /STATS report");
+}
+
+/*
+	the changes one MODE applied, announced together in a single line:
+	"+it-k+o key nick", with a sign written once per run of the same sign.
+	channel operators and other servers get the real key, the other
+	members a masked one.
+*/
+struct ModeChanges {
+	std::string	modes;
+	std::string	params;
+	std::string	masked;
+	char		sign;
+
+	ModeChanges(): sign(0) {}
+
+	void		add(bool add, char mode, const std::string &param = "", bool hidden = false)
+	{
+		if (sign != (add ? '+' : '-'))
+			modes += sign = add ? '+' : '-';
+		modes += mode;
+		if (param.empty())
+			return;
+		params += " " + param;
+		masked += " " + (hidden ? std::string("********") : param);
+	}
+};
+
+// 367 / 368, 348 / 349 or 346 / 347: the b, e or I list of a channel
+static void sendMaskList(Server &server, int socket, Channel &channel, char letter)
+{
+	static const int numerics[] = { 367, 368, 348, 349, 346, 347 };
+	static const char *ends[] = { "End of channel ban list", "End of channel exception list",
+		"End of channel invite list" };
+	int list = letter == 'b' ? ListBan : letter == 'e' ? ListExcept : ListInviteExcept;
+	const std::vector<MaskEntry> &entries = channel.getMasks(static_cast<MaskList>(list));
+	for (size_t i = 0; i < entries.size(); i++)
+		server.reply(socket, numerics[list * 2], {channel.getName(), entries[i].mask.str(), entries[i].setter,
+			entries[i].time});
+	server.reply(socket, numerics[list * 2 + 1], {channel.getName()}, ends[list]);
+}
+
+/**
+ * Shows or changes channel modes: MODE <channel> [<modes> [<params>...]].
+ * Any number of mode letters may be combined, with up to MODES_MAX of them
+ * taking a parameter. Letters that fail get their own error, the others
+ * still apply, and everything that changed goes out as one MODE line.
+ * b, e and I without a parameter list the masks instead, for anyone.
+ * 
+ * @param socket The socket of the client.
+ * @param args The arguments passed to the MODE command.
+ */
+void Server::MODE(int socket, const std::string &args)
+{
+	Client &client = getClient(socket);
+	std::stringstream ss(args);
+	std::string target;
+	std::string mode;
+	std::vector<std::string> mode_args;
+	ss >> target >> mode;
+	for (std::string param; ss >> param; )
+		mode_args.push_back(param);
+	if (target.empty())
+	{
+		reply(socket, 461, {"MODE"}, "Not enough parameters");
+		return;
+	}
+	Channel *channel = findChannel(target);
+	if (!channel)
+	{
+		reply(socket, 403, {target}, "No such channel");
+		return;
+	}
+	if (mode.empty())
+	{
+		reply(socket, 324, {channel->getName(), channel->getModeString()});
+		return;
+	}
+	bool op = channel->hasClient(socket) && channel->isOperator(socket);
+
+	ModeChanges changes;
+	bool add = true;
+	size_t next = 0;
+	int withParam = 0;
+	for (size_t i = 0; i < mode.size(); i++)
+	{
+		char letter = mode[i];
+		if (letter == '+' || letter == '-')
+		{
+			add = letter == '+';
+			continue;
+		}
+		bool isList = letter == 'b' || letter == 'e' || letter == 'I';
+		if (isList && next >= mode_args.size())
+		{
+			sendMaskList(*this, socket, *channel, letter); // anyone may look
+			continue;
+		}
+		if (!op)
+		{
+			reply(socket, 482, {channel->getName()}, "You're not channel operator");
+			return;
+		}
+		std::string param;
+		if (isList || letter == 'o' || letter == 'v' || letter == 'k' || (letter == 'l' && add))
+		{
+			if (withParam++ >= MODES_MAX)
+				break; // the rest of the string is ignored, as MODES= announces
+			if (next < mode_args.size())
+				param = mode_args[next++];
+			else if (letter != 'k' || add)
 			{
-				sendMessageToClient(socket, prefix() + "461 MODE : Not enough parameters");
-				return;
+				reply(socket, 461, {"MODE"}, "Not enough parameters");
+				continue;
 			}
-			channel->setMode(ChannelKey, add);
-			if (add)
-				channel->setPass(mode_args);
-			break;
-		case 'v': // voice permission: can talk in moderated cahannels
-			if (mode_args.empty())
+		}
+		switch (letter)
+		{
+			case 'i': // invite only
+			case 'm': // moderated: only ops and voiced users can write
+			case 't': // topic protected
+			case 's': // secret: not shown in list
 			{
-				sendMessageToClient(socket, prefix() + "461 MODE : Not enough parameters");
-				return;
+				ChannelMode flag = letter == 'i' ? ChanInviteOnly : letter == 'm' ? ChanModerated
+					: letter == 't' ? ChanTopicProtected : ChanSecret;
+				if (channel->getMode(flag) == add)
+					break;
+				channel->setMode(flag, add);
+				changes.add(add, letter);
+				break;
 			}
-			try
-			{
-				Client &target_client = getClient(mode_args);
+			case 'n': // no external messages: always on
+				break;
+			case 'k': // channel key
+				if (add && (param == channel->getPass() && channel->getMode(ChannelKey)))
+					break;
+				if (!add && !channel->getMode(ChannelKey))
+					break;
+				channel->setMode(ChannelKey, add);
 				if (add)
-					channel->addVoice(target_client.getSocket());
-				else
-					channel->removeVoice(target_client.getSocket());
-			}
-			catch (std::runtime_error &)
-			{
-				sendMessageToClient(socket, prefix() + "401 MODE : No such target");
-				return;
-			}
-			break;
-		case 'o': // grant/revoke operator status
-			if (mode_args.empty())
+					channel->setPass(param);
+				changes.add(add, 'k', add ? param : "*", add);
+				break;
+			case 'l': // channel users limit
 			{
-				sendMessageToClient(socket, prefix() + "461 MODE : Not enough parameters");
-				return;
+				if (!add)
+				{
+					if (channel->getLimit())
+						changes.add(false, 'l');
+					channel->setLimit(0);
+					break;
+				}
+				errno = 0;
+				long limit = std::strtol(param.c_str(), NULL, 10);
+				if (param.find_first_not_of("0123456789") != std::string::npos || errno == ERANGE
+					|| limit <= 0 || limit > INT_MAX)
+					reply(socket, 472, {"MODE"}, "malformatted mode");
+				else if (limit != channel->getLimit())
+				{
+					channel->setLimit(limit);
+					changes.add(true, 'l', std::to_string(limit)); // without leading zeros
+				}
+				break;
 			}
-			try
+			case 'o': // grant/revoke operator status
+			case 'v': // voice permission: can talk in moderated cahannels
 			{
-				Client &target_client = getClient(mode_args);
-				if (add)
-					channel->addOperator(target_client.getSocket());
+				int member = _userIndex.findNickname(param);
+				if (member == -1)
+				{
+					reply(socket, 401, {param}, "No such target");
+					break;
+				}
+				if (!channel->hasClient(member))
+				{
+					reply(socket, 441, {param, channel->getName()}, "They aren't on that channel");
+					break;
+				}
+				if ((letter == 'o' ? channel->isOperator(member) : channel->hasVoice(member)) == add)
+					break;
+				if (letter == 'o' && add)
+					channel->addOperator(member);
+				else if (letter == 'o')
+					channel->removeOperator(member);
+				else if (add)
+					channel->addVoice(member);
 				else
-					channel->removeOperator(target_client.getSocket());
-			}
-			catch (std::runtime_error &)
-			{
-				sendMessageToClient(socket, prefix() + "401 MODE : No such target");
-				return;
-			}
-			break;
-		case 'l': // channel users limit
-			if (mode_args.empty() && add)
-			{
-				sendMessageToClient(socket, prefix() + "461 MODE : Not enough parameters");
-				return;
+					channel->removeVoice(member);
+				changes.add(add, letter, getClient(member).getNickname());
+				break;
 			}
-			if (mode_args.find_first_not_of("0123456789") != std::string::npos)
+			case 'b': // ban
+			case 'e': // ban exception
+			case 'I': // invite exception
 			{
-				sendMessageToClient(socket, prefix() + "472 MODE : malformatted mode");
-				return;
+				MaskList list = letter == 'b' ? ListBan : letter == 'e' ? ListExcept : ListInviteExcept;
+				if (param[0] == ':')
+					break; // would read as a trailing parameter on the way out
+				std::string mask = fullMask(param);
+				if (add && channel->getMasks(list).size() >= MASK_LIST_MAX)
+				{
+					reply(socket, 478, {channel->getName(), mask}, "Channel list is full");
+					break;
+				}
+				if (add ? !channel->addMask(list, mask, client.getNetworkIdentifier(), time(NULL))
+					: !channel->removeMask(list, mask))
+					break; // already there / not there
+				changes.add(add, letter, mask);
+				break;
 			}
-			if (add)
-				channel->setLimit(std::stoi(mode_args));
-			else
-				channel->setLimit(0);
-			break;
-		default:
-			sendMessageToClient(socket, prefix() + "472 MODE : Unknown mode");
-			return;
+			default:
+				reply(socket, 472, {letter}, "Unknown mode");
+				break;
+		}
 	}
-	channel->broadcast(client.prefix() + "MODE " + channel->getName() + " " + (add ? "+" : "-") + mode + " " + (mode == "k" ? "********" : mode_args));
+	if (changes.modes.empty())
+		return;
+	std::string line = client.prefix() + "MODE " + channel->getName() + " " + changes.modes;
+	channel->broadcastMasked(line + changes.params, line + changes.masked);
+	propagate(line + changes.params, -1);
 }
@@ -0,0 +1,803 @@
+#include "../include/server.hpp"
+#include "../include/Channel.hpp"
+#include "../include/Link.hpp"
+#include <netdb.h>
+#include <set>
+
+bool LinkMessage::parse(const std::string &text, const std::string &peer)
+{
+	line = text;
+	source = peer;
+	params.clear();
+	size_t position = 0;
+	if (!text.empty() && text[0] == ':')
+	{
+		position = text.find(' ');
+		if (position == std::string::npos)
+			return false;
+		source = text.substr(1, position - 1);
+	}
+	std::stringstream ss(text.substr(position));
+	ss >> command;
+	std::transform(command.begin(), command.end(), command.begin(), ::toupper);
+	std::string param;
+	while (ss >> std::ws && !ss.eof())
+	{
+		if (ss.peek() == ':')
+		{
+			ss.get();
+			std::getline(ss, param, '\0');
+			params.push_back(param);
+			break;
+		}
+		ss >> param;
+		params.push_back(param);
+	}
+	return !command.empty();
+}
+
+std::string LinkMessage::sourceNick(void) const
+{
+	return source.substr(0, source.find('!'));
+}
+
+static std::string numberToString(long number)
+{
+	std::ostringstream ss;
+	ss << number;
+	return ss.str();
+}
+
+void Server::_initLinkHandlers(void)
+{
+	_linkHandlers["SERVER"] = &Server::linkServer;
+	_linkHandlers["NICK"] = &Server::linkNick;
+	_linkHandlers["SJOIN"] = &Server::linkSjoin;
+	_linkHandlers["TOPIC"] = &Server::linkTopic;
+	_linkHandlers["JOIN"] = &Server::linkJoin;
+	_linkHandlers["PART"] = &Server::linkPart;
+	_linkHandlers["KICK"] = &Server::linkKick;
+	_linkHandlers["MODE"] = &Server::linkMode;
+	_linkHandlers["PRIVMSG"] = &Server::linkPrivmsg;
+	_linkHandlers["NOTICE"] = &Server::linkPrivmsg;
+	_linkHandlers["INVITE"] = &Server::linkInvite;
+	_linkHandlers["QUIT"] = &Server::linkQuit;
+	_linkHandlers["KILL"] = &Server::linkKill;
+	_linkHandlers["SQUIT"] = &Server::linkSquit;
+	_linkHandlers["PING"] = &Server::linkPing;
+	_linkHandlers["PONG"] = &Server::linkPong;
+	_linkHandlers["ERROR"] = &Server::linkError;
+}
+
+void Server::loadLinkConfig(void)
+{
+	std::vector<std::string> links = _config.getAll("link");
+	for (size_t i = 0; i < links.size(); i++)
+	{
+		LinkConfig link;
+		std::string flag;
+		std::stringstream ss(links[i]);
+		ss >> link.name >> link.host >> link.port >> link.password >> flag;
+		if (link.password.empty() || link.port.find_first_not_of("0123456789") != std::string::npos
+			|| (!flag.empty() && flag != "connect") || link.name == _serverName)
+			throw std::runtime_error("Invalid link: " + links[i]);
+		link.connect = flag == "connect";
+		_linkConfig.push_back(link);
+	}
+}
+
+const std::string& Server::getServerName(void) const
+{
+	return _serverName;
+}
+
+void Server::propagate(const std::string &line, int except)
+{
+	for (size_t i = 0; i < _links.size(); i++)
+		if (_links[i] != except)
+			sendMessageToClient(_links[i], line);
+}
+
+void Server::propagateShared(SharedLine *line, int except)
+{
+	for (size_t i = 0; i < _links.size(); i++)
+		if (_links[i] != except)
+			sendSharedToClient(_links[i], line);
+}
+
+/*
+	dials every "connect" link that is neither up nor being dialed. the
+	connect is non-blocking: the SERVER line waits in the send queue and
+	goes out once the socket turns writable, and a refused connection
+	shows up as POLLERR / POLLHUP and is dropped like any other socket.
+*/
+void Server::connectLinks(void)
+{
+	for (size_t i = 0; i < _linkConfig.size(); i++)
+	{
+		const LinkConfig &link = _linkConfig[i];
+		if (!link.connect || _servers.count(link.name))
+			continue;
+		bool dialing = false;
+		for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end() && !dialing; it++)
+			dialing = it->second->getFlag(ClientServerLink) && it->second->getServer() == link.name;
+		if (dialing)
+			continue;
+
+		struct addrinfo hints;
+		struct addrinfo *address;
+		std::memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_UNSPEC;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(link.host.c_str(), link.port.c_str(), &hints, &address) != 0)
+		{
+			std::cerr << CMD_RED << "Link " << link.name << ": cannot resolve " << link.host << CMD_RESET << std::endl;
+			continue;
+		}
+		int fd = socket(address->ai_family, SOCK_STREAM, 0);
+		if (fd < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0
+			|| (connect(fd, address->ai_addr, address->ai_addrlen) < 0 && errno != EINPROGRESS))
+		{
+			std::cerr << CMD_RED << "Link " << link.name << ": " << strerror(errno) << CMD_RESET << std::endl;
+			if (fd >= 0)
+				close(fd);
+			freeaddrinfo(address);
+			continue;
+		}
+		freeaddrinfo(address);
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+		addPollfd(fd, POLLIN | POLLERR | POLLHUP);
+		Client *client = new Client(fd, "", link.host); // no ip: it was never counted by the throttle
+		client->setFlag(ClientServerLink, true);
+		client->setServer(link.name);
+		client->setLastActive(_timers.now());
+		_clients[fd] = client;
+		_timers.schedule(client->getTimer(), _timers.now() + REGISTRATION_TIMEOUT);
+		std::cout << CMD_YELLOW << "Linking to " << link.name << " at " << link.host << ":" << link.port << CMD_RESET << std::endl;
+		sendMessageToClient(fd, "SERVER " + _serverName + " " + link.password + " :" LINK_DESCRIPTION);
+	}
+}
+
+/**
+ * Handles SERVER from a connection that has not registered: another
+ * server introducing itself to open a link.
+ *
+ * @param socket The socket of the connection.
+ * @param args <name> <password> :<description>
+ */
+void Server::SERVER(int socket, const std::string &args)
+{
+	if (getClient(socket).isRegistered())
+	{
+		reply(socket, 462, {}, "You may not reregister");
+		return;
+	}
+	LinkMessage message;
+	message.parse("SERVER " + args, "");
+	linkHandshake(socket, message.params);
+}
+
+// SERVER <name> <password> :<description>, on either side of a new link
+void Server::linkHandshake(int socket, const std::vector<std::string> &params)
+{
+	Client &client = getClient(socket);
+	bool dialed = client.getFlag(ClientServerLink);
+	const LinkConfig *config = NULL;
+	for (size_t i = 0; params.size() >= 2 && i < _linkConfig.size(); i++)
+		if (_linkConfig[i].name == params[0])
+			config = &_linkConfig[i];
+	if (!config || config->password != params[1] || (dialed && client.getServer() != config->name))
+		return disconnectClient(socket, "Link refused");
+	if (_servers.count(config->name))
+		return disconnectClient(socket, "Server " + config->name + " already exists");
+
+	if (!dialed)
+	{
+		sendMessageToClient(socket, "SERVER " + _serverName + " " + config->password + " :" LINK_DESCRIPTION);
+		// a link is not a user: whatever NICK / USER it sent before SERVER leaves the index,
+		// and the client forgets them so removing the link later can't drop someone else's nick
+		_userIndex.removeClient(socket, client.getNickname(), client.getUsername(), client.getHostname());
+		client.setNickname("");
+		client.setUsername("");
+	}
+	std::string description = params.size() > 2 ? params[2] : "";
+	client.setFlag(ClientServerLink, true);
+	client.setServer(config->name);
+	client.setAuthenticated(true);
+	client.setRegistered(true);
+	_timers.schedule(client.getTimer(), _timers.now() + PING_INTERVAL);
+	RemoteServer server;
+	server.name = config->name;
+	server.uplink = _serverName;
+	server.description = description;
+	server.hops = 1;
+	server.link = socket;
+	_servers[server.name] = server;
+	_links.push_back(socket);
+	std::cout << CMD_YELLOW << "Linked with " << server.name << CMD_RESET << std::endl;
+
+	propagate(":" + _serverName + " SERVER " + server.name + " 2 :" + description, socket);
+	sendBurst(socket);
+}
+
+static bool fewerHops(const RemoteServer *a, const RemoteServer *b)
+{
+	return a->hops < b->hops;
+}
+
+// everything the new peer needs to know, see Link.hpp
+void Server::sendBurst(int link)
+{
+	std::vector<const RemoteServer *> servers;
+	for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); it++)
+		if (it->second.link != link)
+			servers.push_back(&it->second);
+	std::sort(servers.begin(), servers.end(), fewerHops); // uplinks first
+	for (size_t i = 0; i < servers.size(); i++)
+		sendMessageToClient(link, ":" + servers[i]->uplink + " SERVER " + servers[i]->name + " "
+			+ numberToString(servers[i]->hops + 1) + " :" + servers[i]->description);
+
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); it++)
+	{
+		Client &user = *it->second;
+		if (!user.isRegistered() || user.getFlag(ClientServerLink) || user.getLink() == link)
+			continue;
+		sendMessageToClient(link, ":" + (user.getLink() < 0 ? _serverName : user.getServer()) + " NICK "
+			+ user.getNickname() + " " + user.getUsername() + " " + user.getHostname() + " :" + user.getRealname());
+	}
+
+	for (size_t i = 0; i < _channels.capacity(); i++)
+	{
+		Channel *channel = _channels.channelAt(i);
+		if (!channel)
+			continue;
+		std::string head = ":" + _serverName + " SJOIN " + numberToString(channel->getCreationTime()) + " "
+			+ channel->getName() + " " + modeParams(*channel) + " :";
+		std::string members;
+		const std::vector<int> &clients = channel->getClients();
+		for (size_t j = 0; j < clients.size(); j++)
+		{
+			Client &member = getClient(clients[j]);
+			if (member.getLink() == link)
+				continue;
+			if (!members.empty() && head.size() + members.size() + NICK_MAX_LEN + 3 > NAMES_LINE_MAX)
+			{
+				sendMessageToClient(link, head + members);
+				members.clear();
+			}
+			members += members.empty() ? "" : " ";
+			members += channel->isOperator(clients[j]) ? "@" : channel->hasVoice(clients[j]) ? "+" : "";
+			members += member.getNickname();
+		}
+		if (members.empty())
+			continue;
+		sendMessageToClient(link, head + members);
+		sendMaskBurst(link, *channel);
+		if (channel->getTopicTime())
+			sendMessageToClient(link, ":" + _serverName + " TOPIC " + channel->getName() + " "
+				+ numberToString(channel->getTopicTime()) + " :" + channel->getTopic());
+	}
+}
+
+// the b / e / I lists follow the SJOIN as MODE lines, MODES_MAX masks a line
+void Server::sendMaskBurst(int link, Channel &channel)
+{
+	std::string head = ":" + _serverName + " MODE " + channel.getName() + " +";
+	for (int list = 0; list < MaskListCount; list++)
+	{
+		const std::vector<MaskEntry> &entries = channel.getMasks(static_cast<MaskList>(list));
+		std::string modes;
+		std::string params;
+		for (size_t i = 0; i <= entries.size(); i++)
+		{
+			if (!modes.empty() && (i == entries.size() || modes.size() == MODES_MAX
+				|| head.size() + modes.size() + params.size() + entries[i].mask.str().size() + 2 > NAMES_LINE_MAX))
+			{
+				sendMessageToClient(link, head + modes + params);
+				modes.clear();
+				params.clear();
+			}
+			if (i == entries.size())
+				break;
+			modes += "beI"[list];
+			params += " " + entries[i].mask.str();
+		}
+	}
+}
+
+// "+itk key 10": the channel modes and their parameters, as SJOIN carries them
+std::string Server::modeParams(Channel &channel) const
+{
+	std::string modes = "+";
+	std::string params;
+	if (channel.getMode(ChanInviteOnly))
+		modes += "i";
+	if (channel.getMode(ChanTopicProtected))
+		modes += "t";
+	if (channel.getMode(ChanSecret))
+		modes += "s";
+	if (channel.getMode(ChanModerated))
+		modes += "m";
+	if (channel.getMode(ChannelKey))
+	{
+		modes += "k";
+		params += " " + channel.getPass();
+	}
+	if (channel.getLimit() > 0)
+	{
+		modes += "l";
+		params += " " + numberToString(channel.getLimit());
+	}
+	return modes + params;
+}
+
+/*
+	applies "+it-k+o key nick" style changes coming from another server,
+	with the same effect the local MODE handler has: the origin already
+	checked the rights, this only keeps the state the same everywhere.
+	returns the index of a key that was set, 0 when none was.
+*/
+size_t Server::applyModes(Channel &channel, const std::vector<std::string> &params, size_t first, const std::string &setter)
+{
+	size_t key = 0;
+	if (first >= params.size())
+		return key;
+	const std::string &modes = params[first];
+	size_t next = first + 1;
+	bool add = true;
+	for (size_t i = 0; i < modes.size(); i++)
+	{
+		char mode = modes[i];
+		if (mode == '+' || mode == '-')
+		{
+			add = mode == '+';
+			continue;
+		}
+		std::string param;
+		bool isList = mode == 'b' || mode == 'e' || mode == 'I';
+		if ((isList || mode == 'o' || mode == 'v' || mode == 'k' || (mode == 'l' && add)) && next < params.size())
+			param = params[next++];
+		if (mode == 'i')
+			channel.setMode(ChanInviteOnly, add);
+		else if (mode == 't')
+			channel.setMode(ChanTopicProtected, add);
+		else if (mode == 's')
+			channel.setMode(ChanSecret, add);
+		else if (mode == 'm')
+			channel.setMode(ChanModerated, add);
+		else if (mode == 'k')
+		{
+			channel.setMode(ChannelKey, add);
+			if (add)
+				channel.setPass(param);
+			if (add)
+				key = next - 1;
+		}
+		else if (mode == 'l')
+			channel.setLimit(add ? std::atoi(param.c_str()) : 0);
+		else if (isList && !param.empty())
+		{
+			MaskList list = mode == 'b' ? ListBan : mode == 'e' ? ListExcept : ListInviteExcept;
+			if (add)
+				channel.addMask(list, param, setter, time(NULL));
+			else
+				channel.removeMask(list, param);
+		}
+		else if (mode == 'o' || mode == 'v')
+		{
+			int member = _userIndex.findNickname(param);
+			if (member == -1 || !channel.hasClient(member))
+				continue;
+			if (mode == 'o' && add)
+				channel.addOperator(member);
+			else if (mode == 'o')
+				channel.removeOperator(member);
+			else if (add)
+				channel.addVoice(member);
+			else
+				channel.removeVoice(member);
+		}
+	}
+	return key;
+}
+
+/*
+	one line from an established link (or from a dialed one that has not
+	answered yet, which may only say SERVER or ERROR).
+*/
+void Server::receiveFromLink(int link, const std::string &line)
+{
+	Client &client = getClient(link);
+	LinkMessage message;
+	if (!message.parse(line, client.getServer()))
+		return;
+	if (!client.isRegistered())
+	{
+		if (message.command == "SERVER")
+			linkHandshake(link, message.params);
+		else if (message.command == "ERROR")
+			closeLink(link, message.params.empty() ? "ERROR" : message.params.back());
+		return;
+	}
+	std::map<std::string, linkHandler>::iterator handler = _linkHandlers.find(message.command);
+	if (handler != _linkHandlers.end())
+		(this->*handler->second)(link, message);
+}
+
+// the remote user a line comes from, or -1 unless it is one behind that link
+int Server::linkUser(int link, const LinkMessage &message)
+{
+	int user = _userIndex.findNickname(message.sourceNick());
+	if (user == -1 || getClient(user).getLink() != link)
+		return -1;
+	return user;
+}
+
+void Server::removeRemoteUser(int user, const std::string &quit)
+{
+	sendMessageToClientChannels(user, quit);
+	removeClient(user);
+}
+
+/*
+	a link went down: every server behind it leaves with its users, as a
+	netsplit, and the rest of the network hears SQUIT for the peer.
+*/
+void Server::closeLink(int link, const std::string &reason)
+{
+	Client &client = getClient(link);
+	std::string peer = client.getServer();
+	if (client.isRegistered())
+	{
+		std::cout << CMD_RED << "Lost link with " << peer << ": " << reason << CMD_RESET << std::endl;
+		std::set<std::string> gone;
+		for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); it++)
+			if (it->second.link == link)
+				gone.insert(it->first);
+		dropServers(gone, _serverName + " " + peer);
+		_links.erase(std::find(_links.begin(), _links.end(), link));
+		propagate(":" + _serverName + " SQUIT " + peer + " :" + reason, -1);
+	}
+	else
+		std::cout << CMD_RED << "Link with " << peer << " failed: " << reason << CMD_RESET << std::endl;
+	removeClient(link);
+}
+
+void Server::dropServers(const std::set<std::string> &servers, const std::string &reason)
+{
+	std::vector<int> users;
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); it++)
+		if (it->second->getLink() >= 0 && servers.count(it->second->getServer()))
+			users.push_back(it->first);
+	for (size_t i = 0; i < users.size(); i++)
+		removeRemoteUser(users[i], getClient(users[i]).prefix() + "QUIT :" + reason);
+	for (std::set<std::string>::const_iterator it = servers.begin(); it != servers.end(); it++)
+		_servers.erase(*it);
+}
+
+// :<uplink> SERVER <name> <hops> :<description>, a server behind the peer
+void Server::linkServer(int link, const LinkMessage &message)
+{
+	if (message.params.size() < 2)
+		return;
+	const std::string &name = message.params[0];
+	if (name == _serverName || _servers.count(name))
+		return disconnectClient(link, "Server " + name + " already exists"); // a loop in the tree
+	RemoteServer server;
+	server.name = name;
+	server.uplink = message.source;
+	server.hops = std::atoi(message.params[1].c_str());
+	server.description = message.params.size() > 2 ? message.params[2] : "";
+	server.link = link;
+	_servers[name] = server;
+	propagate(":" + server.uplink + " SERVER " + name + " " + numberToString(server.hops + 1) + " :" + server.description, link);
+}
+
+/*
+	:<server> NICK <nick> <user> <host> :<realname> introduces a user,
+	:<nick!user@host> NICK <new> renames one.
+*/
+void Server::linkNick(int link, const LinkMessage &message)
+{
+	if (message.params.empty())
+		return;
+	const std::string &nickname = message.params[0];
+	int existing = _userIndex.findNickname(nickname);
+	if (message.source.find('!') == std::string::npos && message.params.size() >= 3)
+	{
+		if (existing != -1) // nobody keeps a nick that both sides had
+		{
+			propagate(":" + _serverName + " KILL " + nickname + " :Nick collision", -1);
+			if (existing >= 0)
+				disconnectClient(existing, "Nick collision");
+			else
+				removeRemoteUser(existing, getClient(existing).prefix() + "QUIT :Killed (Nick collision)");
+			return;
+		}
+		int id = _nextRemoteId--;
+		Client *user = new Client(id, message.params[2], message.params[2]);
+		user->setNickname(nickname);
+		user->setUsername(message.params[1]);
+		user->setRealname(message.params.size() > 3 ? message.params[3] : "");
+		user->setAuthenticated(true);
+		user->setRegistered(true);
+		user->setLink(link);
+		user->setServer(message.source);
+		_clients[id] = user;
+		_userIndex.addHost(id, user->getHostname());
+		_userIndex.setNickname(id, "", nickname);
+		_userIndex.setUsername(id, "", user->getUsername());
+		propagate(message.line, link);
+		notifyWatchers(nickname, user->getNetworkIdentifier());
+		return;
+	}
+	int user = linkUser(link, message);
+	if (user == -1)
+		return;
+	Client &client = getClient(user);
+	if (existing != -1 && existing != user)
+	{
+		// renamed onto a nick taken here: it goes, the taker stays
+		sendMessageToClient(link, ":" + _serverName + " KILL " + nickname + " :Nick collision");
+		std::string quit = client.prefix() + "QUIT :Killed (Nick collision)";
+		propagate(quit, link);
+		removeRemoteUser(user, quit);
+		return;
+	}
+	notifyWatchers(client.getNickname(), "");
+	std::vector<Channel *> channels = getClientChannels(user);
+	for (size_t i = 0; i < channels.size(); i++)
+		channels[i]->renameClient(user, client.getNickname(), nickname);
+	_userIndex.setNickname(user, client.getNickname(), nickname);
+	client.setNickname(nickname);
+	notifyWatchers(nickname, client.getNetworkIdentifier());
+	sendMessageToClientChannels(user, message.line);
+	propagate(message.line, link);
+}
+
+/*
+	:<server> SJOIN <ts> <channel> <+modes> [params] :[@|+]nick ...
+	the side with the older channel wins its modes and statuses; the
+	newer side's members still join, without them.
+*/
+void Server::linkSjoin(int link, const LinkMessage &message)
+{
+	if (message.params.size() < 4)
+		return;
+	time_t theirs = std::atol(message.params[0].c_str());
+	const std::string &name = message.params[1];
+	Channel *channel = _channels.find(name);
+	bool created = !channel;
+	if (created)
+	{
+		channel = &createChannel(name, "");
+		channel->setTimes(theirs, 0);
+	}
+	time_t ours = channel->getCreationTime();
+	if (!created && theirs < ours)
+	{
+		const std::vector<int> &clients = channel->getClients();
+		for (size_t i = 0; i < clients.size(); i++)
+		{
+			std::string nickname = getClient(clients[i]).getNickname();
+			if (channel->isOperator(clients[i]))
+				channel->broadcast(prefix() + "MODE " + name + " -o " + nickname, link);
+			if (channel->hasVoice(clients[i]))
+				channel->broadcast(prefix() + "MODE " + name + " -v " + nickname, link);
+			channel->removeOperator(clients[i]);
+			channel->removeVoice(clients[i]);
+		}
+		channel->setModes(0);
+		channel->setLimit(0);
+		channel->clearMasks();
+		channel->setTimes(theirs, channel->getTopicTime());
+	}
+	bool theyWin = created || theirs <= ours;
+	if (theyWin)
+	{
+		std::vector<std::string> modes(message.params.begin() + 2, message.params.end() - 1);
+		applyModes(*channel, modes, 0, message.source);
+	}
+
+	std::stringstream members(message.params.back());
+	std::string token;
+	while (members >> token)
+	{
+		size_t status = token.find_first_not_of("@+");
+		int user = _userIndex.findNickname(token.substr(status));
+		if (user == -1 || getClient(user).getLink() != link || channel->hasClient(user))
+			continue;
+		channel->addClient(user);
+		channel->broadcast(getClient(user).prefix() + "JOIN " + channel->getName(), link);
+		if (theyWin && token.find('@') < status)
+		{
+			channel->addOperator(user);
+			channel->broadcast(prefix() + "MODE " + channel->getName() + " +o " + getClient(user).getNickname(), link);
+		}
+		if (theyWin && token.find('+') < status)
+		{
+			channel->addVoice(user);
+			channel->broadcast(prefix() + "MODE " + channel->getName() + " +v " + getClient(user).getNickname(), link);
+		}
+	}
+	propagate(message.line, link);
+}
+
+/*
+	:<nick!user@host> TOPIC <channel> : <topic> from a user, or
+	:<server> TOPIC <channel> <time> :<topic> in a burst, kept when it is
+	newer than ours.
+*/
+void Server::linkTopic(int link, const LinkMessage &message)
+{
+	if (message.params.size() < 2)
+		return;
+	Channel *channel = _channels.find(message.params[0]);
+	if (!channel)
+		return;
+	if (message.source.find('!') == std::string::npos && message.params.size() >= 3)
+	{
+		time_t time = std::atol(message.params[1].c_str());
+		if (time <= channel->getTopicTime())
+			return;
+		channel->setTopic(message.params[2]);
+		channel->setTimes(channel->getCreationTime(), time);
+		channel->broadcast(prefix() + "TOPIC " + channel->getName() + " : " + message.params[2], link);
+		propagate(message.line, link);
+		return;
+	}
+	std::string topic = message.params.back();
+	if (!topic.empty() && topic[0] == ' ') // the local TOPIC line reads "<channel> : <topic>"
+		topic = topic.substr(1);
+	channel->setTopic(topic);
+	channel->broadcastEvent(message.line, link);
+}
+
+void Server::linkJoin(int link, const LinkMessage &message)
+{
+	int user = linkUser(link, message);
+	if (user == -1 || message.params.empty())
+		return;
+	const std::string &name = message.params[0];
+	Channel *existing = findChannel(name);
+	Channel &channel = existing ? *existing : createChannel(name, "");
+	if (channel.hasClient(user))
+		return;
+	channel.addClient(user);
+	channel.removeInvite(user);
+	if (channel.getClientCount() == 1) // the same rule JOIN applies at the origin
+		channel.addOperator(user);
+	channel.broadcastEvent(message.line, link);
+}
+
+void Server::linkPart(int link, const LinkMessage &message)
+{
+	int user = linkUser(link, message);
+	Channel *channel = message.params.empty() ? NULL : _channels.find(message.params[0]);
+	if (user == -1 || !channel || !channel->hasClient(user))
+		return;
+	channel->broadcastEvent(message.line, link);
+	channel->removeClient(user);
+	removeChannelIfEmpty(*channel);
+}
+
+void Server::linkKick(int link, const LinkMessage &message)
+{
+	if (message.params.size() < 2)
+		return;
+	Channel *channel = _channels.find(message.params[0]);
+	int target = _userIndex.findNickname(message.params[1]);
+	if (!channel || target == -1 || !channel->hasClient(target))
+		return;
+	channel->broadcastEvent(message.line, link);
+	channel->removeClient(target);
+	removeChannelIfEmpty(*channel);
+}
+
+void Server::linkMode(int link, const LinkMessage &message)
+{
+	Channel *channel = message.params.empty() ? NULL : _channels.find(message.params[0]);
+	if (!channel)
+		return; // user modes stay on the user's server
+	size_t key = applyModes(*channel, message.params, 1, message.source);
+	std::string line = message.line;
+	if (key) // members see the key masked, as with a local MODE
+	{
+		line = ":" + message.source + " MODE " + channel->getName();
+		for (size_t i = 1; i < message.params.size(); i++)
+			line += " " + (i == key ? "********" : message.params[i]);
+	}
+	channel->broadcast(line, link);
+	propagate(message.line, link);
+}
+
+// the origin checked the targets, this delivers to the ones here and passes the line on
+void Server::linkPrivmsg(int link, const LinkMessage &message)
+{
+	if (linkUser(link, message) == -1 || message.params.size() < 2)
+		return;
+	std::vector<std::string> targets;
+	std::stringstream ss(message.params[0]);
+	std::string target;
+	while (std::getline(ss, target, ','))
+		targets.push_back(target);
+	deliverMessage(":" + message.source + " ", message.command, targets, ":" + message.params[1], link);
+}
+
+void Server::linkInvite(int link, const LinkMessage &message)
+{
+	if (message.params.size() < 2)
+		return;
+	int user = _userIndex.findNickname(message.params[0]);
+	if (user == -1 || getClient(user).getLink() == link)
+		return;
+	Channel *channel = _channels.find(message.params[1]);
+	if (channel && user >= 0)
+		channel->addInvite(user);
+	sendMessageToClient(user, message.line);
+}
+
+void Server::linkQuit(int link, const LinkMessage &message)
+{
+	int user = linkUser(link, message);
+	if (user == -1)
+		return;
+	removeRemoteUser(user, message.line);
+	propagate(message.line, link);
+}
+
+void Server::linkKill(int link, const LinkMessage &message)
+{
+	int user = message.params.empty() ? -1 : _userIndex.findNickname(message.params[0]);
+	if (user == -1)
+		return;
+	std::string reason = "Killed (" + (message.params.size() > 1 ? message.params[1] : message.source) + ")";
+	propagate(message.line, link);
+	if (user >= 0)
+		disconnectClient(user, reason);
+	else
+		removeRemoteUser(user, getClient(user).prefix() + "QUIT :" + reason);
+}
+
+// SQUIT <server> :<reason>: that server and everything behind it left
+void Server::linkSquit(int link, const LinkMessage &message)
+{
+	if (message.params.empty())
+		return;
+	const std::string &name = message.params[0];
+	std::string reason = message.params.size() > 1 ? message.params[1] : name;
+	if (name == getClient(link).getServer() || name == _serverName)
+		return closeLink(link, reason);
+	std::map<std::string, RemoteServer>::iterator server = _servers.find(name);
+	if (server == _servers.end() || server->second.link != link)
+		return;
+	std::set<std::string> gone;
+	gone.insert(name);
+	for (size_t count = 0; count != gone.size(); )
+	{
+		count = gone.size();
+		for (std::map<std::string, RemoteServer>::iterator it = _servers.begin(); it != _servers.end(); it++)
+			if (gone.count(it->second.uplink))
+				gone.insert(it->first);
+	}
+	dropServers(gone, server->second.uplink + " " + name);
+	propagate(message.line, link);
+}
+
+void Server::linkPing(int link, const LinkMessage &message)
+{
+	sendMessageToClient(link, ":" + _serverName + " PONG " + _serverName + " :"
+		+ (message.params.empty() ? _serverName : message.params.back()));
+}
+
+void Server::linkPong(int link, const LinkMessage &message)
+{
+	(void)message;
+	getClient(link).setFlag(ClientPingSent, false);
+}
+
+void Server::linkError(int link, const LinkMessage &message)
+{
+	closeLink(link, message.params.empty() ? "ERROR" : message.params.back());
+}
@@ -0,0 +1,145 @@
+#include "../include/Mask.hpp"
+
+char ircToLower(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c + ('a' - 'A');
+	if (c == '[')
+		return '{';
+	if (c == ']')
+		return '}';
+	if (c == '\\')
+		return '|';
+	if (c == '~')
+		return '^';
+	return c;
+}
+
+std::string ircLower(std::string_view str)
+{
+	std::string lower(str);
+	for (size_t i = 0; i < lower.size(); i++)
+		lower[i] = ircToLower(lower[i]);
+	return lower;
+}
+
+bool hasWildcards(std::string_view mask)
+{
+	return mask.find_first_of("*?") != std::string_view::npos;
+}
+
+/*
+	iterative glob matching: on a mismatch we go back to the last '*' and
+	let it swallow one more character, so no recursion and no allocation.
+*/
+bool matchMask(std::string_view mask, std::string_view str)
+{
+	size_t m = 0;
+	size_t s = 0;
+	size_t star = std::string::npos;
+	size_t starMatch = 0;
+	while (s < str.size())
+	{
+		if (m < mask.size() && (mask[m] == '?' || ircToLower(mask[m]) == ircToLower(str[s])))
+		{
+			m++;
+			s++;
+		}
+		else if (m < mask.size() && mask[m] == '*')
+		{
+			star = m++;
+			starMatch = s;
+		}
+		else if (star != std::string::npos)
+		{
+			m = star + 1;
+			s = ++starMatch;
+		}
+		else
+			return false;
+	}
+	while (m < mask.size() && mask[m] == '*')
+		m++;
+	return m == mask.size();
+}
+
+/*
+	the parts a mask leaves out match anything: a bare nick is a nick with
+	any user and host, "user@host" any nick.
+*/
+std::string fullMask(const std::string &mask)
+{
+	size_t bang = mask.find('!');
+	size_t at = mask.find('@');
+	if (bang == std::string::npos && at == std::string::npos)
+		return mask + "!*@*";
+	if (bang == std::string::npos)
+		return "*!" + mask;
+	if (at == std::string::npos)
+		return mask + "@*";
+	return mask;
+}
+
+CompiledMask::CompiledMask(const std::string &mask): _mask(mask), _star(false)
+{
+	std::string folded = ircLower(mask);
+	size_t first = folded.find('*');
+	if (first == std::string::npos)
+	{
+		_head = folded;
+		return;
+	}
+	_star = true;
+	size_t last = folded.rfind('*');
+	_head = folded.substr(0, first);
+	_tail = folded.substr(last + 1);
+	for (size_t start = first + 1; start < last; )
+	{
+		size_t end = folded.find('*', start);
+		if (end > start)
+			_runs.push_back(folded.substr(start, end - start));
+		start = end + 1;
+	}
+}
+
+const std::string& CompiledMask::str(void) const
+{
+	return _mask;
+}
+
+static bool runAt(std::string_view str, size_t pos, const std::string &run)
+{
+	for (size_t i = 0; i < run.size(); i++)
+		if (run[i] != '?' && run[i] != str[pos + i])
+			return false;
+	return true;
+}
+
+static size_t findRun(std::string_view str, size_t from, const std::string &run)
+{
+	if (run.find('?') == std::string::npos)
+		return str.find(run, from);
+	for (size_t pos = from; pos + run.size() <= str.size(); pos++)
+		if (runAt(str, pos, run))
+			return pos;
+	return std::string::npos;
+}
+
+bool CompiledMask::matches(std::string_view str) const
+{
+	if (!_star)
+		return str.size() == _head.size() && runAt(str, 0, _head);
+	if (str.size() < _head.size() + _tail.size() || !runAt(str, 0, _head)
+		|| !runAt(str, str.size() - _tail.size(), _tail))
+		return false;
+	size_t pos = _head.size();
+	size_t end = str.size() - _tail.size();
+	for (size_t i = 0; i < _runs.size(); i++)
+	{
+		pos = findRun(str, pos, _runs[i]); // leftmost is always safe: a '*' follows
+		if (pos == std::string::npos || pos + _runs[i].size() > end)
+			return false;
+		pos += _runs[i].size();
+	}
+	return true;
+}
@@ -0,0 +1,56 @@
+#include "../include/MemoryStats.hpp"
+
+size_t	MemoryStats::_used[MemoryCategoryCount] = {};
+size_t	MemoryStats::_peak[MemoryCategoryCount] = {};
+size_t	MemoryStats::_total = 0;
+size_t	MemoryStats::_totalPeak = 0;
+
+void MemoryStats::charge(MemoryCategory category, size_t bytes)
+{
+	_used[category] += bytes;
+	_total += bytes;
+	if (_used[category] > _peak[category])
+		_peak[category] = _used[category];
+	if (_total > _totalPeak)
+		_totalPeak = _total;
+}
+
+void MemoryStats::release(MemoryCategory category, size_t bytes)
+{
+	_used[category] -= bytes;
+	_total -= bytes;
+}
+
+void MemoryStats::set(MemoryCategory category, size_t bytes)
+{
+	release(category, _used[category]);
+	charge(category, bytes);
+}
+
+size_t MemoryStats::used(MemoryCategory category)
+{
+	return _used[category];
+}
+
+size_t MemoryStats::peak(MemoryCategory category)
+{
+	return _peak[category];
+}
+
+size_t MemoryStats::total(void)
+{
+	return _total;
+}
+
+size_t MemoryStats::totalPeak(void)
+{
+	return _totalPeak;
+}
+
+const char *MemoryStats::name(MemoryCategory category)
+{
+	static const char *names[MemoryCategoryCount] = {
+		"inbound", "outbound", "lines", "clients", "channels", "tables"
+	};
+	return names[category];
+}
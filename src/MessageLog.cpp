@@ -0,0 +1,539 @@
+#include "../include/MessageLog.hpp"
+#include "../include/Serializer.hpp"
+#include "../include/Mask.hpp"
+#include <iostream>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <cerrno>
+#include <ctime>
+#include <csignal>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#define LOG_MAGIC_SIZE (sizeof(LOG_MAGIC) - 1)
+#define LOG_RECORD_MIN 28 // size, msgid, time and the two string lengths
+
+static bool segmentBefore(const LogSegment &segment, uint32_t id)
+{
+	return segment.id < id;
+}
+
+MessageLog::MessageLog(void)
+: _segmentSize(LOG_SEGMENT_SIZE), _retention(0), _enabled(false), _lastMsgid(0), _queuedBytes(0),
+_writing(false), _stop(false), _writtenSegment(0), _writtenSize(0)
+{
+	pthread_mutex_init(&_lock, NULL);
+	pthread_cond_init(&_wake, NULL);
+	pthread_cond_init(&_idle, NULL);
+}
+
+MessageLog::~MessageLog(void)
+{
+	close();
+	pthread_cond_destroy(&_idle);
+	pthread_cond_destroy(&_wake);
+	pthread_mutex_destroy(&_lock);
+}
+
+std::string MessageLog::segmentPath(uint32_t id) const
+{
+	char name[32];
+	snprintf(name, sizeof(name), "/%010u.seg", id);
+	return _dir + name;
+}
+
+void MessageLog::open(const std::string &dir, size_t segmentSize, uint64_t retention)
+{
+	_dir = dir;
+	_segmentSize = segmentSize;
+	_retention = retention;
+	if (mkdir(dir.c_str(), 0700) < 0 && errno != EEXIST)
+		throw std::runtime_error("Failed to create " + dir + ": " + strerror(errno));
+	DIR *listing = opendir(dir.c_str());
+	if (!listing)
+		throw std::runtime_error("Failed to open " + dir + ": " + strerror(errno));
+	std::vector<uint32_t> ids;
+	while (struct dirent *entry = readdir(listing))
+	{
+		std::string name = entry->d_name;
+		if (name.size() == 14 && name.compare(10, 4, ".seg") == 0
+			&& name.find_first_not_of("0123456789") == 10)
+			ids.push_back(std::strtoul(name.c_str(), NULL, 10));
+	}
+	closedir(listing);
+	std::sort(ids.begin(), ids.end());
+	for (size_t i = 0; i < ids.size(); i++)
+		scanSegment(ids[i], i + 1 == ids.size());
+	if (!_segments.empty())
+	{
+		_writtenSegment = _segments.back().id;
+		_writtenSize = _segments.back().size;
+	}
+
+	_stop = false;
+	// the writer starts with every signal blocked, so SIGINT / SIGTERM / SIGUSR2 interrupt the loop's poll
+	sigset_t all, previous;
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &previous);
+	int started = pthread_create(&_writer, NULL, writerMain, this);
+	pthread_sigmask(SIG_SETMASK, &previous, NULL);
+	if (started != 0)
+		throw std::runtime_error("Failed to start the message log writer");
+	_enabled = true;
+	expire(std::time(NULL) * 1000ULL);
+}
+
+/*
+	rebuilds the index of one segment. a record that does not parse ends
+	the segment: in the last one it is a write cut short by a crash, and
+	the file is truncated there so appends carry on from a clean end.
+*/
+void MessageLog::scanSegment(uint32_t id, bool last)
+{
+	std::string path = segmentPath(id);
+	int fd = ::open(path.c_str(), last ? O_RDWR | O_CLOEXEC : O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat st;
+	const char *base = NULL;
+	if (fstat(fd, &st) < 0 || size_t(st.st_size) < LOG_MAGIC_SIZE
+		|| (base = static_cast<const char *>(mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))) == MAP_FAILED
+		|| std::memcmp(base, LOG_MAGIC, LOG_MAGIC_SIZE))
+	{
+		if (base && base != MAP_FAILED)
+			munmap(const_cast<char *>(base), st.st_size);
+		::close(fd);
+		std::cerr << "Message log: ignoring " << path << std::endl;
+		return;
+	}
+	LogSegment segment = { id, uint32_t(LOG_MAGIC_SIZE), 0, base, size_t(st.st_size) };
+	size_t size = st.st_size;
+	while (segment.size + 4 <= size)
+	{
+		try
+		{
+			Deserializer in(base + segment.size, size - segment.size);
+			uint32_t total = in.getU32();
+			if (total < LOG_RECORD_MIN || total > size - segment.size)
+				break;
+			uint64_t msgid = in.getU64();
+			uint64_t time = in.getU64();
+			std::string channel = in.getString();
+			in.getString();
+			addIndexPoint(channel, msgid, time, id, segment.size);
+			_lastMsgid = std::max(_lastMsgid, msgid);
+			segment.newest = time;
+			segment.size += total;
+		}
+		catch (std::runtime_error &)
+		{
+			break;
+		}
+	}
+	if (segment.size < size && last)
+	{
+		std::cerr << "Message log: dropping a torn record at the end of " << path << std::endl;
+		if (ftruncate(fd, segment.size) < 0)
+			std::cerr << "Message log: " << path << ": " << strerror(errno) << std::endl;
+	}
+	::close(fd);
+	_segments.push_back(segment);
+}
+
+void MessageLog::addIndexPoint(const std::string &key, uint64_t msgid, uint64_t time, uint32_t segment, uint32_t offset)
+{
+	LogChannelIndex &index = _index[key];
+	if (index.points.empty() || index.sinceLast == 0 || index.points.back().segment != segment)
+	{
+		LogIndexPoint point = { msgid, time, segment, offset };
+		index.points.push_back(point);
+		index.sinceLast = 0;
+	}
+	index.sinceLast = (index.sinceLast + 1) % LOG_INDEX_EVERY;
+}
+
+bool MessageLog::enabled(void) const
+{
+	return _enabled;
+}
+
+uint64_t MessageLog::nextMsgid(void) const
+{
+	return _lastMsgid + 1;
+}
+
+void MessageLog::queue(uint32_t segment, uint32_t end, const std::string &head, const char *tail, size_t tailSize)
+{
+	pthread_mutex_lock(&_lock);
+	if (_queue.empty() || _queue.back().segment != segment || _queue.back().drop)
+	{
+		LogWrite write = { segment, end, false, std::string() };
+		_queue.push_back(write);
+	}
+	LogWrite &write = _queue.back();
+	write.bytes.append(head);
+	write.bytes.append(tail, tailSize);
+	write.end = end;
+	_queuedBytes += head.size() + tailSize;
+	if (_queuedBytes >= LOG_BATCH_BYTES)
+		pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+}
+
+void MessageLog::startSegment(uint64_t time)
+{
+	uint32_t id = _segments.empty() ? 0 : _segments.back().id + 1;
+	LogSegment segment = { id, uint32_t(LOG_MAGIC_SIZE), time, NULL, 0 };
+	_segments.push_back(segment);
+	queue(id, segment.size, LOG_MAGIC, NULL, 0);
+	expire(time);
+}
+
+/*
+	drops the segments past retention, oldest first. the segment being
+	appended to always stays, and so does every index point into a kept
+	segment: points are in log order, so the dropped ones are a prefix.
+*/
+void MessageLog::expire(uint64_t now)
+{
+	while (_retention && _segments.size() > 1 && _segments.front().newest + _retention < now)
+	{
+		LogSegment &segment = _segments.front();
+		if (segment.map)
+			munmap(const_cast<char *>(segment.map), segment.mapped);
+		pthread_mutex_lock(&_lock);
+		LogWrite drop = { segment.id, 0, true, std::string() };
+		_queue.push_back(drop);
+		pthread_mutex_unlock(&_lock);
+		_segments.pop_front();
+	}
+	uint32_t oldest = _segments.empty() ? 0 : _segments.front().id;
+	for (std::map<std::string, LogChannelIndex>::iterator it = _index.begin(); it != _index.end(); )
+	{
+		std::vector<LogIndexPoint> &points = it->second.points;
+		size_t dropped = 0;
+		while (dropped < points.size() && points[dropped].segment < oldest)
+			dropped++;
+		points.erase(points.begin(), points.begin() + dropped);
+		if (points.empty())
+			_index.erase(it++);
+		else
+			++it;
+	}
+}
+
+void MessageLog::append(const std::string &channel, uint64_t msgid, uint64_t time, const SharedLine *line)
+{
+	if (!_enabled)
+		return;
+	if (_segments.empty() || _segments.back().size >= _segmentSize)
+		startSegment(time);
+	LogSegment &segment = _segments.back();
+	std::string key = ircLower(channel);
+	size_t lineSize = line->size() - 2; // without "\r\n"
+	uint32_t total = LOG_RECORD_MIN + key.size() + lineSize;
+
+	Serializer record;
+	record.putU32(total);
+	record.putU64(msgid);
+	record.putU64(time);
+	record.putString(key);
+	record.putU32(lineSize);
+	addIndexPoint(key, msgid, time, segment.id, segment.size);
+	segment.size += total;
+	segment.newest = time;
+	_lastMsgid = msgid;
+	queue(segment.id, segment.size, record.data(), line->data(), lineSize);
+}
+
+void MessageLog::flush(void)
+{
+	if (!_enabled)
+		return;
+	pthread_mutex_lock(&_lock);
+	pthread_cond_signal(&_wake);
+	while (!_queue.empty() || _writing)
+		pthread_cond_wait(&_idle, &_lock);
+	pthread_mutex_unlock(&_lock);
+}
+
+void MessageLog::close(void)
+{
+	if (!_enabled)
+		return;
+	pthread_mutex_lock(&_lock);
+	_stop = true;
+	pthread_cond_signal(&_wake);
+	pthread_mutex_unlock(&_lock);
+	pthread_join(_writer, NULL);
+	for (size_t i = 0; i < _segments.size(); i++)
+		if (_segments[i].map)
+			munmap(const_cast<char *>(_segments[i].map), _segments[i].mapped);
+	_segments.clear();
+	_index.clear();
+	_enabled = false;
+}
+
+void *MessageLog::writerMain(void *log)
+{
+	static_cast<MessageLog *>(log)->writerLoop();
+	return NULL;
+}
+
+/*
+	the writer thread. it only touches the queue and the written position
+	under the lock, and the files outside of it; everything else belongs
+	to the loop. a failed open or write is reported and the rest of that
+	segment is skipped: the loop placed the records after it at offsets
+	the file no longer matches. the written position only moves past
+	records that are whole in the file, the loop is never held up.
+*/
+void MessageLog::writerLoop(void)
+{
+	int fd = -1;
+	uint32_t current = 0;
+	bool failed = false; // the current segment lost a record
+	pthread_mutex_lock(&_lock);
+	while (true)
+	{
+		if (_queue.empty())
+		{
+			if (_stop)
+				break;
+			struct timespec deadline;
+			clock_gettime(CLOCK_REALTIME, &deadline);
+			deadline.tv_nsec += LOG_FLUSH_MS * 1000000L;
+			deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+			deadline.tv_nsec %= 1000000000L;
+			pthread_cond_timedwait(&_wake, &_lock, &deadline);
+			continue;
+		}
+		std::vector<LogWrite> batch;
+		batch.swap(_queue);
+		_queuedBytes = 0;
+		_writing = true;
+		pthread_mutex_unlock(&_lock);
+
+		bool wrote = false;
+		uint32_t segment = 0, end = 0;
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			LogWrite &write = batch[i];
+			if (write.drop)
+			{
+				if (fd >= 0 && current == write.segment)
+				{
+					::close(fd);
+					fd = -1;
+				}
+				unlink(segmentPath(write.segment).c_str());
+				continue;
+			}
+			if (current != write.segment || (fd < 0 && !failed))
+			{
+				if (fd >= 0)
+				{
+					fdatasync(fd);
+					::close(fd);
+				}
+				current = write.segment;
+				fd = ::open(segmentPath(current).c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+				failed = fd < 0;
+				if (failed)
+					std::cerr << "Message log: " << segmentPath(current) << ": " << strerror(errno) << std::endl;
+			}
+			size_t done = 0;
+			while (!failed && done < write.bytes.size())
+			{
+				ssize_t n = ::write(fd, write.bytes.data() + done, write.bytes.size() - done);
+				if (n < 0 && errno == EINTR)
+					continue;
+				if (n < 0)
+				{
+					std::cerr << "Message log: " << segmentPath(current) << ": " << strerror(errno) << std::endl;
+					failed = true;
+					break;
+				}
+				done += n;
+			}
+			if (failed)
+				continue;
+			wrote = true;
+			segment = write.segment;
+			end = write.end;
+		}
+		if (fd >= 0)
+			fdatasync(fd);
+
+		pthread_mutex_lock(&_lock);
+		_writing = false;
+		if (wrote)
+		{
+			_writtenSegment = segment;
+			_writtenSize = end;
+		}
+		pthread_cond_broadcast(&_idle);
+	}
+	pthread_mutex_unlock(&_lock);
+	if (fd >= 0)
+		::close(fd);
+}
+
+size_t MessageLog::segmentAt(uint32_t id) const
+{
+	return std::lower_bound(_segments.begin(), _segments.end(), id, segmentBefore) - _segments.begin();
+}
+
+/*
+	maps the first size bytes of a segment, remapping once the segment
+	grew past its mapping, and returns how many of them can be read: the
+	file may be shorter when writes to it failed, and touching a mapping
+	past the end of its file is a SIGBUS. 0 when nothing can be read.
+*/
+uint32_t MessageLog::mapSegment(size_t index, uint32_t size)
+{
+	LogSegment &segment = _segments[index];
+	if (segment.map && segment.mapped >= size)
+		return size;
+	if (segment.map)
+		munmap(const_cast<char *>(segment.map), segment.mapped);
+	segment.map = NULL;
+	int fd = ::open(segmentPath(segment.id).c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		::close(fd);
+		return 0;
+	}
+	size = std::min<uint64_t>(size, st.st_size);
+	void *map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	::close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+	segment.map = static_cast<const char *>(map);
+	segment.mapped = size;
+	return size;
+}
+
+/*
+	walks the records of one channel in log order from (segment, offset)
+	up to (toSegment, toOffset). before: collects keys under mark and stops
+	at the first record at or over it. after: collects keys over mark
+	until limit. msgids and times grow along the log, so any record can
+	end a walk, whatever its channel.
+*/
+void MessageLog::scan(const std::string &key, uint32_t segment, uint32_t offset, uint32_t toSegment, uint32_t toOffset,
+	bool byMsgid, bool before, uint64_t mark, size_t limit, std::vector<LoggedLine> &out)
+{
+	for (size_t index = segmentAt(segment); index < _segments.size() && _segments[index].id <= toSegment; index++)
+	{
+		const LogSegment &current = _segments[index];
+		uint32_t end = current.id == toSegment ? toOffset : current.size;
+		if (current.id != segment)
+			offset = LOG_MAGIC_SIZE;
+		if (offset >= end || offset >= (end = mapSegment(index, end)))
+			continue;
+		while (offset + 4 <= end)
+		{
+			LoggedLine line;
+			std::string channel;
+			try
+			{
+				Deserializer in(current.map + offset, end - offset);
+				uint32_t total = in.getU32();
+				if (total < LOG_RECORD_MIN || total > end - offset)
+					break;
+				line.msgid = in.getU64();
+				line.time = in.getU64();
+				channel = in.getString();
+				if (channel == key)
+					line.line = in.getString();
+				offset += total;
+			}
+			catch (std::runtime_error &)
+			{
+				break;
+			}
+			uint64_t value = byMsgid ? line.msgid : line.time;
+			if (before && value >= mark)
+				return;
+			if (channel != key || (!before && value <= mark))
+				continue;
+			out.push_back(line);
+			if (out.size() >= limit)
+				return;
+		}
+	}
+}
+
+void MessageLog::before(const std::string &channel, bool byMsgid, uint64_t mark, size_t limit, std::vector<LoggedLine> &out)
+{
+	std::map<std::string, LogChannelIndex>::const_iterator it = _index.find(ircLower(channel));
+	if (!_enabled || it == _index.end() || limit == 0)
+		return;
+	pthread_mutex_lock(&_lock);
+	uint32_t toSegment = _writtenSegment, toOffset = _writtenSize;
+	pthread_mutex_unlock(&_lock);
+
+	// first point at or past mark: the lines wanted start in the window before it
+	const std::vector<LogIndexPoint> &points = it->second.points;
+	size_t low = 0, high = points.size();
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if ((byMsgid ? points[middle].msgid : points[middle].time) < mark)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	std::vector<LoggedLine> lines;
+	for (size_t i = low; i > 0 && lines.size() < limit; i--)
+	{
+		const LogIndexPoint &point = points[i - 1];
+		std::vector<LoggedLine> window;
+		scan(it->first, point.segment, point.offset, toSegment, toOffset, byMsgid, true, mark, size_t(-1), window);
+		lines.insert(lines.begin(), window.begin(), window.end());
+		if (point.segment < toSegment || (point.segment == toSegment && point.offset < toOffset))
+		{
+			toSegment = point.segment;
+			toOffset = point.offset;
+		}
+	}
+	if (lines.size() > limit)
+		lines.erase(lines.begin(), lines.end() - limit);
+	out.insert(out.end(), lines.begin(), lines.end());
+}
+
+void MessageLog::after(const std::string &channel, bool byMsgid, uint64_t mark, size_t limit, std::vector<LoggedLine> &out)
+{
+	std::map<std::string, LogChannelIndex>::const_iterator it = _index.find(ircLower(channel));
+	if (!_enabled || it == _index.end() || limit == 0)
+		return;
+	pthread_mutex_lock(&_lock);
+	uint32_t toSegment = _writtenSegment, toOffset = _writtenSize;
+	pthread_mutex_unlock(&_lock);
+
+	// last point at or before mark: the lines wanted start in its window
+	const std::vector<LogIndexPoint> &points = it->second.points;
+	size_t low = 0, high = points.size();
+	while (low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if ((byMsgid ? points[middle].msgid : points[middle].time) <= mark)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	const LogIndexPoint &point = points[low ? low - 1 : 0];
+	std::vector<LoggedLine> lines;
+	scan(it->first, point.segment, point.offset, toSegment, toOffset, byMsgid, false, mark, limit, lines);
+	out.insert(out.end(), lines.begin(), lines.end());
+}
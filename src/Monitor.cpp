@@ -0,0 +1,94 @@
+#include "../include/Monitor.hpp"
+#include "../include/Mask.hpp"
+#include "../include/MemoryStats.hpp"
+
+MonitorIndex::MonitorIndex(void)
+: _perClient(MONITOR_MAX), _total(MONITOR_TOTAL_MAX), _size(0)
+{
+}
+
+void MonitorIndex::setLimits(size_t perClient, size_t total)
+{
+	_perClient = perClient;
+	_total = total;
+}
+
+size_t MonitorIndex::getLimit(void) const
+{
+	return _perClient;
+}
+
+bool MonitorIndex::add(int fd, const std::string &nickname)
+{
+	std::string key = ircLower(nickname);
+	List &list = _lists[fd];
+	if (list.count(key))
+		return true;
+	if (list.size() >= _perClient || _size >= _total)
+	{
+		if (list.empty())
+			_lists.erase(fd);
+		return false;
+	}
+	list[key] = nickname;
+	_watchers[key].insert(fd);
+	_size++;
+	return true;
+}
+
+void MonitorIndex::unwatch(int fd, const std::string &key)
+{
+	std::map<std::string, std::set<int> >::iterator it = _watchers.find(key);
+	if (it == _watchers.end())
+		return;
+	it->second.erase(fd);
+	if (it->second.empty())
+		_watchers.erase(it);
+	_size--;
+}
+
+void MonitorIndex::remove(int fd, const std::string &nickname)
+{
+	std::map<int, List>::iterator list = _lists.find(fd);
+	std::string key = ircLower(nickname);
+	if (list == _lists.end() || !list->second.erase(key))
+		return;
+	unwatch(fd, key);
+	if (list->second.empty())
+		_lists.erase(list);
+}
+
+void MonitorIndex::clear(int fd)
+{
+	std::map<int, List>::iterator list = _lists.find(fd);
+	if (list == _lists.end())
+		return;
+	for (List::iterator it = list->second.begin(); it != list->second.end(); it++)
+		unwatch(fd, it->first);
+	_lists.erase(list);
+}
+
+std::vector<std::string> MonitorIndex::list(int fd) const
+{
+	std::vector<std::string> nicknames;
+	std::map<int, List>::const_iterator list = _lists.find(fd);
+	if (list == _lists.end())
+		return nicknames;
+	for (List::const_iterator it = list->second.begin(); it != list->second.end(); it++)
+		nicknames.push_back(it->second);
+	return nicknames;
+}
+
+const std::set<int> *MonitorIndex::watchers(const std::string &nickname) const
+{
+	std::map<std::string, std::set<int> >::const_iterator it = _watchers.find(ircLower(nickname));
+	return it == _watchers.end() ? NULL : &it->second;
+}
+
+// every entry is a set node under its nick and a list node under its watcher
+size_t MonitorIndex::footprint(void) const
+{
+	return _watchers.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const std::string, std::set<int> >))
+		+ _lists.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const int, List>))
+		+ _size * (2 * MAP_NODE_OVERHEAD + sizeof(int) + sizeof(List::value_type));
+}
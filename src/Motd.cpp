@@ -0,0 +1,57 @@
+#include "../include/Motd.hpp"
+#include <fstream>
+#include <sys/stat.h>
+
+Motd::Motd(const std::string &path)
+:_path(path),_mtime(0),_lastCheck(0),_loaded(false)
+{
+	loadDefault();
+	refresh();
+}
+
+void Motd::loadDefault(void) {
+	_lines.clear();
+	_lines.push_back("Welcome to the Internet Relay Network!");
+	_lines.push_back("Please remember to respect the members and follow the rules.");
+	_lines.push_back("Enjoy your stay!");
+}
+
+bool Motd::refresh(void) {
+	time_t now = time(NULL);
+	if (now == _lastCheck)
+		return false;
+	_lastCheck = now;
+
+	struct stat st;
+	if (stat(_path.c_str(), &st) == -1) {
+		if (!_loaded)
+			return false;
+		_loaded = false; // file went away: back to the built-in text
+		_mtime = 0;
+		loadDefault();
+		return true;
+	}
+	if (_loaded && st.st_mtime == _mtime)
+		return false;
+
+	std::ifstream file(_path.c_str());
+	if (!file)
+		return false;
+	std::vector<std::string> lines;
+	std::string line;
+	while (std::getline(file, line)) {
+		if (!line.empty() && line[line.size() - 1] == '\r')
+			line.erase(line.size() - 1);
+		if (line.size() > 400)
+			line.resize(400); // keep every 372 under the 512 bytes limit
+		lines.push_back(line);
+	}
+	_lines.swap(lines);
+	_mtime = st.st_mtime;
+	_loaded = true;
+	return true;
+}
+
+const std::vector<std::string>& Motd::getLines(void) const {
+	return _lines;
+}
@@ -0,0 +1,90 @@
+#include "../include/Reply.hpp"
+#include "../include/server.hpp"
+
+void ReplyArg::print(unsigned long long value, bool negative)
+{
+	char *end = _digits + sizeof(_digits);
+	char *digit = end;
+	do
+		*--digit = '0' + value % 10;
+	while (value /= 10);
+	if (negative)
+		*--digit = '-';
+	_length = end - digit;
+}
+
+// rebuilt on each call, so a copied argument still points at its own digits
+std::string_view ReplyArg::view(void) const
+{
+	if (!_length)
+		return _text;
+	return std::string_view(_digits + sizeof(_digits) - _length, _length);
+}
+
+static char *put(char *out, std::string_view part)
+{
+	std::memcpy(out, part.data(), part.size());
+	return out + part.size();
+}
+
+void Server::reply(int socket, int code, std::initializer_list<ReplyArg> params)
+{
+	writeReply(socket, code, params, NULL);
+}
+
+void Server::reply(int socket, int code, std::initializer_list<ReplyArg> params, std::string_view text)
+{
+	writeReply(socket, code, params, &text);
+}
+
+void Server::writeReply(int socket, int code, std::initializer_list<ReplyArg> params, const std::string_view *text)
+{
+	Client &client = getClient(socket);
+	if (client.getLink() >= 0)
+		return; // numerics only answer local commands
+	std::string_view nickname = *client.getNickname() ? client.getNickname() : "*";
+	char number[3] = { char('0' + code / 100 % 10), char('0' + code / 10 % 10), char('0' + code % 10) };
+
+	size_t size = _prefix.size() + sizeof(number) + 1 + nickname.size() + 2; // prefix ends in a space
+	for (const ReplyArg &param : params)
+		size += 1 + param.view().size();
+	std::string_view trailing = text ? *text : std::string_view();
+	if (text)
+		size += 2 + trailing.size();
+	if (size > IRC_LINE_MAX && text)
+	{
+		size_t cut = std::min(size - IRC_LINE_MAX, trailing.size());
+		size_t keep = trailing.size() - cut;
+		while (keep > 0 && (static_cast<unsigned char>(trailing[keep]) & 0xC0) == 0x80)
+			keep--; // back to the start of the character that would be split
+		size -= trailing.size() - keep;
+		trailing = trailing.substr(0, keep);
+	}
+	size_t length = std::min(size, size_t(IRC_LINE_MAX)); // what still doesn't fit is params
+
+	char line[IRC_LINE_MAX];
+	char *out = size > IRC_LINE_MAX ? line : client.claimOutbound(length); // an overlong one is cut on the side
+	char *start = out;
+	char *limit = out + length - 2;
+	out = put(out, _prefix);
+	out = put(out, std::string_view(number, sizeof(number)));
+	*out++ = ' ';
+	out = put(out, nickname.substr(0, limit - out));
+	for (const ReplyArg &param : params)
+	{
+		if (out < limit)
+			*out++ = ' ';
+		out = put(out, param.view().substr(0, limit - out));
+	}
+	if (text && out + 2 <= limit)
+	{
+		out = put(out, " :");
+		out = put(out, trailing.substr(0, limit - out));
+	}
+	out = put(out, "\r\n");
+	if (start == line) // cut: only now is its length known
+		client.newRawMessage(std::string_view(line, length = out - start));
+	std::cout << CMD_BLUE << ">>>>> Sending into socket " << socket << ": " << CMD_RESET;
+	std::cout.write(start, length - 2) << std::endl;
+	getPollfd(socket).events |= POLLOUT;
+}
@@ -0,0 +1,84 @@
+#include "../include/Serializer.hpp"
+#include <stdexcept>
+
+void Serializer::putU8(uint8_t value)
+{
+	_data += static_cast<char>(value);
+}
+
+void Serializer::putU16(uint16_t value)
+{
+	_data += static_cast<char>(value >> 8);
+	_data += static_cast<char>(value);
+}
+
+void Serializer::putU32(uint32_t value)
+{
+	for (int shift = 24; shift >= 0; shift -= 8)
+		_data += static_cast<char>(value >> shift);
+}
+
+void Serializer::putU64(uint64_t value)
+{
+	putU32(static_cast<uint32_t>(value >> 32));
+	putU32(static_cast<uint32_t>(value));
+}
+
+void Serializer::putString(const std::string &value)
+{
+	putU32(value.size());
+	_data += value;
+}
+
+const std::string& Serializer::data(void) const
+{
+	return _data;
+}
+
+Deserializer::Deserializer(const char *data, size_t size)
+:_data(data),_size(size),_offset(0)
+{
+}
+
+const char *Deserializer::take(size_t size)
+{
+	if (size > _size - _offset)
+		throw std::runtime_error("Truncated state");
+	const char *bytes = _data + _offset;
+	_offset += size;
+	return bytes;
+}
+
+uint8_t Deserializer::getU8(void)
+{
+	return static_cast<uint8_t>(*take(1));
+}
+
+uint16_t Deserializer::getU16(void)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(take(2));
+	return (uint16_t(bytes[0]) << 8) | bytes[1];
+}
+
+uint32_t Deserializer::getU32(void)
+{
+	const unsigned char *bytes = reinterpret_cast<const unsigned char *>(take(4));
+	return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) | (uint32_t(bytes[2]) << 8) | bytes[3];
+}
+
+uint64_t Deserializer::getU64(void)
+{
+	uint64_t high = getU32();
+	return (high << 32) | getU32();
+}
+
+std::string Deserializer::getString(void)
+{
+	uint32_t size = getU32();
+	return std::string(take(size), size);
+}
+
+size_t Deserializer::remaining(void) const
+{
+	return _size - _offset;
+}
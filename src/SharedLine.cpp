@@ -0,0 +1,70 @@
+#include "../include/SharedLine.hpp"
+#include "../include/MemoryStats.hpp"
+#include <cstring>
+#include <new>
+
+SharedLine::SharedLine(size_t size)
+:_refs(1),_size(size)
+{
+}
+
+SharedLine::~SharedLine(void)
+{
+}
+
+SharedLine::SharedLine(const SharedLine &){}
+
+SharedLine& SharedLine::operator=(const SharedLine &){return *this;}
+
+SharedLine *SharedLine::create(std::string_view line)
+{
+	return create({ line });
+}
+
+// a line put together from its parts right in the shared block: no string in between
+SharedLine *SharedLine::create(std::initializer_list<std::string_view> parts)
+{
+	size_t size = 2;
+	for (std::string_view part : parts)
+		size += part.size();
+	void *memory = ::operator new(sizeof(SharedLine) + size);
+	SharedLine *shared = new (memory) SharedLine(size);
+	char *data = reinterpret_cast<char *>(shared + 1);
+	for (std::string_view part : parts)
+	{
+		std::memcpy(data, part.data(), part.size());
+		data += part.size();
+	}
+	std::memcpy(data, "\r\n", 2);
+	MemoryStats::charge(MemLines, shared->footprint());
+	return shared;
+}
+
+void SharedLine::retain(void)
+{
+	_refs++;
+}
+
+void SharedLine::release(void)
+{
+	if (--_refs > 0)
+		return;
+	MemoryStats::release(MemLines, footprint());
+	this->~SharedLine();
+	::operator delete(this);
+}
+
+const char *SharedLine::data(void) const
+{
+	return reinterpret_cast<const char *>(this + 1);
+}
+
+size_t SharedLine::size(void) const
+{
+	return _size;
+}
+
+size_t SharedLine::footprint(void) const
+{
+	return sizeof(SharedLine) + _size;
+}
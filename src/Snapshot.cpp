@@ -0,0 +1,258 @@
+#include "../include/server.hpp"
+#include "../include/Channel.hpp"
+#include "../include/Snapshot.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sstream>
+#include <cstdio>
+
+volatile sig_atomic_t Server::_shutdownSignal = 0;
+
+void Server::requestShutdown(int)
+{
+	_shutdownSignal = 1;
+}
+
+// FNV-1a, chained over several ranges
+static uint32_t checksum(uint32_t h, const char *data, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		h ^= static_cast<unsigned char>(data[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static SnapshotString addString(std::string &pool, const std::string &value)
+{
+	SnapshotString string;
+	string.offset = pool.size();
+	string.length = value.size();
+	pool += value;
+	return string;
+}
+
+// header, records and string pool, ready to be written out as is
+std::string Server::snapshotImage(void) const
+{
+	std::vector<SnapshotRecord> records;
+	std::string strings;
+	records.reserve(_channels.size());
+	for (size_t i = 0; i < _channels.capacity(); i++)
+	{
+		const Channel *channel = _channels.channelAt(i);
+		if (!channel)
+			continue;
+		SnapshotRecord record;
+		std::memset(&record, 0, sizeof(record));
+		record.createdAt = channel->getCreationTime();
+		record.topicTime = channel->getTopicTime();
+		record.modes = channel->getModes();
+		record.limit = channel->getLimit();
+		record.name = addString(strings, channel->getName());
+		record.key = addString(strings, channel->getPass());
+		record.topic = addString(strings, channel->getTopic());
+		std::ostringstream masks;
+		for (int list = 0; list < MaskListCount; list++)
+		{
+			const std::vector<MaskEntry> &entries = channel->getMasks(static_cast<MaskList>(list));
+			for (size_t j = 0; j < entries.size(); j++)
+				masks << "beI"[list] << " " << entries[j].mask.str() << " " << entries[j].setter
+					<< " " << entries[j].time << "\n";
+		}
+		record.masks = addString(strings, masks.str());
+		records.push_back(record);
+	}
+	const char *table = records.empty() ? "" : reinterpret_cast<const char *>(&records[0]);
+	size_t tableSize = records.size() * sizeof(SnapshotRecord);
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.byteOrder = SNAPSHOT_BYTE_ORDER;
+	header.count = records.size();
+	header.stringsOffset = sizeof(header) + tableSize;
+	header.size = header.stringsOffset + strings.size();
+	header.checksum = checksum(checksum(2166136261u, table, tableSize), strings.data(), strings.size());
+
+	std::string image;
+	image.reserve(header.size);
+	image.append(reinterpret_cast<const char *>(&header), sizeof(header));
+	image.append(table, tableSize);
+	image += strings;
+	return image;
+}
+
+/*
+	writes image under the temporary name and renames it over path.
+	runs in the forked child too, so it makes system calls only: nothing
+	in here may allocate.
+*/
+bool Server::writeSnapshotImage(const char *path, const char *temporary, const std::string &image)
+{
+	int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600); // keys are in there
+	if (fd < 0)
+		return false;
+	size_t done = 0;
+	while (done < image.size())
+	{
+		ssize_t written = write(fd, image.data() + done, image.size() - done);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			break;
+		done += written;
+	}
+	bool ok = done == image.size() && fsync(fd) == 0;
+	close(fd);
+	if (!ok || rename(temporary, path) < 0)
+	{
+		unlink(temporary);
+		return false;
+	}
+	return true;
+}
+
+static std::string temporaryPath(const std::string &path)
+{
+	std::ostringstream temporary;
+	temporary << path << ".tmp." << getpid();
+	return temporary.str();
+}
+
+bool Server::writeSnapshot(const std::string &path) const
+{
+	return writeSnapshotImage(path.c_str(), temporaryPath(path).c_str(), snapshotImage());
+}
+
+static bool validString(const SnapshotString &string, uint64_t poolSize)
+{
+	return string.offset <= poolSize && string.length <= poolSize - string.offset;
+}
+
+void Server::loadSnapshot(void)
+{
+	int fd = open(_snapshotPath.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	struct stat st;
+	void *map = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(SnapshotHeader))
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return;
+
+	const char *base = static_cast<const char *>(map);
+	const SnapshotHeader *header = reinterpret_cast<const SnapshotHeader *>(base);
+	uint64_t size = st.st_size;
+	bool valid = !std::memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC))
+		&& header->version == SNAPSHOT_VERSION && header->byteOrder == SNAPSHOT_BYTE_ORDER
+		&& header->size == size && header->count <= (size - sizeof(SnapshotHeader)) / sizeof(SnapshotRecord)
+		&& header->stringsOffset == sizeof(SnapshotHeader) + uint64_t(header->count) * sizeof(SnapshotRecord)
+		&& header->checksum == checksum(2166136261u, base + sizeof(SnapshotHeader), size - sizeof(SnapshotHeader));
+	if (!valid)
+	{
+		std::cerr << CMD_RED << "Ignoring unusable snapshot " << _snapshotPath << CMD_RESET << std::endl;
+		munmap(map, st.st_size);
+		return;
+	}
+
+	const SnapshotRecord *records = reinterpret_cast<const SnapshotRecord *>(base + sizeof(SnapshotHeader));
+	const char *pool = base + header->stringsOffset;
+	uint64_t poolSize = size - header->stringsOffset;
+	size_t loaded = 0;
+	for (uint32_t i = 0; i < header->count; i++)
+	{
+		const SnapshotRecord &record = records[i];
+		if (!validString(record.name, poolSize) || !validString(record.key, poolSize)
+			|| !validString(record.topic, poolSize) || !validString(record.masks, poolSize)
+			|| record.name.length < 2)
+			continue;
+		std::string name(pool + record.name.offset, record.name.length);
+		if (name[0] != '#' || _channels.find(name))
+			continue;
+		Channel *channel = new Channel(name, std::string(pool + record.key.offset, record.key.length), this);
+		channel->setTopic(std::string(pool + record.topic.offset, record.topic.length));
+		channel->setModes(record.modes);
+		channel->setLimit(record.limit);
+		channel->setTimes(record.createdAt, record.topicTime);
+		std::istringstream masks(std::string(pool + record.masks.offset, record.masks.length));
+		std::string list, mask, setter;
+		time_t time;
+		while (masks >> list >> mask >> setter >> time)
+		{
+			size_t index = std::string("beI").find(list);
+			if (list.size() == 1 && index != std::string::npos)
+				channel->addMask(static_cast<MaskList>(index), mask, setter, time);
+		}
+		_channels.insert(name, channel);
+		loaded++;
+	}
+	munmap(map, st.st_size);
+	std::cout << "Restored " << loaded << " channels from " << _snapshotPath << std::endl;
+	if (loaded)
+		_timers.schedule(_restoreTimer, _timers.now() + SNAPSHOT_RESTORE_GRACE);
+}
+
+void Server::dropEmptyRestoredChannels(void)
+{
+	std::vector<Channel *> empty; // removing shifts the registry slots, collect first
+	for (size_t i = 0; i < _channels.capacity(); i++)
+		if (_channels.channelAt(i) && _channels.channelAt(i)->getClientCount() == 0)
+			empty.push_back(_channels.channelAt(i));
+	for (size_t i = 0; i < empty.size(); i++)
+		removeChannelIfEmpty(*empty[i]);
+	if (!empty.empty())
+		std::cout << "Dropped " << empty.size() << " restored channels nobody joined" << std::endl;
+}
+
+// the image is built here and written by a child, the loop keeps going
+void Server::startSnapshot(void)
+{
+	if (_snapshotInterval)
+		_timers.schedule(_snapshotTimer, _timers.now() + _snapshotInterval);
+	if (_snapshotPid > 0)
+		return; // the previous one is still writing
+	std::string image = snapshotImage();
+	std::string temporary = temporaryPath(_snapshotPath);
+	pid_t pid = fork();
+	if (pid < 0)
+	{
+		std::cerr << CMD_RED << "Snapshot: fork: " << strerror(errno) << CMD_RESET << std::endl;
+		return;
+	}
+	if (pid == 0)
+	{
+		for (size_t i = 0; i < _pollfds.size(); i++)
+			close(_pollfds[i].fd); // so closing a client in the parent still ends its connection
+		_exit(writeSnapshotImage(_snapshotPath.c_str(), temporary.c_str(), image) ? 0 : 1);
+	}
+	_snapshotPid = pid;
+}
+
+void Server::reapSnapshot(bool wait)
+{
+	if (_snapshotPid <= 0)
+		return;
+	int status;
+	pid_t done = waitpid(_snapshotPid, &status, wait ? 0 : WNOHANG);
+	if (done == 0)
+		return;
+	if (done > 0 && !(WIFEXITED(status) && WEXITSTATUS(status) == 0))
+		std::cerr << CMD_RED << "Snapshot: writing " << _snapshotPath << " failed" << CMD_RESET << std::endl;
+	_snapshotPid = -1;
+}
+
+// SIGINT / SIGTERM: the state is saved in the foreground, then run() returns
+void Server::saveOnShutdown(void)
+{
+	reapSnapshot(true); // an older snapshot must not be renamed over this one
+	if (writeSnapshot(_snapshotPath))
+		std::cout << "Saved " << _channels.size() << " channels to " << _snapshotPath << std::endl;
+	else
+		std::cerr << CMD_RED << "Snapshot: writing " << _snapshotPath << " failed" << CMD_RESET << std::endl;
+}
@@ -0,0 +1,142 @@
+#include "../include/TimerWheel.hpp"
+
+#define TIMER_MASK (TIMER_SLOTS - 1)
+
+TimerNode::TimerNode(void)
+:prev(this), next(this), expires(0), owner(-1)
+{
+}
+
+TimerNode::TimerNode(const TimerNode &){}
+
+TimerNode& TimerNode::operator=(const TimerNode &){return *this;}
+
+TimerNode::~TimerNode(void)
+{
+	unlink();
+}
+
+bool TimerNode::pending(void) const
+{
+	return next != this;
+}
+
+void TimerNode::unlink(void)
+{
+	prev->next = next;
+	next->prev = prev;
+	prev = this;
+	next = this;
+}
+
+static void pushBack(TimerNode &head, TimerNode &node)
+{
+	node.prev = head.prev;
+	node.next = &head;
+	head.prev->next = &node;
+	head.prev = &node;
+}
+
+TimerWheel::TimerWheel(void)
+:_now(0)
+{
+}
+
+TimerWheel::TimerWheel(const TimerWheel &){}
+
+TimerWheel& TimerWheel::operator=(const TimerWheel &){return *this;}
+
+void TimerWheel::start(unsigned long now)
+{
+	_now = now;
+}
+
+// files the node under the lowest level whose span still covers it
+void TimerWheel::place(TimerNode &node)
+{
+	unsigned long delta = node.expires - _now;
+	int level = 0;
+	while (level < TIMER_LEVELS - 1 && delta >> ((level + 1) * TIMER_LEVEL_BITS))
+		level++;
+	unsigned long expires = node.expires;
+	if (delta >> (TIMER_LEVELS * TIMER_LEVEL_BITS)) // too far out: park it in the last slot reachable
+		expires = _now + (1UL << (TIMER_LEVELS * TIMER_LEVEL_BITS)) - 1;
+	pushBack(_slots[level][(expires >> (level * TIMER_LEVEL_BITS)) & TIMER_MASK], node);
+}
+
+// spreads the current slot of a level over the levels below it
+void TimerWheel::cascade(int level)
+{
+	TimerNode &head = _slots[level][(_now >> (level * TIMER_LEVEL_BITS)) & TIMER_MASK];
+	while (head.next != &head)
+	{
+		TimerNode *node = head.next;
+		node->unlink();
+		place(*node);
+	}
+}
+
+void TimerWheel::schedule(TimerNode &node, unsigned long expires)
+{
+	node.unlink();
+	node.expires = expires > _now ? expires : _now + 1;
+	place(node);
+}
+
+void TimerWheel::cancel(TimerNode &node)
+{
+	node.unlink();
+}
+
+void TimerWheel::advance(unsigned long now)
+{
+	if (ticksUntilNext() < 0) // nothing armed: no need to walk the idle ticks
+		_now = now > _now ? now : _now;
+	while (_now < now)
+	{
+		++_now;
+		for (int level = 1; level < TIMER_LEVELS; level++)
+		{
+			if ((_now >> ((level - 1) * TIMER_LEVEL_BITS)) & TIMER_MASK)
+				break;
+			cascade(level);
+		}
+		TimerNode &head = _slots[0][_now & TIMER_MASK];
+		while (head.next != &head)
+		{
+			TimerNode *node = head.next;
+			node->unlink();
+			pushBack(_expired, *node);
+		}
+	}
+}
+
+TimerNode *TimerWheel::popExpired(void)
+{
+	if (_expired.next == &_expired)
+		return NULL;
+	TimerNode *node = _expired.next;
+	node->unlink();
+	return node;
+}
+
+long TimerWheel::ticksUntilNext(void) const
+{
+	long cascadeIn = TIMER_SLOTS - (_now & TIMER_MASK); // the next time level 1 gets spread
+	for (long ticks = 1; ticks <= cascadeIn; ticks++)
+	{
+		const TimerNode &head = _slots[0][(_now + ticks) & TIMER_MASK];
+		if (head.next != &head)
+			return ticks;
+	}
+	for (int level = 0; level < TIMER_LEVELS; level++)
+		for (int slot = 0; slot < TIMER_SLOTS; slot++)
+			if (_slots[level][slot].next != &_slots[level][slot])
+				return cascadeIn;
+	return -1;
+}
+
+unsigned long TimerWheel::now(void) const
+{
+	return _now;
+}
@@ -0,0 +1,126 @@
+#include "../include/UserIndex.hpp"
+#include "../include/Mask.hpp"
+#include "../include/MemoryStats.hpp"
+#include <algorithm>
+
+static std::string reversed(const std::string &str)
+{
+	return std::string(str.rbegin(), str.rend());
+}
+
+/*
+	the literal part of a mask usable as an index key: its (folded) prefix
+	up to the first wildcard
+*/
+static std::string literalPrefix(const std::string &mask)
+{
+	return ircLower(mask.substr(0, mask.find_first_of("*?")));
+}
+
+UserIndex::UserIndex(void)
+: _hosted(0)
+{
+}
+
+void UserIndex::addTo(Buckets &buckets, const std::string &key, int fd)
+{
+	buckets[ircLower(key)].insert(fd);
+}
+
+bool UserIndex::removeFrom(Buckets &buckets, const std::string &key, int fd)
+{
+	Buckets::iterator it = buckets.find(ircLower(key));
+	if (it == buckets.end() || !it->second.erase(fd))
+		return false;
+	if (it->second.empty())
+		buckets.erase(it);
+	return true;
+}
+
+void UserIndex::collectRange(const Buckets &buckets, const std::string &prefix, std::set<int> &out, size_t cap)
+{
+	for (Buckets::const_iterator it = buckets.lower_bound(prefix);
+		it != buckets.end() && it->first.compare(0, prefix.size(), prefix) == 0; it++)
+	{
+		for (std::set<int>::const_iterator fd = it->second.begin(); fd != it->second.end(); fd++)
+		{
+			if (out.size() >= cap)
+				return;
+			out.insert(*fd);
+		}
+	}
+}
+
+void UserIndex::collectNicknames(const std::string &prefix, std::set<int> &out, size_t cap) const
+{
+	for (std::map<std::string, int>::const_iterator it = _nicknames.lower_bound(prefix);
+		it != _nicknames.end() && it->first.compare(0, prefix.size(), prefix) == 0 && out.size() < cap; it++)
+		out.insert(it->second);
+}
+
+int UserIndex::findNickname(const std::string &nickname) const
+{
+	std::map<std::string, int>::const_iterator it = _nicknames.find(ircLower(nickname));
+	return it == _nicknames.end() ? -1 : it->second;
+}
+
+void UserIndex::setNickname(int fd, const std::string &oldNickname, const std::string &newNickname)
+{
+	if (!oldNickname.empty())
+		_nicknames.erase(ircLower(oldNickname));
+	if (!newNickname.empty())
+		_nicknames[ircLower(newNickname)] = fd;
+}
+
+void UserIndex::setUsername(int fd, const std::string &oldUsername, const std::string &newUsername)
+{
+	if (!oldUsername.empty())
+		removeFrom(_usernames, oldUsername, fd);
+	if (!newUsername.empty())
+		addTo(_usernames, newUsername, fd);
+}
+
+void UserIndex::addHost(int fd, const std::string &host)
+{
+	addTo(_hosts, host, fd);
+	addTo(_reversedHosts, reversed(host), fd);
+	_hosted++;
+}
+
+void UserIndex::removeClient(int fd, const std::string &nickname, const std::string &username, const std::string &host)
+{
+	setNickname(fd, nickname, "");
+	setUsername(fd, username, "");
+	if (removeFrom(_hosts, host, fd))
+		_hosted--;
+	removeFrom(_reversedHosts, reversed(host), fd);
+}
+
+size_t UserIndex::footprint(void) const
+{
+	return _nicknames.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const std::string, int>))
+		+ (_usernames.size() + _hosts.size() + _reversedHosts.size()) * (MAP_NODE_OVERHEAD + sizeof(Buckets::value_type))
+		+ 3 * _hosted * (MAP_NODE_OVERHEAD + sizeof(int));
+}
+
+bool UserIndex::candidates(const std::string &nickMask, const std::string &userMask, const std::string &hostMask,
+	std::set<int> &out, size_t cap) const
+{
+	std::string nickKey = literalPrefix(nickMask);
+	std::string userKey = literalPrefix(userMask);
+	std::string hostKey = literalPrefix(hostMask);
+	std::string hostSuffix = literalPrefix(reversed(hostMask));
+
+	size_t best = std::max(std::max(nickKey.size(), userKey.size()), std::max(hostKey.size(), hostSuffix.size()));
+	if (best == 0)
+		return false;
+	if (best == nickKey.size())
+		collectNicknames(nickKey, out, cap);
+	else if (best == userKey.size())
+		collectRange(_usernames, userKey, out, cap);
+	else if (best == hostKey.size())
+		collectRange(_hosts, hostKey, out, cap);
+	else
+		collectRange(_reversedHosts, hostSuffix, out, cap);
+	return true;
+}
@@ -11,6 +11,7 @@
 /* ************************************************************************** */
 
 #include "../include/server.hpp"
+#include "../include/HotRestart.hpp"
 
 
 
@@ -20,7 +21,7 @@ void arguments_validator(std::string port, std::string password)
 		throw (std::runtime_error("Error: port and password are required"));
 	if (port.find_first_not_of("0123456789") != std::string::npos)
 		throw (std::runtime_error("Error: port must be a number"));
-	if (port.size() > 5 || std::stoi(port) < 1024 || std::stoi(port) > 65535)
+	if (port.size() > 5 || std::atoi(port.c_str()) < 1024 || std::atoi(port.c_str()) > 65535)
 		throw (std::runtime_error("Error: port must be between 1024 and 65535"));
 	if (password.size() < 8)
 		throw (std::runtime_error("Error: password must be at least 8 characters"));
@@ -36,13 +37,16 @@ int main(int ac, char **av)
     }
 	try
 	{
-		if (signal(SIGPIPE, SIG_IGN) == SIG_ERR)
+		if (signal(SIGPIPE, SIG_IGN) == SIG_ERR || signal(SIGUSR2, Server::requestHotRestart) == SIG_ERR
+			|| signal(SIGINT, Server::requestShutdown) == SIG_ERR || signal(SIGTERM, Server::requestShutdown) == SIG_ERR)
 			throw (std::runtime_error("Error: signal"));
 		arguments_validator(av[1], av[2]);
 		int port = std::atoi(av[1]);
 		std::string password = av[2];
+		const char *handoff = getenv(HANDOFF_ENV); // set when started by a hot restart
 
-		Server serv(port, password);
+		Server serv(port, password, handoff ? std::atoi(handoff) : -1);
+		serv.enableHotRestart(av);
 		serv.run();
 	}
 	catch(std::exception &e)
@@ -13,6 +13,7 @@
 #include "../include/server.hpp"
 #include <netdb.h>
 #include "../include/Channel.hpp"
+#include "../include/Snapshot.hpp"
 
 
 void Server::_initCommandHandlers(void)
@@ -21,7 +22,7 @@ void Server::_initCommandHandlers(void)
 	_commandHandlers["NICK"] = &Server::NICK;
 	_commandHandlers["USER"] = &Server::USER;
 	_commandHandlers["PING"] = &Server::PING;
-	_commandHandlers["PONG"] = &Server::PING;
+	_commandHandlers["PONG"] = &Server::PONG;
 	
 	_commandHandlers["LIST"] = &Server::LIST;
 	_commandHandlers["JOIN"] = &Server::JOIN;
@@ -39,16 +40,69 @@ void Server::_initCommandHandlers(void)
 
 	_commandHandlers["TOPIC"] = &Server::TOPIC;
 	_commandHandlers["INVITE"] = &Server::INVITE;
-	_commandHandlers["NOTICE"] = &Server::PRIVMSG;
+	_commandHandlers["NOTICE"] = &Server::NOTICE;
 	_commandHandlers["ISON"] = &Server::ISON;
+	_commandHandlers["MONITOR"] = &Server::MONITOR;
 	_commandHandlers["MODE"] = &Server::MODE;
+	_commandHandlers["NAMES"] = &Server::NAMES;
+	_commandHandlers["CAP"] = &Server::CAP;
+	_commandHandlers["CHATHISTORY"] = &Server::CHATHISTORY;
+	_commandHandlers["SERVER"] = &Server::SERVER;
+	_commandHandlers["STATS"] = &Server::STATS;
 }
 
 
-Server::Server(int port, const std::string &password) : _port(port), _password(password)
+// milliseconds on a clock that never jumps, the timer wheel runs on it
+static unsigned long monotonicMs(void)
 {
-	init_server();
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000UL + ts.tv_nsec / 1000000;
+}
+
+Server::Server(int port, const std::string &password, int handoff)
+: _port(port), _password(password), _motd(MOTD_FILE), _welcomeSize(0),
+_channelListDirty(true), _channelListGeneration(0), _restartPending(false), _restartRequestedAt(0), _snapshotPid(-1),
+_historyBatches(0), _deliveryEpoch(0), _memoryBudget(0), _nextRemoteId(-2)
+{
+	if (_config.load(CONFIG_FILE))
+		std::cout << "Loaded " << CONFIG_FILE << std::endl;
+	_serverName = _config.get("server_name", SERVER_NAME);
+	if (_serverName.empty() || _serverName.find_first_of(" :!@#,*") != std::string::npos)
+		throw std::runtime_error("Invalid server_name: " + _serverName);
+	_prefix = ":" + _serverName + " ";
+	_monitor.setLimits(_config.getNumber("monitor_max", MONITOR_MAX, 0, 10000),
+		_config.getNumber("monitor_total_max", MONITOR_TOTAL_MAX, 0, 100000000));
+	loadLinkConfig();
+	_throttle.configure(_config);
+	ChannelHistory::configure(_config.getNumber("history_lines", HISTORY_LINES, 0, 100000),
+		_config.getNumber("history_memory", HISTORY_MEMORY, 0, 1L << 40));
+	_snapshotPath = _config.get("snapshot_file", SNAPSHOT_FILE);
+	_snapshotInterval = _config.getNumber("snapshot_interval", SNAPSHOT_INTERVAL, 0, 7 * 86400);
+	_memoryBudget = _config.getNumber("memory_budget", MEMORY_BUDGET, 0, 1L << 40);
+	std::string logDir = _config.get("log_dir", ""); // unset: no message log
+	if (!logDir.empty())
+	{
+		_log.open(logDir, _config.getNumber("log_segment_size", LOG_SEGMENT_SIZE, 65536, 1L << 30),
+			_config.getNumber("log_retention", LOG_RETENTION, 0, 10L * 365 * 86400) * 1000ULL);
+		ChannelHistory::setNextMsgid(_log.nextMsgid()); // msgids stay unique across restarts
+		std::cout << "Message log in " << logDir << std::endl;
+	}
+	_timers.start(monotonicMs() / TIMER_TICK_MS);
+	if (handoff >= 0)
+		adoptState(handoff); // channels come with the rest of the state
+	else
+	{
+		loadSnapshot();
+		init_server();
+	}
+	if (_snapshotInterval)
+		_timers.schedule(_snapshotTimer, _timers.now() + _snapshotInterval);
+	for (size_t i = 0; i < _linkConfig.size(); i++)
+		if (_linkConfig[i].connect)
+			_timers.schedule(_linkTimer, _timers.now() + 1);
 	_initCommandHandlers();
+	_initLinkHandlers();
 }
 
 Server::~Server()
@@ -56,6 +110,10 @@ Server::~Server()
 	close(_server_fd);
 	for (size_t i = 0; i < _pollfds.size(); ++i)
 		close(_pollfds[i].fd);
+	for (size_t i = 0; i < _channels.capacity(); i++)
+		delete _channels.channelAt(i); // before the clients, they unregister from their members
+	for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); it++)
+		delete it->second;
 }
 
 void Server::init_server()
@@ -70,6 +128,7 @@ void Server::init_server()
 
 	if (fcntl(_server_fd, F_SETFL, O_NONBLOCK) == -1)
 		throw std::runtime_error("Failed to set socket to non-blocking: " + std::string(strerror(errno)));
+	fcntl(_server_fd, F_SETFD, FD_CLOEXEC); // a hot restart passes it on explicitly
 		
 	struct sockaddr_in address;
 	address.sin_family = AF_INET;
@@ -82,10 +141,7 @@ void Server::init_server()
 	if (listen(_server_fd, SOMAXCONN) < 0)
 		throw std::runtime_error("Failed to listen on socket: " + std::string(strerror(errno)));
 	
-	struct pollfd server_poll_fd;
-	server_poll_fd.fd = _server_fd;
-	server_poll_fd.events = POLLIN | POLLERR | POLLHUP;
-	_pollfds.push_back(server_poll_fd);
+	addPollfd(_server_fd, POLLIN | POLLERR | POLLHUP);
 	
 	std::cout << "Server started on " << "0.0.0.0" << ":" << _port << std::endl;
 }
@@ -94,88 +150,273 @@ void Server::run()
 {
 	while (true)
 	{
-		int pollCount = poll(_pollfds.data(), _pollfds.size(), -1);
+		if (_shutdownSignal)
+			return saveOnShutdown();
+		if (checkHotRestart())
+			return;
+		int pollCount = poll(_pollfds.data(), _pollfds.size(), pollTimeout());
+		if (pollCount < 0 && errno == EINTR)
+			continue;
 		if (pollCount < 0)
 			throw (std::runtime_error("poll"));
+		_timers.advance(monotonicMs() / TIMER_TICK_MS); // due timers fire after the I/O pass
 		if (_pollfds[0].revents & POLLIN)
 			handleNewConnection();
-		for (size_t i = 1; i < _pollfds.size(); ++i)
+		for (size_t i = 1; i < _pollfds.size();)
 		{
+			int fd = _pollfds[i].fd;
 			if (_pollfds[i].revents & (POLLERR | POLLHUP))
-				QUIT(_pollfds[i].fd, "Client disconnected");
+				QUIT(fd, "Client disconnected");
 			else if (_pollfds[i].revents & POLLIN)
-				handleClientMessage(_pollfds[i].fd);
+				handleClientMessage(fd);
 			else if (_pollfds[i].revents & POLLOUT)
-				writeToClient(_pollfds[i].fd);
-			
+				writeToClient(fd);
+			if (i < _pollfds.size() && _pollfds[i].fd == fd) // otherwise it quit and the last entry moved in
+				++i;
 		}
+		expireTimers();
+		reapSnapshot(false);
+		enforceMemoryBudget();
 	}
 }
 
+// wakes up for the next armed timer, or never when none is
+int Server::pollTimeout(void) const
+{
+	long ticks = _timers.ticksUntilNext();
+	if (_restartPending && (ticks < 0 || ticks > 1))
+		ticks = 1; // keep checking whether the streamed replies are done
+	if (ticks < 0)
+		return -1;
+	long wait = static_cast<long>((_timers.now() + ticks) * TIMER_TICK_MS - monotonicMs());
+	return wait > 0 ? static_cast<int>(wait) : 0;
+}
+
+void Server::expireTimers(void)
+{
+	TimerNode *node;
+	while ((node = _timers.popExpired()))
+	{
+		if (node == &_snapshotTimer)
+			startSnapshot();
+		else if (node == &_restoreTimer)
+			dropEmptyRestoredChannels();
+		else if (node == &_linkTimer)
+		{
+			connectLinks();
+			_timers.schedule(_linkTimer, _timers.now() + LINK_RETRY);
+		}
+		else
+			clientTimerExpired(node->owner);
+	}
+}
+
+/*
+CLIENT TIMER:
+	- unregistered: the registration deadline passed, drop it
+	- heard from within PING_INTERVAL: re-arm for the end of that interval
+	- idle: PING it and give it PING_TIMEOUT to send anything
+	- still idle after the PING: drop it
+*/
+void Server::clientTimerExpired(int socket)
+{
+	Client &client = getClient(socket);
+	unsigned long now = _timers.now();
+	if (!client.isRegistered())
+		disconnectClient(socket, "Registration timed out");
+	else if (now - client.getLastActive() < PING_INTERVAL)
+	{
+		client.setFlag(ClientPingSent, false);
+		_timers.schedule(client.getTimer(), client.getLastActive() + PING_INTERVAL);
+	}
+	else if (!client.getFlag(ClientPingSent))
+	{
+		client.setFlag(ClientPingSent, true);
+		sendMessageToClient(socket, "PING :" + _serverName);
+		_timers.schedule(client.getTimer(), now + PING_TIMEOUT);
+	}
+	else
+		disconnectClient(socket, "Ping timeout");
+}
+
 void Server::handleNewConnection()
 {
-	struct sockaddr_in clientAdd;
+	struct sockaddr_storage clientAdd;
 	socklen_t clientLen = sizeof(clientAdd);
 	int client_fd = accept(_server_fd, (struct sockaddr *)&clientAdd, &clientLen);
-	if (client_fd < 0)
-		throw (std::runtime_error("accept"));
+	if (client_fd < 0) // out of fds or the peer already gave up: try again on the next poll
+	{
+		std::cerr << CMD_RED << "accept: " << strerror(errno) << CMD_RESET << std::endl;
+		return;
+	}
+
+	char address[INET6_ADDRSTRLEN];
+	const void *in_addr = clientAdd.ss_family == AF_INET6
+		? (const void *)&((struct sockaddr_in6 *)&clientAdd)->sin6_addr
+		: (const void *)&((struct sockaddr_in *)&clientAdd)->sin_addr;
+	std::string clinet_ip = inet_ntop(clientAdd.ss_family, in_addr, address, sizeof(address)) ? address : "0.0.0.0";
+	if (overMemoryThreshold())
+	{
+		std::string error = "ERROR :Closing Link: " + clinet_ip + " (Server is out of memory, try again later)\r\n";
+		send(client_fd, error.data(), error.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+		close(client_fd);
+		std::cout << CMD_RED << "Refused connection from " << clinet_ip << ": memory budget" << CMD_RESET << std::endl;
+		return;
+	}
+	HostKey host;
+	bool tracked = HostKey::fromSockaddr((struct sockaddr *)&clientAdd, host);
+	ThrottleVerdict verdict = tracked ? _throttle.admit(host, _timers.now()) : ThrottleAdmit;
+	if (verdict != ThrottleAdmit)
+	{
+		std::string error = "ERROR :Closing Link: " + clinet_ip + (verdict == ThrottleTooMany
+			? " (Too many connections from your host)\r\n" : " (Connecting too fast, try again later)\r\n");
+		send(client_fd, error.data(), error.size(), MSG_DONTWAIT | MSG_NOSIGNAL); // best effort, no Client for it
+		close(client_fd);
+		std::cout << CMD_RED << "Refused connection from " << clinet_ip << CMD_RESET << std::endl;
+		return;
+	}
 
-	if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1)
+	if (fcntl(client_fd, F_SETFL, O_NONBLOCK) == -1) // only this connection is lost, the server goes on
 	{
+		std::cerr << CMD_RED << "fcntl: " << clinet_ip << ": " << strerror(errno) << CMD_RESET << std::endl;
+		if (tracked)
+			_throttle.release(host);
 		close(client_fd);
-		throw (std::runtime_error("Failed to set client socket to non-blocking: " + std::string(strerror(errno))));
+		return;
 	}
+	fcntl(client_fd, F_SETFD, FD_CLOEXEC);
 	
-	struct pollfd clientPoll_fd;
-	clientPoll_fd.fd = client_fd;
-	clientPoll_fd.events = POLLIN | POLLERR | POLLHUP;
-	_pollfds.push_back(clientPoll_fd);
-	std::string clinet_ip = inet_ntoa(clientAdd.sin_addr);
-	_clients[client_fd] = new Client(client_fd, clinet_ip, clinet_ip);
+	addPollfd(client_fd, POLLIN | POLLERR | POLLHUP); // the loop in run() visits it before the next poll
+	Client *client = new Client(client_fd, clinet_ip, clinet_ip);
+	_clients[client_fd] = client;
+	_userIndex.addHost(client_fd, client->getHostname());
+	client->setLastActive(_timers.now());
+	_timers.schedule(client->getTimer(), _timers.now() + REGISTRATION_TIMEOUT);
 	std::cout << CMD_YELLOW << "New connection from " << clinet_ip << CMD_RESET << std::endl;
 }
 
 
-Client &Server::getClient(int socket)
+Client *Server::findClient(int socket)
 {
 	std::map<int, Client *>::iterator it = _clients.find(socket);
-	if (it == _clients.end())
-		throw std::runtime_error("Client not found in getClient");
-	return *it->second;
+	return it == _clients.end() ? NULL : it->second;
+}
+
+Client *Server::findClient(const std::string &nickname)
+{
+	int socket = _userIndex.findNickname(nickname);
+	return socket == -1 ? NULL : findClient(socket);
 }
 
-Client &Server::getClient(std::string nickname)
+// for ids the caller knows are there: a miss is a bug, not an answer
+Client &Server::getClient(int socket)
 {
-	std::map<int, Client *>::iterator it = _clients.begin();
-	for (; it != _clients.end() && it->second->getNickname() != nickname; it++)
-		;
-	if (it == _clients.end())
+	Client *client = findClient(socket);
+	if (!client)
 		throw std::runtime_error("Client not found in getClient");
-	return *it->second;
+	return *client;
 }
 
+bool Server::hasClient(int socket) const
+{
+	return _clients.find(socket) != _clients.end();
+}
+
+// remote users (negative ids) only leave the tables: no socket, and their server picks backup operators
 void Server::removeClient(int socket)
 {
 	std::map<int, Client *>::iterator it = _clients.find(socket);
 	if (it != _clients.end())
 	{
+		if (it->second->isRegistered() && !it->second->getFlag(ClientServerLink))
+			notifyWatchers(it->second->getNickname(), "");
+		_monitor.clear(socket);
 		std::vector<Channel *> channels = getClientChannels(socket);
 		for (size_t i = 0; i < channels.size(); i++)
 		{
-			setBackupOperator(*channels[i], getClient(socket), *this);
+			if (socket >= 0)
+				setBackupOperator(*channels[i], getClient(socket), *this);
 			channels[i]->removeClient(socket);
+			removeChannelIfEmpty(*channels[i]);
 		}
+		_userIndex.removeClient(socket, it->second->getNickname(), it->second->getUsername(), it->second->getHostname());
+		HostKey host;
+		if (socket >= 0 && HostKey::fromString(it->second->getIp(), host))
+			_throttle.release(host);
 		delete it->second;
 		_clients.erase(it);
 	}
-	std::vector<pollfd>::iterator it2 = _pollfds.begin();
-	for (; it2 != _pollfds.end() && it2->fd != socket; it2++);
-	if (it2 != _pollfds.end())
-		_pollfds.erase(it2);
+	if (socket < 0)
+		return;
+	removePollfd(socket);
 	std::cout << CMD_YELLOW << "Client disconnected from socket " << socket << CMD_RESET << std::endl;
 	close(socket);
 }
 
+// the server wide maps, recomputed from their sizes: each change to them is too small to charge
+void Server::accountTables(void)
+{
+	MemoryStats::set(MemTables, _clients.size() * (MAP_NODE_OVERHEAD + sizeof(std::pair<const int, Client *>))
+		+ _pollfds.capacity() * sizeof(struct pollfd) + _pollIndex.capacity() * sizeof(int) + _channelList.capacity() * sizeof(ChannelListEntry)
+		+ _userIndex.footprint() + _channels.footprint() + _monitor.footprint());
+}
+
+bool Server::overMemoryThreshold(void) const
+{
+	return _memoryBudget && MemoryStats::total() >= _memoryBudget / 100 * MEMORY_REFUSE_PERCENT;
+}
+
+/*
+MEMORY BUDGET:
+	- past MEMORY_REFUSE_PERCENT of memory_budget, new connections are
+	  refused (see handleNewConnection)
+	- past the budget itself, the clients with the longest send queues
+	  are dropped, largest first, until it fits again. queues under
+	  MEMORY_SHED_MIN are left alone: when the memory is somewhere else,
+	  dropping them would not bring it back
+	- once no send queue is that long, the clients holding the most
+	  unfinished input go next: each is capped at a line, but every one
+	  of them pins a whole buffer block
+	- server links are never dropped for the budget
+*/
+void Server::enforceMemoryBudget(void)
+{
+	accountTables();
+	while (_memoryBudget && MemoryStats::total() > _memoryBudget)
+	{
+		int largest = -1;
+		size_t largestSize = MEMORY_SHED_MIN - 1;
+		bool inbound = false;
+		for (int pass = 0; pass < 2 && largest == -1; pass++)
+		{
+			inbound = pass == 1;
+			if (inbound)
+				largestSize = 0;
+			for (std::map<int, Client *>::iterator it = _clients.begin(); it != _clients.end(); it++)
+			{
+				size_t size = inbound ? it->second->getInboundSize() : it->second->getOutboundSize();
+				if (it->first < 0 || it->second->getFlag(ClientServerLink) || size <= largestSize)
+					continue;
+				largest = it->first;
+				largestSize = size;
+			}
+		}
+		if (largest == -1)
+			return;
+		std::cout << CMD_RED << "Memory budget exceeded, dropping socket " << largest << " with "
+			<< largestSize << " bytes " << (inbound ? "received" : "queued") << CMD_RESET << std::endl;
+		disconnectClient(largest, inbound ? "RecvQ exceeded" : "SendQ exceeded");
+		accountTables();
+	}
+}
+
+void Server::disconnectClient(int socket, const std::string &reason)
+{
+	sendMessageToClient(socket, "ERROR :Closing Link: " + getClient(socket).getHostname() + " (" + reason + ")");
+	writeToClient(socket); // best effort, the socket is closed right after
+	QUIT(socket, reason);
+}
+
 /**
  * @brief Handles the incoming message from a client.
  * 
@@ -190,25 +431,48 @@ void Server::handleClientMessage(int client_fd)
 	char buffer[4096];
 	int read_bytes;
 	Client &client = getClient(client_fd);
-	if ((read_bytes = recv(client_fd, buffer, 4096, 0)) <= 0)
+	if ((read_bytes = recv(client_fd, buffer, 4096, 0)) < 0)
 		return;
-	client.appendToInboundBuffer(std::string(buffer, read_bytes));
+	if (read_bytes == 0) // orderly shutdown from the peer
+		return QUIT(client_fd, "Connection closed");
+	client.setLastActive(_timers.now());
+	client.appendToInboundBuffer(std::string_view(buffer, read_bytes));
 	if (client.inboundReady())
-	{
-		std::vector<std::string> commands = client.getCompleteCommands();
-		processCommands(commands, client_fd);
-	}
+		processCommands(client.getCompleteCommands(), client_fd);
+	if (hasClient(client_fd) && client.inboundOverflow()) // what is left has no line end
+		disconnectClient(client_fd, "Input line too long");
 }
 
 // ctrl +v ctrl +m -> ^M -> \r\n
 pollfd& Server::getPollfd(int socket)
 {
-	for (size_t i = 0; i < _pollfds.size(); ++i)
-	{
-		if (_pollfds[i].fd == socket)
-			return _pollfds[i];
-	}
-	throw std::runtime_error("Pollfd not found in getPollfd");
+	if (socket < 0 || (size_t)socket >= _pollIndex.size() || _pollIndex[socket] < 0)
+		throw std::runtime_error("Pollfd not found in getPollfd");
+	return _pollfds[_pollIndex[socket]];
+}
+
+void Server::addPollfd(int socket, short events)
+{
+	struct pollfd pollFd;
+	pollFd.fd = socket;
+	pollFd.events = events;
+	pollFd.revents = 0;
+	if ((size_t)socket >= _pollIndex.size())
+		_pollIndex.resize(socket + 1, -1);
+	_pollIndex[socket] = _pollfds.size();
+	_pollfds.push_back(pollFd);
+}
+
+// the last entry takes the freed slot, so run() visits it next at the same index
+void Server::removePollfd(int socket)
+{
+	if (socket < 0 || (size_t)socket >= _pollIndex.size() || _pollIndex[socket] < 0)
+		return;
+	size_t slot = _pollIndex[socket];
+	_pollfds[slot] = _pollfds.back();
+	_pollIndex[_pollfds[slot].fd] = slot;
+	_pollfds.pop_back();
+	_pollIndex[socket] = -1;
 }
 
 void Server::writeToClient(int socket)
@@ -216,28 +480,58 @@ void Server::writeToClient(int socket)
 	Client &client = getClient(socket);
 	if (!client.outboundReady())
 		return;
-	std::string data = client.getOutboundBuffer();
+	struct iovec iov[64];
+	size_t count = client.getOutboundBuffer(iov, 64);
 	ssize_t bytes_sent;
-	if ((bytes_sent = send(socket, data.c_str(), data.size(), 0)) == -1)
+	if ((bytes_sent = writev(socket, iov, count)) == -1)
 		return;
 	client.advanceOutboundBuffer(bytes_sent);
+	if (client.getPendingReply() && client.getOutboundSize() < REPLY_LOW_WATER)
+		resumePendingReply(socket);
 	if (!client.outboundReady()) // no more data to send
 		getPollfd(socket).events &= ~POLLOUT; //nand: disable POLLOUT -> POLLIN | POLLERR | POLLHUP
 }
 
 
+// lines for a remote user go down the link it is behind, they carry their target already
 void Server::sendMessageToClient(int client_fd, const std::string &message)
 {
 	Client &client = getClient(client_fd);
+	if (client.getLink() >= 0)
+		return sendMessageToClient(client.getLink(), message);
 	client.newMessage(message);
 	std::cout << CMD_BLUE << ">>>>> Sending into socket " << client_fd << ": " << CMD_RESET << message << std::endl;
 	getPollfd(client_fd).events |= POLLOUT; //or: append
 }
 
 
-std::string Server::prefix(void)
+void Server::sendRawToClient(int client_fd, const std::string &data)
+{
+	Client &client = getClient(client_fd);
+	client.newRawMessage(data);
+	std::cout << CMD_BLUE << ">>>>> Sending into socket " << client_fd << ": " << CMD_RESET << data.size() << " bytes burst" << std::endl;
+	getPollfd(client_fd).events |= POLLOUT;
+}
+
+void Server::sendSharedToClient(int client_fd, SharedLine *line)
+{
+	Client &client = getClient(client_fd);
+	if (client.getLink() >= 0)
+		return sendSharedToClient(client.getLink(), line);
+	client.newSharedMessage(line);
+	std::cout << CMD_BLUE << ">>>>> Sending into socket " << client_fd << ": " << CMD_RESET;
+	std::cout.write(line->data(), line->size() - 2) << std::endl;
+	getPollfd(client_fd).events |= POLLOUT;
+}
+
+MessageLog& Server::getMessageLog(void)
 {
-	return ":ircserv ";
+	return _log;
+}
+
+const std::string& Server::prefix(void) const
+{
+	return _prefix;
 }
 
 void Server::processCommands(std::vector<std::string> commands, int client_fd)
@@ -247,66 +541,138 @@ void Server::processCommands(std::vector<std::string> commands, int client_fd)
 	while (it < commands.end())
 	{
 		std::cout << CMD_GREEN << "<<<<< Received from socket " << client_fd << ": " << CMD_RESET << *it << std::endl;
-		std::string command_name;
-		std::string command_args;
-		std::stringstream ss(*it);
-		ss >> command_name >> std::ws;
+		if (client.getFlag(ClientServerLink))
+		{
+			receiveFromLink(client_fd, *it++);
+			if (!hasClient(client_fd))
+				return; // the link went down
+			continue;
+		}
+		// the line itself becomes the arguments: the command and the spaces after it are cut off in place
+		std::string &command_args = *it;
+		size_t start = std::min(command_args.find_first_not_of(WHITESPACE), command_args.size());
+		size_t end = std::min(command_args.find_first_of(WHITESPACE, start), command_args.size());
+		std::string command_name = command_args.substr(start, end - start);
 		std::transform(command_name.begin(), command_name.end(), command_name.begin(), ::toupper);
-		std::getline(ss, command_args, '\0');
-		if (command_name != "PASS" && !client.isAuthenticated())
-			sendMessageToClient(client_fd, prefix() + "451 : You have not registered");
-		else if (command_name != "PASS" && command_name != "NICK" && command_name != "USER" && !client.isRegistered())
-			sendMessageToClient(client_fd, prefix() + "451 : You have not registered");
+		command_args.erase(0, std::min(command_args.find_first_not_of(WHITESPACE, end), command_args.size()));
+		if (command_name != "PASS" && command_name != "CAP" && command_name != "SERVER" && !client.isAuthenticated())
+			reply(client_fd, 451, {}, "You have not registered");
+		else if (command_name != "PASS" && command_name != "CAP" && command_name != "NICK" && command_name != "USER"
+			&& command_name != "SERVER" && !client.isRegistered())
+			reply(client_fd, 451, {}, "You have not registered");
 		else if (_commandHandlers.find(command_name) == _commandHandlers.end())
-			sendMessageToClient(client_fd, prefix() + "421 " + command_name + " : Unknown command");
+			reply(client_fd, 421, {command_name}, "Unknown command");
 		else if (command_name == "QUIT")
-			QUIT(client_fd, command_args);
+			return QUIT(client_fd, command_args); // the client is gone, drop what followed
 		else
 			(this->*_commandHandlers[command_name])(client_fd, command_args);
+		if (!hasClient(client_fd))
+			return; // refused as a server link
 		++it;
 	}
 }
 
-void Server::createChannel(std::string name,std::string pass, std::string topic)
+Channel &Server::createChannel(const std::string &name, std::string pass, std::string topic)
 {
-	std::string key = name;
-	if (key[0] == '#')
-		key = key.substr(1);
-	for (size_t i = 0; i < key.size(); i++)
-		key[i] = std::tolower(key[i]); // make channel name case-insensitive
-	if (_channels.find(key) != _channels.end())
+	if (_channels.find(name))
 		throw std::runtime_error("Channel already exists");
-	Channel *channel = new Channel(name, pass, this);
-	channel->setTopic(topic);
-	_channels.insert(std::make_pair(key, channel));
+	Channel *channel = new Channel(name, std::move(pass), this);
+	channel->setTopic(std::move(topic));
+	_channels.insert(name, channel); // keyed case-insensitively, without the '#'
+	invalidateChannelList();
+	return *channel;
+}
+
+Channel *Server::findChannel(const std::string &name)
+{
+	return _channels.find(name);
+}
+
+void Server::removeChannelIfEmpty(Channel &channel)
+{
+	if (channel.getClientCount() > 0 || _channels.find(channel.getName()) != &channel)
+		return;
+	_channels.erase(channel.getName());
+	delete &channel;
+	invalidateChannelList();
+}
+
+void Server::invalidateChannelList(void)
+{
+	_channelListDirty = true;
+}
+
+static bool channelListKeyLess(const ChannelListEntry &a, const ChannelListEntry &b)
+{
+	return a.key < b.key;
+}
+
+const std::vector<ChannelListEntry>& Server::getChannelList(void)
+{
+	if (!_channelListDirty)
+		return _channelList;
+	_channelList.clear();
+	_channelList.reserve(_channels.size());
+	for (size_t i = 0; i < _channels.capacity(); i++)
+	{
+		if (!_channels.channelAt(i))
+			continue;
+		Channel &channel = *_channels.channelAt(i);
+		ChannelListEntry entry;
+		entry.key = _channels.keyAt(i);
+		entry.name = channel.getName();
+		entry.topic = channel.getTopic();
+		entry.channel = &channel;
+		entry.users = channel.getClientCount();
+		entry.createdAt = channel.getCreationTime();
+		entry.topicTime = channel.getTopicTime();
+		entry.secret = channel.getMode(ChanSecret);
+		_channelList.push_back(entry);
+	}
+	std::sort(_channelList.begin(), _channelList.end(), channelListKeyLess);
+	_channelListDirty = false;
+	_channelListGeneration++;
+	return _channelList;
 }
 
-Channel &Server::getChannel(std::string name)
+unsigned long Server::getChannelListGeneration(void) const
 {
-	if (name[0] == '#')
-		name = name.substr(1);
-	for (size_t i = 0; i < name.size(); i++)
-		name[i] = std::tolower(name[i]); // make channel name case-insensitive
-	std::map<std::string, Channel *>::iterator it = _channels.find(name);
-	if (it == _channels.end())
-		throw std::runtime_error("Channel not found in getChannel");
-	return *it->second;
+	return _channelListGeneration;
 }
 
+/*
+	called when a client's send queue drained: lets its pending reply
+	(if any) queue the next slice, and drops it once it is finished.
+*/
+void Server::resumePendingReply(int socket)
+{
+	Client &client = getClient(socket);
+	PendingReply *reply = client.getPendingReply();
+	if (reply && reply->resume(*this, socket))
+		client.setPendingReply(NULL);
+}
+
+// a copy: callers part or rename the client while walking it
 std::vector<Channel *> Server::getClientChannels(int socket)
 {
-	std::vector<Channel *> channels;
-	std::map<std::string, Channel *>::iterator it = _channels.begin();
-	for (; it != _channels.end(); it++)
-		if (it->second->hasClient(socket))
-			channels.push_back(it->second);
-	return channels;
+	Client *client = findClient(socket);
+	return client ? client->getChannels() : std::vector<Channel *>();
 }
 
-void Server::sendMessageToClientChannels(int socket, std::string message)
+/*
+	one line for everyone sharing a channel with socket: built once, and
+	the delivery epoch makes a neighbour met in several channels get it
+	only the first time.
+*/
+void Server::sendMessageToClientChannels(int socket, const std::string &message)
 {
 	std::vector<Channel *> channels = getClientChannels(socket);
+	if (channels.empty())
+		return;
+	SharedLine *line = SharedLine::create(message);
+	unsigned long epoch = ++_deliveryEpoch;
 	for (size_t i = 0; i < channels.size(); i++)
-		channels[i]->broadcast(message, socket);
+		channels[i]->sendShared(line, socket, LinksNone, epoch);
+	line->release();
 }
 
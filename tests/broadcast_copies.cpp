@@ -0,0 +1,103 @@
+/*
+	copy-count test for the PRIVMSG-to-channel path: the server runs on a
+	thread of this process, whose operator new counts what is allocated
+	while one PRIVMSG fans out to a channel. the relayed line has to be
+	built once (one SharedLine of its size) and nothing sized like the
+	text may be allocated per recipient: a channel of 1 and a channel of
+	BIG_CHANNEL members must cost the same allocations.
+*/
+
+#define TEST_NAME "broadcast_copies"
+#define TEST_PORT 16667
+#include "harness.hpp"
+#include <atomic>
+#include <new>
+
+#define BIG_CHANNEL 20
+#define TEXT_SIZE 400
+
+static std::atomic<bool>	g_counting(false);
+static std::atomic<size_t>	g_large(0); // allocations of at least TEXT_SIZE bytes
+static std::atomic<size_t>	g_exact(0); // allocations of g_lineSize bytes
+static std::atomic<size_t>	g_lineSize(0);
+
+void *operator new(size_t size)
+{
+	if (g_counting)
+	{
+		if (size >= TEXT_SIZE)
+			g_large++;
+		if (size == g_lineSize)
+			g_exact++;
+	}
+	void *ptr = std::malloc(size ? size : 1);
+	if (!ptr)
+		throw std::bad_alloc();
+	return ptr;
+}
+
+void operator delete(void *ptr) noexcept
+{
+	std::free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+	std::free(ptr);
+}
+
+static void join(int fd, const std::string &channel)
+{
+	sendAll(fd, "JOIN " + channel + "\r\n");
+	waitFor(fd, " 366 ");
+}
+
+// one PRIVMSG to channel, counted until every member got it
+static void measure(int sender, const std::vector<int> &members, const std::string &channel,
+	size_t &large, size_t &exact)
+{
+	std::string text(TEXT_SIZE, 'x');
+	std::string command = "PRIVMSG " + channel + " :" + text + "\r\n";
+	std::string relayed = ":sender!sender@127.0.0.1 PRIVMSG " + channel + " :" + text + "\r\n";
+	g_lineSize = sizeof(SharedLine) + relayed.size();
+	std::string marker = channel + " :x";
+	g_large = 0;
+	g_exact = 0;
+	g_counting = true;
+	sendAll(sender, command);
+	for (size_t i = 0; i < members.size(); i++)
+		waitFor(members[i], marker.c_str());
+	g_counting = false;
+	large = g_large;
+	exact = g_exact;
+}
+
+int main(void)
+{
+	startServer("exempt = 127.0.0.1\nsnapshot_interval = 0\n"); // BIG_CHANNEL + 2 connections at once
+
+	int sender = connectClient("sender");
+	join(sender, "#one");
+	join(sender, "#many");
+	std::vector<int> one(1, connectClient("alone"));
+	join(one[0], "#one");
+	std::vector<int> many;
+	for (int i = 0; i < BIG_CHANNEL; i++)
+	{
+		many.push_back(connectClient("member" + std::to_string(i)));
+		join(many.back(), "#many");
+	}
+	size_t large, exact;
+	measure(sender, many, "#many", large, exact); // warms the pools and the history up
+
+	size_t oneLarge, oneExact, manyLarge, manyExact;
+	measure(sender, one, "#one", oneLarge, oneExact);
+	measure(sender, many, "#many", manyLarge, manyExact);
+	std::printf("PRIVMSG to 1 member: %zu line copies, %zu text-sized allocations\n", oneExact, oneLarge);
+	std::printf("PRIVMSG to %d members: %zu line copies, %zu text-sized allocations\n", BIG_CHANNEL, manyExact, manyLarge);
+	if (oneExact != 1 || manyExact != 1)
+		fail("the relayed line is not built exactly once");
+	if (manyLarge != oneLarge)
+		fail("allocations grow with the number of recipients");
+	finish();
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+/*
+	shared by the tests: each one runs the server on a thread of its own
+	process, in a scratch directory with its own config, and talks to it
+	over loopback. a test defines TEST_NAME and TEST_PORT before
+	including this.
+*/
+
+#include "../include/server.hpp"
+#include <thread>
+#include <cstdio>
+
+#define TEST_PASSWORD "password123"
+
+static char g_directory[] = "/tmp/ircserv_test.XXXXXX";
+
+inline void fail(const char *what)
+{
+	std::fprintf(stderr, TEST_NAME ": %s\n", what);
+	std::fflush(NULL);
+	_exit(1);
+}
+
+// the server never returns from run(), finish() ends the process instead
+inline void startServer(const char *config)
+{
+	signal(SIGPIPE, SIG_IGN);
+	if (!mkdtemp(g_directory) || chdir(g_directory) < 0)
+		fail("mkdtemp");
+	FILE *file = std::fopen(CONFIG_FILE, "w");
+	if (!file)
+		fail(CONFIG_FILE);
+	std::fputs(config, file);
+	std::fclose(file);
+	std::cout.setstate(std::ios::badbit); // the server's per line logging
+	Server *server = new Server(TEST_PORT, TEST_PASSWORD);
+	std::thread([server]() { server->run(); }).detach();
+}
+
+inline void finish(void)
+{
+	std::printf(TEST_NAME ": OK\n");
+	std::fflush(NULL);
+	unlink(CONFIG_FILE);
+	rmdir(g_directory);
+	_exit(0);
+}
+
+inline void sendAll(int fd, const std::string &data)
+{
+	for (size_t sent = 0; sent < data.size();)
+	{
+		ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+		if (n <= 0)
+			fail("send");
+		sent += n;
+	}
+}
+
+// reads until marker went by; a fixed buffer, so waiting allocates nothing
+inline void waitFor(int fd, const char *marker)
+{
+	static char buffer[65536];
+	size_t kept = 0;
+	size_t length = std::strlen(marker);
+	while (true)
+	{
+		ssize_t n = recv(fd, buffer + kept, sizeof(buffer) - kept, 0);
+		if (n <= 0)
+			fail("recv");
+		kept += n;
+		if (memmem(buffer, kept, marker, length))
+			return;
+		if (kept > length) // keep a tail that may hold the start of marker
+		{
+			std::memmove(buffer, buffer + kept - length, length);
+			kept = length;
+		}
+	}
+}
+
+// everything received up to and including marker
+inline std::string readUntil(int fd, const char *marker)
+{
+	std::string received;
+	char buffer[4096];
+	while (received.find(marker) == std::string::npos)
+	{
+		ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+		if (n <= 0)
+			fail("recv");
+		received.append(buffer, n);
+	}
+	return received;
+}
+
+inline int connectSocket(void)
+{
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	std::memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(TEST_PORT);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int attempt = 0; connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0; attempt++)
+	{
+		if (attempt == 50)
+			fail("connect");
+		usleep(100000);
+	}
+	return fd;
+}
+
+inline int connectClient(const std::string &nickname)
+{
+	int fd = connectSocket();
+	sendAll(fd, "PASS " TEST_PASSWORD "\r\nNICK " + nickname + "\r\nUSER " + nickname + " 0 * :test\r\n");
+	waitFor(fd, " 001 ");
+	return fd;
+}
@@ -0,0 +1,43 @@
+/*
+	WHO by mask must only list registered users: a connection that sent
+	PASS and NICK but no USER is already in the user index (its host since
+	accept, its nickname since NICK) and must not show up, whether the
+	mask is answered from the index or by the full scan.
+*/
+
+#define TEST_NAME "who_visibility"
+#define TEST_PORT 16668
+#include "harness.hpp"
+
+static size_t countReplies(const std::string &received, const char *numeric)
+{
+	size_t count = 0;
+	for (size_t at = received.find(numeric); at != std::string::npos; at = received.find(numeric, at + 1))
+		count++;
+	return count;
+}
+
+static void expectWho(int asker, const std::string &mask, size_t expected, const char *what)
+{
+	sendAll(asker, "WHO " + mask + "\r\n");
+	std::string received = readUntil(asker, " 315 ");
+	if (countReplies(received, " 352 ") != expected) // 352 per user listed, the 315 echoes the mask
+		fail(what);
+}
+
+int main(void)
+{
+	startServer("snapshot_interval = 0\n");
+
+	int ghost = connectSocket();
+	sendAll(ghost, "PASS " TEST_PASSWORD "\r\nNICK ghost\r\nLIST\r\n");
+	waitFor(ghost, " 451 "); // NICK went through before this
+	int asker = connectClient("asker");
+
+	expectWho(asker, "*@127.0.0.1", 1, "WHO by host lists an unregistered connection");
+	expectWho(asker, "ghost", 0, "WHO by nickname lists an unregistered connection");
+	expectWho(asker, "gh*", 0, "WHO by nickname mask lists an unregistered connection");
+	expectWho(asker, "*", 1, "WHO * lists an unregistered connection");
+	close(ghost);
+	finish();
+}